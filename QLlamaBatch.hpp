@@ -0,0 +1,273 @@
+#ifndef QLLAMABATCH_HPP
+#define QLLAMABATCH_HPP
+
+#include "common/common.h"
+#include <llama.h>
+
+#include "QLlamaInference.hpp"
+#include "QLlamaGrammarCache.hpp"
+
+#include <QObject>
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonParseError>
+#include <QJsonValue>
+#include <QString>
+
+#include <algorithm>
+#include <vector>
+
+// Runs a JSONL file of prompts through a QLlamaInference and writes one JSONL result per
+// prompt as soon as it finishes, in completion order. Every input line is an object with a
+// "prompt" and optionally "id" (echoed back), "n_predict", "temperature", "top_k", "top_p",
+// "min_p", "repeat_penalty", "grammar", "json_schema" and "timeout_ms". Up to n_in_flight
+// prompts are queued at a time, enough to keep every slot busy without reading the whole file
+// up front. finished() is emitted after the last result, with a summary of throughput and
+// latency percentiles logged.
+class QLlamaBatchRunner : public QObject
+{
+    Q_OBJECT
+
+public:
+    QLlamaBatchRunner(QLlamaInference *inference, const QString &input, const QString &output, qint32 n_in_flight, QObject *parent = nullptr)
+        : QObject(parent)
+        , m_inference(inference)
+        , m_input(input)
+        , m_output(output)
+        , m_n_in_flight(std::max(n_in_flight, 1))
+    {
+    }
+
+    // Returns false if a file cannot be opened; nothing is submitted then.
+    bool start()
+    {
+        if (!m_input.open(QIODevice::ReadOnly))
+        {
+            LOG_TEE("%s: failed to open %s\n", __func__, m_input.fileName().toStdString().c_str());
+            return false;
+        }
+
+        if (!m_output.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        {
+            LOG_TEE("%s: failed to open %s\n", __func__, m_output.fileName().toStdString().c_str());
+            return false;
+        }
+
+        connect(m_inference, &QLlamaInference::tokensGenerated, this, &QLlamaBatchRunner::tokensGenerated);
+        connect(m_inference, &QLlamaInference::generationFinished, this, &QLlamaBatchRunner::generationFinished);
+
+        m_wall.start();
+        fill();
+
+        return true;
+    }
+
+signals:
+    void finished(int code);
+
+private:
+    struct QLlamaBatchJob
+    {
+        QJsonValue id;
+        qint64 line                                 {0};
+        QElapsedTimer t_submit;
+        qint64 t_first_us                           {-1};
+        qint64 t_last_us                            {-1};
+        qint32 n_tokens                             {0};
+    };
+
+    QLlamaInference *m_inference;
+    QFile m_input;
+    QFile m_output;
+    qint32 m_n_in_flight;
+
+    QHash<quint64, QLlamaBatchJob> m_jobs;
+    qint64 m_line                                   {0};
+    qint64 m_n_failed                               {0};
+    qint64 m_n_tokens                               {0};
+    QElapsedTimer m_wall;
+
+    std::vector<qint64> m_latency_us;
+    std::vector<qint64> m_ttft_us;
+    std::vector<qint64> m_itl_us;                   // mean inter-token latency per request
+
+    // Queues input lines until n_in_flight requests are pending or the input is exhausted.
+    void fill()
+    {
+        while (m_jobs.size() < m_n_in_flight && !m_input.atEnd())
+        {
+            const QByteArray line = m_input.readLine().trimmed();
+            ++m_line;
+
+            if (line.isEmpty())
+                continue;
+
+            QJsonParseError error;
+            const QJsonDocument document = QJsonDocument::fromJson(line, &error);
+
+            if (!document.isObject() || !document.object().value("prompt").isString())
+            {
+                write_error(m_line, error.error != QJsonParseError::NoError ? error.errorString() : QString("expected an object with a prompt"));
+                continue;
+            }
+
+            submit(document.object());
+        }
+
+        if (m_jobs.isEmpty() && m_input.atEnd())
+            finish();
+    }
+
+    void submit(const QJsonObject &input)
+    {
+        llama_sampling_params sparams = m_inference->sparams();
+        sparams.temp = input.value("temperature").toDouble(sparams.temp);
+        sparams.top_k = input.value("top_k").toInt(sparams.top_k);
+        sparams.top_p = input.value("top_p").toDouble(sparams.top_p);
+        sparams.min_p = input.value("min_p").toDouble(sparams.min_p);
+        sparams.penalty_repeat = input.value("repeat_penalty").toDouble(sparams.penalty_repeat);
+        sparams.grammar = input.value("grammar").toString(QString::fromStdString(sparams.grammar)).toStdString();
+
+        QLlamaGrammarCache::Grammar grammar;
+
+        if (input.contains("json_schema"))
+        {
+            grammar = QLlamaGrammarCache::instance().schema(QJsonDocument(input.value("json_schema").toObject()).toJson(QJsonDocument::Compact));
+
+            if (!grammar)
+            {
+                write_error(m_line, "json_schema cannot be compiled");
+                return;
+            }
+        }
+
+        QLlamaBatchJob job;
+        job.id = input.value("id");
+        job.line = m_line;
+        job.t_submit.start();
+
+        const quint64 id = m_inference->generate(input.value("prompt").toString(), sparams,
+                                                 input.value("n_predict").toInt(m_inference->params().n_predict),
+                                                 input.value("timeout_ms").toInteger(-1), std::move(grammar));
+
+        if (!id)
+        {
+            write_error(m_line, "the model is not loaded");
+            return;
+        }
+
+        m_jobs.insert(id, job);
+    }
+
+    void tokensGenerated(quint64 id, const QList<llama_token> &tokens, const QString &)
+    {
+        auto job = m_jobs.find(id);
+        if (job == m_jobs.end())
+            return;
+
+        const qint64 t_us = job->t_submit.nsecsElapsed() / 1000;
+
+        if (job->t_first_us < 0)
+            job->t_first_us = t_us;
+
+        job->t_last_us = t_us;
+        job->n_tokens += tokens.size();
+    }
+
+    void generationFinished(quint64 id, QLlamaWorker::StopReason reason, const QString &output)
+    {
+        static const char *const reasons[] = {"eog", "length", "cancelled", "deadline", "error"};
+
+        const auto it = m_jobs.constFind(id);
+        if (it == m_jobs.constEnd())
+            return;
+
+        const QLlamaBatchJob job = it.value();
+        m_jobs.erase(it);
+
+        const qint64 latency_us = job.t_submit.nsecsElapsed() / 1000;
+
+        QJsonObject result;
+        if (!job.id.isUndefined())
+            result["id"] = job.id;
+        result["line"] = job.line;
+        result["output"] = output;
+        result["stop_reason"] = reasons[reason];
+        result["n_tokens"] = job.n_tokens;
+        result["ttft_ms"] = job.t_first_us < 0 ? QJsonValue() : QJsonValue(job.t_first_us / 1000.0);
+        result["latency_ms"] = latency_us / 1000.0;
+        write(result);
+
+        if (reason == QLlamaWorker::StopError)
+        {
+            ++m_n_failed;
+        }
+        else
+        {
+            m_n_tokens += job.n_tokens;
+            m_latency_us.push_back(latency_us);
+
+            if (job.t_first_us >= 0)
+                m_ttft_us.push_back(job.t_first_us);
+            if (job.n_tokens > 1)
+                m_itl_us.push_back((job.t_last_us - job.t_first_us) / (job.n_tokens - 1));
+        }
+
+        fill();
+    }
+
+    void write(const QJsonObject &result)
+    {
+        m_output.write(QJsonDocument(result).toJson(QJsonDocument::Compact) + '\n');
+        m_output.flush();
+    }
+
+    void write_error(qint64 line, const QString &error)
+    {
+        QJsonObject result;
+        result["line"] = line;
+        result["error"] = error;
+        write(result);
+
+        ++m_n_failed;
+    }
+
+    static double percentile_ms(std::vector<qint64> values, double p)
+    {
+        if (values.empty())
+            return 0.0;
+
+        const size_t rank = std::min<size_t>(values.size() - 1, p * values.size());
+        std::nth_element(values.begin(), values.begin() + rank, values.end());
+
+        return values[rank] / 1000.0;
+    }
+
+    void finish()
+    {
+        const double t_s = m_wall.nsecsElapsed() / 1e9;
+
+        LOG_TEE("\n");
+        LOG_TEE("%s: %zu requests done, %lld failed in %.2f s\n", __func__, m_latency_us.size(), (long long) m_n_failed, t_s);
+        LOG_TEE("%s: %lld tokens generated, %.2f tokens/s, %.2f requests/s\n", __func__, (long long) m_n_tokens, t_s > 0 ? m_n_tokens / t_s : 0.0, t_s > 0 ? m_latency_us.size() / t_s : 0.0);
+
+        for (const auto &[name, values] : { std::pair<const char *, const std::vector<qint64> *>{"latency", &m_latency_us},
+                                            std::pair<const char *, const std::vector<qint64> *>{"ttft", &m_ttft_us},
+                                            std::pair<const char *, const std::vector<qint64> *>{"itl", &m_itl_us} })
+        {
+            LOG_TEE("%s: %-8s p50 %9.2f ms  p90 %9.2f ms  p99 %9.2f ms\n", __func__, name,
+                    percentile_ms(*values, 0.50), percentile_ms(*values, 0.90), percentile_ms(*values, 0.99));
+        }
+
+        m_output.close();
+
+        emit finished(m_n_failed ? 1 : 0);
+    }
+};
+
+#endif // QLLAMABATCH_HPP
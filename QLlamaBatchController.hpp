@@ -0,0 +1,205 @@
+#ifndef QLLAMABATCHCONTROLLER_HPP
+#define QLLAMABATCHCONTROLLER_HPP
+
+#include <QtGlobal>
+
+#include <algorithm>
+#include <array>
+#include <vector>
+
+// Picks how many prompt tokens go into each decode. The context fixes n_batch and n_ubatch,
+// but the throughput of a chunk size depends on the prompts and on how many sequences are
+// generating alongside them, so the controller measures it instead.
+//
+// Chunk sizes are powers of two up to n_batch. Every decode the prompts filled to the chunk
+// size updates a moving average of tokens per second for that size, kept apart for batches
+// with and without generating sequences. Now and then a neighbouring size is probed; the
+// controller moves down when the smaller size is about as fast, since generating sequences
+// wait for the whole batch, and up only when the larger one is clearly faster. The margins
+// differ so it does not oscillate between two sizes.
+//
+// Used from the worker thread only.
+class QLlamaBatchController
+{
+public:
+    explicit QLlamaBatchController(qint32 n_batch = 1, qint32 n_ubatch = 1)
+    {
+        reset(n_batch, n_ubatch);
+    }
+
+    // Forgets everything and starts from n_batch, which is what a batch without the controller holds.
+    void reset(qint32 n_batch, qint32 n_ubatch)
+    {
+        n_batch = std::max(n_batch, 1);
+
+        m_sizes.clear();
+        for (qint32 n = std::min(n_min, n_batch); n < n_batch; n *= 2)
+            m_sizes.push_back(n);
+        m_sizes.push_back(n_batch);
+
+        for (Load &load : m_loads)
+        {
+            load = Load();
+            load.stats.assign(m_sizes.size(), Stat());
+            load.current = m_sizes.size() - 1;
+        }
+
+        m_n_ubatch = n_ubatch;
+        m_pending = -1;
+    }
+
+    // The context was recreated with n_ubatch: the chunk sizes stay, their measurements do not.
+    void rebase(qint32 n_ubatch)
+    {
+        for (Load &load : m_loads)
+        {
+            load.stats.assign(m_sizes.size(), Stat());
+            load.since_probe = 0;
+            load.n_stable = 0;
+        }
+
+        m_n_ubatch = n_ubatch;
+        m_pending = -1;
+    }
+
+    // Prompt tokens to add to the next batch. generating is whether it also holds tokens of generating sequences.
+    qint32 next_chunk(bool generating)
+    {
+        Load &load = m_loads[generating];
+
+        m_pending_load = generating;
+        m_pending = load.current;
+
+        if (load.since_probe >= n_period)
+        {
+            const qint32 probe = load.current + (load.probe_up ? 1 : -1);
+
+            load.probe_up = !load.probe_up;
+            load.since_probe = 0;
+
+            if (probe >= 0 && probe < (qint32) m_sizes.size())
+                m_pending = probe;
+        }
+
+        return m_sizes[m_pending];
+    }
+
+    // Records the decode of the batch the last next_chunk() was for, holding n_prompt prompt
+    // tokens out of n_tokens. Returns whether the chunk size changed.
+    bool observe(qint32 n_prompt, qint32 n_tokens, qint64 t_us)
+    {
+        const qint32 i = m_pending;
+        m_pending = -1;
+
+        // A batch the prompts did not fill says nothing about its chunk size.
+        if (i < 0 || n_prompt < m_sizes[i] || t_us <= 0)
+            return false;
+
+        Load &load = m_loads[m_pending_load];
+        Stat &stat = load.stats[i];
+
+        const double tps = n_tokens * 1e6 / t_us;
+        stat.tps = stat.n == 0 ? tps : stat.tps + alpha * (tps - stat.tps);
+        ++stat.n;
+
+        if (i == load.current)
+            ++load.since_probe;
+
+        const qint32 best = pick(load);
+
+        if (best == load.current)
+        {
+            ++load.n_stable;
+            return false;
+        }
+
+        load.current = best;
+        load.since_probe = 0;
+        load.n_stable = 0;
+
+        return true;
+    }
+
+    // The chunk size of the batches seen most, with or without generating sequences.
+    qint32 chunk() const { return m_sizes[dominant().current]; }
+
+    // A better n_ubatch for the context, or 0. Only once the chunk size has settled and is at
+    // least twice as large as n_ubatch, so a decode no longer has to be split, or at most half
+    // of it, so the compute buffers are not sized for tokens that never come.
+    qint32 recommended_n_ubatch() const
+    {
+        const Load &load = dominant();
+
+        if (load.n_stable < n_settled)
+            return 0;
+
+        const qint32 n_ubatch = m_sizes[load.current];
+
+        if (n_ubatch >= 2 * m_n_ubatch || 2 * n_ubatch <= m_n_ubatch)
+            return n_ubatch;
+
+        return 0;
+    }
+
+private:
+    static constexpr qint32 n_min = 32;
+    static constexpr qint32 n_period = 8;           // decodes at the current size between probes
+    static constexpr qint32 n_settled = 64;         // decodes without a change before n_ubatch is worth changing
+    static constexpr double alpha = 0.2;
+    static constexpr double down_margin = 0.97;     // a smaller size is taken if it is at least this fast
+    static constexpr double up_margin = 1.05;       // a larger one only if it is this much faster
+
+    struct Stat
+    {
+        double tps                                  {0.0};
+        qint32 n                                    {0};
+    };
+
+    struct Load
+    {
+        std::vector<Stat> stats;
+        qint32 current                              {0};
+        qint32 since_probe                          {0};
+        qint32 n_stable                             {0};
+        bool probe_up                               {false};
+
+        qint64 n_observed() const
+        {
+            qint64 n = 0;
+            for (const Stat &stat : stats)
+                n += stat.n;
+
+            return n;
+        }
+    };
+
+    std::vector<qint32> m_sizes;
+    std::array<Load, 2> m_loads;                    // without and with generating sequences
+    qint32 m_n_ubatch                               {1};
+    qint32 m_pending                                {-1};
+    bool m_pending_load                             {false};
+
+    const Load &dominant() const
+    {
+        return m_loads[1].n_observed() > m_loads[0].n_observed() ? m_loads[1] : m_loads[0];
+    }
+
+    qint32 pick(const Load &load) const
+    {
+        const qint32 c = load.current;
+        const Stat &current = load.stats[c];
+
+        if (current.n == 0)
+            return c;
+
+        if (c > 0 && load.stats[c - 1].n > 0 && load.stats[c - 1].tps >= down_margin * current.tps)
+            return c - 1;
+
+        if (c + 1 < (qint32) m_sizes.size() && load.stats[c + 1].n > 0 && load.stats[c + 1].tps > up_margin * current.tps)
+            return c + 1;
+
+        return c;
+    }
+};
+
+#endif // QLLAMABATCHCONTROLLER_HPP
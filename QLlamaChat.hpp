@@ -0,0 +1,173 @@
+#ifndef QLLAMACHAT_HPP
+#define QLLAMACHAT_HPP
+
+#include "common/common.h"
+#include <llama.h>
+
+#include <QtGlobal>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Where a message of a chat session sits, both in the rendered template output and in the
+// session's KV cache.
+struct QLlamaChatSpan
+{
+    size_t text_pos     {0}; // offset of the message's first cached character in the rendered chat
+    size_t text_end     {0}; // offset one past its last cached character
+    qint32 pos          {0}; // KV position of the message's first token
+    qint32 n_tokens     {0}; // number of tokens the message occupies in the KV cache
+};
+
+// A chat whose formatted history is resident in a session's KV cache. New messages are
+// rendered together with the history, checked against the text that is already cached and
+// only the part after it is tokenized, so a turn costs O(new message) tokens to decode.
+// When the template renders earlier messages differently once a new one is appended, the
+// turn restarts at the first message that no longer matches and the worker drops the
+// stale cells with llama_kv_cache_seq_rm.
+class QLlamaChatHistory
+{
+public:
+    // Input for one turn: keep the first n_keep session tokens, then decode tokens.
+    struct Turn
+    {
+        qint32 n_keep {0};
+        std::vector<llama_token> tokens;
+    };
+
+    const std::vector<llama_chat_msg> &msgs() const { return m_msgs; }
+    const std::vector<QLlamaChatSpan> &spans() const { return m_spans; }
+
+    // Number of tokens the resident messages occupy.
+    qint32 n_tokens() const { return m_spans.empty() ? 0 : m_spans.back().pos + m_spans.back().n_tokens; }
+
+    // Queues a message; it is rendered and tokenized with the next turn.
+    void add(const std::string &role, const std::string &content)
+    {
+        m_msgs.push_back({role, content});
+    }
+
+    Turn prepare(const llama_model *model, const std::string &tmpl, bool add_ass)
+    {
+        const std::string rendered = ::llama_chat_apply_template(model, tmpl, m_msgs, add_ass);
+
+        // Find the first resident message whose cached text is no longer what the template produces.
+        size_t n_match = 0;
+        while (n_match < m_text.size() && n_match < rendered.size() && m_text[n_match] == rendered[n_match])
+            ++n_match;
+
+        size_t first = m_spans.size();
+        if (n_match < m_text.size())
+        {
+            first = 0;
+            while (first < m_spans.size() && m_spans[first].text_end <= n_match)
+                ++first;
+
+            LOG("%s: template output diverges at message %zu, re-evaluating from there\n", __func__, first);
+        }
+
+        Turn turn;
+        size_t text_pos = first < m_spans.size() ? m_spans[first].text_pos : m_text.size();
+        qint32 pos = first < m_spans.size() ? m_spans[first].pos : n_tokens();
+
+        m_spans.resize(first);
+        m_text.resize(text_pos);
+        turn.n_keep = pos;
+
+        // Tokenize the pending messages one by one so each keeps its own token count. Only
+        // turns with more than one pending message (system prompt, rollback) render prefixes.
+        for (size_t i = first; i < m_msgs.size(); ++i)
+        {
+            size_t text_end = rendered.size();
+
+            if (i + 1 < m_msgs.size())
+            {
+                const std::vector<llama_chat_msg> prefix(m_msgs.begin(), m_msgs.begin() + i + 1);
+                const std::string partial = ::llama_chat_apply_template(model, tmpl, prefix, false);
+
+                // Templates that are not prefix-stable get the remaining text in one span.
+                if (partial.size() >= text_pos && rendered.compare(0, partial.size(), partial) == 0)
+                    text_end = partial.size();
+            }
+
+            const std::string segment = rendered.substr(text_pos, text_end - text_pos);
+            const std::vector<llama_token> tokens = ::llama_tokenize(model, segment, pos == 0, true);
+
+            m_spans.push_back({text_pos, text_end, pos, (qint32) tokens.size()});
+            m_text += segment;
+            turn.tokens.insert(turn.tokens.end(), tokens.begin(), tokens.end());
+
+            text_pos = text_end;
+            pos += tokens.size();
+        }
+
+        return turn;
+    }
+
+    // Records the reply generated for the last turn. n_tokens counts the generated tokens
+    // that made it into content; a trailing end-of-generation token is re-tokenized from the
+    // template with the next turn.
+    void add_reply(const std::string &content, qint32 n_tokens)
+    {
+        const size_t text_pos = m_text.size();
+        const qint32 pos = this->n_tokens();
+
+        m_msgs.push_back({"assistant", content});
+        m_spans.push_back({text_pos, text_pos + content.size(), pos, n_tokens});
+        m_text += content;
+    }
+
+    // Accounts for a context shift that dropped the KV cells [n_keep, n_keep + n_discard).
+    // Messages keep their text but lose the dropped tokens, so later turns neither render
+    // nor decode them again. Returns how many dropped tokens lie past the resident messages,
+    // i.e. in the reply that is being generated.
+    qint32 discard(qint32 n_keep, qint32 n_discard)
+    {
+        const qint32 end = n_keep + n_discard;
+        const qint32 n_resident = n_tokens();
+
+        for (QLlamaChatSpan &span : m_spans)
+        {
+            const qint32 span_end = span.pos + span.n_tokens;
+            const qint32 overlap = std::max(0, std::min(span_end, end) - std::max(span.pos, n_keep));
+
+            span.n_tokens -= overlap;
+            span.pos = span.pos >= end ? span.pos - n_discard : std::min(span.pos, n_keep);
+        }
+
+        return std::max(0, end - std::max(n_keep, n_resident));
+    }
+
+    // Keeps the first n_msgs messages, e.g. for a fork that regenerates a reply. Cached
+    // messages stay cached, so n_tokens() is then the number of tokens the fork shares.
+    void truncate(size_t n_msgs)
+    {
+        if (n_msgs >= m_msgs.size())
+            return;
+
+        m_msgs.resize(n_msgs);
+
+        if (n_msgs < m_spans.size())
+        {
+            m_text.resize(m_spans[n_msgs].text_pos);
+            m_spans.resize(n_msgs);
+        }
+    }
+
+    // Forgets what is cached; the next turn re-evaluates the whole chat.
+    void invalidate()
+    {
+        m_spans.clear();
+        m_text.clear();
+    }
+
+private:
+    std::vector<llama_chat_msg> m_msgs;
+    std::vector<QLlamaChatSpan> m_spans; // one per resident message
+
+    // The rendered chat as far as it is held in the KV cache.
+    std::string m_text;
+};
+
+#endif // QLLAMACHAT_HPP
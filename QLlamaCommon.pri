@@ -0,0 +1,66 @@
+# Engine sources shared by the GUI app (QLlamaCpp.pro) and the batch tool (batch/QLlamaBatch.pro).
+
+CONFIG += c++2b
+
+INCLUDEPATH += $$PWD $$PWD/common $$PWD/llava $$PWD/ggml
+
+SOURCES += \
+    $$PWD/common/build-info.cpp \
+    $$PWD/common/common.cpp \
+    $$PWD/common/console.cpp \
+    $$PWD/common/grammar-parser.cpp \
+    $$PWD/common/json-schema-to-grammar.cpp \
+    $$PWD/common/ngram-cache.cpp \
+    $$PWD/common/sampling.cpp \
+    $$PWD/common/train.cpp \
+    $$PWD/llava/clip.cpp
+
+HEADERS += \
+    $$PWD/QLlamaBatch.hpp \
+    $$PWD/QLlamaBatchController.hpp \
+    $$PWD/QLlamaChat.hpp \
+    $$PWD/QLlamaDetokenizer.hpp \
+    $$PWD/QLlamaEmbedder.hpp \
+    $$PWD/QLlamaGrammarCache.hpp \
+    $$PWD/QLlamaInference.hpp \
+    $$PWD/QLlamaLogWriter.hpp \
+    $$PWD/QLlamaMetrics.hpp \
+    $$PWD/QLlamaModelPool.hpp \
+    $$PWD/QLlamaPrefetch.hpp \
+    $$PWD/QLlamaPrefixTree.hpp \
+    $$PWD/QLlamaPromptCache.hpp \
+    $$PWD/QLlamaSessionStore.hpp \
+    $$PWD/QLlamaThreadTuner.hpp \
+    $$PWD/QLlamaWorker.hpp \
+    $$PWD/common/base64.hpp \
+    $$PWD/common/common.h \
+    $$PWD/common/console.h \
+    $$PWD/common/grammar-parser.h \
+    $$PWD/common/json-schema-to-grammar.h \
+    $$PWD/common/json.hpp \
+    $$PWD/common/log.h \
+    $$PWD/common/ngram-cache.h \
+    $$PWD/common/sampling.h \
+    $$PWD/common/stb_image.h \
+    $$PWD/common/train.h \
+    $$PWD/ggml/ggml-alloc.h \
+    $$PWD/ggml/ggml-backend.h \
+    $$PWD/ggml/ggml-blas.h \
+    $$PWD/ggml/ggml-cann.h \
+    $$PWD/ggml/ggml-cuda.h \
+    $$PWD/ggml/ggml-kompute.h \
+    $$PWD/ggml/ggml-metal.h \
+    $$PWD/ggml/ggml-rpc.h \
+    $$PWD/ggml/ggml-sycl.h \
+    $$PWD/ggml/ggml-vulkan.h \
+    $$PWD/ggml/ggml.h \
+    $$PWD/llava/clip.h \
+    $$PWD/llava/llava.h
+
+unix: LIBS += -L/usr/local/lib -lllama -lllava_shared -lggml
+#win32: LIBS += -LC:\Program Files\Llama\lib -llama -lllava_shared
+
+DISTFILES += \
+    $$PWD/common/CMakeLists.txt \
+    $$PWD/common/build-info.cpp.in \
+    $$PWD/common/cmake/build-info-gen-cpp.cmake
@@ -1,4 +1,4 @@
-QT       += core gui
+QT       += core gui network
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
@@ -8,62 +8,21 @@ CONFIG += c++2b
 # In order to do so, uncomment the following line.
 #DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
 
-INCLUDEPATH += $$PWD/common $$PWD/llava $$PWD/ggml
+include(QLlamaCommon.pri)
 
 SOURCES += \
-    common/build-info.cpp \
-    common/common.cpp \
-    common/console.cpp \
-    common/grammar-parser.cpp \
-    common/json-schema-to-grammar.cpp \
-    common/ngram-cache.cpp \
-    common/sampling.cpp \
-    common/train.cpp \
-    llava/clip.cpp \
     main.cpp \
     mainwindow.cpp
 
 HEADERS += \
-    QLlamaInference.hpp \
-    common/base64.hpp \
-    common/common.h \
-    common/console.h \
-    common/grammar-parser.h \
-    common/json-schema-to-grammar.h \
-    common/json.hpp \
-    common/log.h \
-    common/ngram-cache.h \
-    common/sampling.h \
-    common/stb_image.h \
-    common/train.h \
-    ggml/ggml-alloc.h \
-    ggml/ggml-backend.h \
-    ggml/ggml-blas.h \
-    ggml/ggml-cann.h \
-    ggml/ggml-cuda.h \
-    ggml/ggml-kompute.h \
-    ggml/ggml-metal.h \
-    ggml/ggml-rpc.h \
-    ggml/ggml-sycl.h \
-    ggml/ggml-vulkan.h \
-    ggml/ggml.h \
-    llava/clip.h \
-    llava/llava.h \
+    QLlamaServer.hpp \
+    QLlamaTranscript.hpp \
     mainwindow.h
 
 FORMS += \
     mainwindow.ui
 
-unix: LIBS += -L/usr/local/lib -lllama -lllava_shared -lggml
-#win32: LIBS += -LC:\Program Files\Llama\lib -llama -lllava_shared
-
-
 # Default rules for deployment.
 qnx: target.path = /tmp/$${TARGET}/bin
 else: unix:!android: target.path = /opt/$${TARGET}/bin
 !isEmpty(target.path): INSTALLS += target
-
-DISTFILES += \
-    common/CMakeLists.txt \
-    common/build-info.cpp.in \
-    common/cmake/build-info-gen-cpp.cmake
@@ -0,0 +1,145 @@
+#ifndef QLLAMADETOKENIZER_HPP
+#define QLLAMADETOKENIZER_HPP
+
+#include <llama.h>
+
+#include <QObject>
+
+#include <QList>
+#include <QHash>
+#include <QString>
+#include <QTimer>
+
+#include <algorithm>
+#include <string>
+
+// Turns token pieces into text without splitting UTF-8 sequences. A piece may end in the
+// middle of a multi-byte character (byte-fallback tokens, emoji split over several tokens);
+// those bytes are held back until the piece that completes them arrives.
+class QLlamaDetokenizer
+{
+public:
+    // Returns the text that is complete once piece is appended.
+    QString push(const std::string &piece)
+    {
+        m_bytes += piece;
+
+        const size_t n_complete = complete_utf8(m_bytes);
+        const QString text = QString::fromUtf8(m_bytes.data(), n_complete);
+        m_bytes.erase(0, n_complete);
+
+        return text;
+    }
+
+    // Returns whatever is still held back; an incomplete sequence becomes U+FFFD.
+    QString flush()
+    {
+        const QString text = QString::fromUtf8(m_bytes.data(), m_bytes.size());
+        m_bytes.clear();
+
+        return text;
+    }
+
+    void clear() { m_bytes.clear(); }
+
+private:
+    std::string m_bytes;
+
+    // Length of the longest prefix that does not end in a truncated multi-byte sequence.
+    static size_t complete_utf8(const std::string &bytes)
+    {
+        for (size_t i = 1; i <= 4 && i <= bytes.size(); ++i)
+        {
+            const unsigned char c = bytes[bytes.size() - i];
+
+            // Continuation byte, keep looking for the lead byte.
+            if ((c & 0xC0) == 0x80)
+                continue;
+
+            const size_t n_seq = (c & 0x80) == 0x00 ? 1
+                               : (c & 0xE0) == 0xC0 ? 2
+                               : (c & 0xF0) == 0xE0 ? 3
+                               : (c & 0xF8) == 0xF0 ? 4
+                               : 1;
+
+            return n_seq > i ? bytes.size() - i : bytes.size();
+        }
+
+        return bytes.size();
+    }
+};
+
+// Lives in the GUI thread and coalesces streamed text so views repaint at most once per
+// frame. Text is appended as it arrives through queued signals, which never block the
+// generation thread, and handed on in one textReady per request when the frame timer
+// fires or when a request has buffered max_tokens tokens.
+class QLlamaStreamBuffer : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit QLlamaStreamBuffer(QObject *parent = nullptr)
+        : QObject(parent)
+    {
+        m_timer.setSingleShot(true);
+        m_timer.setTimerType(Qt::PreciseTimer);
+        connect(&m_timer, &QTimer::timeout, this, &QLlamaStreamBuffer::flushAll);
+    }
+
+    void set_frame_ms(qint32 frame_ms = 16)         { m_frame_ms = std::max(frame_ms, 0); }
+    void set_max_tokens(qint32 max_tokens = 64)     { m_max_tokens = std::max(max_tokens, 1); }
+
+public slots:
+    // Matches QLlamaInference::tokensGenerated.
+    void append(quint64 id, const QList<llama_token> &tokens, const QString &text)
+    {
+        QLlamaPendingText &pending = m_pending[id];
+        pending.text += text;
+        pending.n_tokens += tokens.size();
+
+        if (pending.n_tokens >= m_max_tokens)
+        {
+            flush(id);
+            return;
+        }
+
+        // The first text of a frame starts the timer; everything until it fires rides along.
+        if (!m_timer.isActive())
+            m_timer.start(m_frame_ms);
+    }
+
+    // Hands on what is buffered for id right away, e.g. when the request has finished.
+    void flush(quint64 id)
+    {
+        const QLlamaPendingText pending = m_pending.take(id);
+
+        if (!pending.text.isEmpty())
+            emit textReady(id, pending.text);
+    }
+
+    void flushAll()
+    {
+        const QList<quint64> ids = m_pending.keys();
+
+        for (quint64 id : ids)
+            flush(id);
+    }
+
+signals:
+    void textReady(quint64 id, const QString &text);
+
+private:
+    struct QLlamaPendingText
+    {
+        QString text;
+        qint32 n_tokens                             {0};
+    };
+
+    QHash<quint64, QLlamaPendingText> m_pending;
+    QTimer m_timer;
+
+    qint32 m_frame_ms                               {16};
+    qint32 m_max_tokens                             {64};
+};
+
+#endif // QLLAMADETOKENIZER_HPP
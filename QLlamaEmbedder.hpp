@@ -0,0 +1,201 @@
+#ifndef QLLAMAEMBEDDER_HPP
+#define QLLAMAEMBEDDER_HPP
+
+#include "common/common.h"
+#include <llama.h>
+
+#include <QObject>
+
+#include <QList>
+#include <QString>
+#include <QStringList>
+#include <QMetaObject>
+
+#include <algorithm>
+#include <vector>
+
+// Owns an embedding context (embeddings on, n_ubatch == n_batch) and computes sentence
+// embeddings on whatever thread it lives in. Texts from all queued requests are packed into
+// one llama_batch, one seq_id per text, until either the batch or the sequence ids run out;
+// the pooled embedding of every sequence is read back after a single llama_decode.
+class QLlamaEmbedder : public QObject
+{
+    Q_OBJECT
+
+public:
+    QLlamaEmbedder(llama_context *ctx, const gpt_params &params, QObject *parent = nullptr)
+        : QObject(parent)
+        , m_ctx(ctx)
+        , m_model(llama_get_model(ctx))
+        , m_params(params)
+        , m_n_batch(std::max<qint32>(llama_n_batch(ctx), 1))
+        , m_n_seq(std::max<qint32>(llama_n_seq_max(ctx), 1))
+        , m_n_embd(llama_n_embd(m_model))
+        , m_batch(llama_batch_init(m_n_batch, 0, 1))
+    {
+    }
+
+    ~QLlamaEmbedder()
+    {
+        llama_batch_free(m_batch);
+        if (m_ctx) llama_free(m_ctx);
+    }
+
+public slots:
+    void embed(quint64 id, const QStringList &texts)
+    {
+        if (texts.isEmpty())
+        {
+            emit embeddingFinished(id);
+            return;
+        }
+
+        for (qsizetype i = 0; i < texts.size(); ++i)
+        {
+            QLlamaEmbeddingInput input;
+            input.id = id;
+            input.index = i;
+            input.tokens = ::llama_tokenize(m_ctx, texts.at(i).toStdString(), true, true);
+
+            // A sequence has to fit into one batch; without pooling over several batches the tail is cut.
+            if ((qint32) input.tokens.size() > m_n_batch)
+            {
+                LOG_TEE("%s: text %lld of request %llu has %zu tokens, truncating to %d\n", __func__, (long long) i, (unsigned long long) id, input.tokens.size(), m_n_batch);
+                input.tokens.resize(m_n_batch);
+            }
+
+            // Poolings that read the last token expect the SEP/EOS the model was trained with.
+            if (llama_pooling_type(m_ctx) == LLAMA_POOLING_TYPE_LAST && !input.tokens.empty() &&
+                input.tokens.back() != llama_token_eos(m_model) && (qint32) input.tokens.size() < m_n_batch)
+            {
+                input.tokens.push_back(llama_token_eos(m_model));
+            }
+
+            input.last = i == texts.size() - 1;
+            m_queue.push_back(std::move(input));
+        }
+
+        schedule();
+    }
+
+signals:
+    // Embeddings for texts [first, first + embeddings.size()) of a request, normalized with embd_normalize.
+    void embeddingsReady(quint64 id, qint32 first, const QList<QList<float>> &embeddings);
+    void embeddingFinished(quint64 id);
+
+private:
+    struct QLlamaEmbeddingInput
+    {
+        quint64 id                                  {0};
+        qint32 index                                {0};
+        std::vector<llama_token> tokens;
+        bool last                                   {false};
+    };
+
+    llama_context *m_ctx                            {nullptr};
+    const llama_model *m_model                      {nullptr};
+    gpt_params m_params;
+
+    qint32 m_n_batch                                {0};
+    qint32 m_n_seq                                  {0};
+    qint32 m_n_embd                                 {0};
+    llama_batch m_batch;
+
+    std::vector<QLlamaEmbeddingInput> m_queue;
+    size_t m_queue_head                             {0};
+    bool m_step_scheduled                           {false};
+
+    void schedule()
+    {
+        if (m_step_scheduled || m_queue_head == m_queue.size())
+            return;
+
+        m_step_scheduled = true;
+        QMetaObject::invokeMethod(this, &QLlamaEmbedder::step, Qt::QueuedConnection);
+    }
+
+    // Decodes one packed batch and emits its results; re-posts itself while inputs are queued,
+    // so new requests are picked up between batches.
+    void step()
+    {
+        m_step_scheduled = false;
+
+        llama_batch_clear(m_batch);
+
+        const size_t first = m_queue_head;
+        qint32 n_seq = 0;
+
+        while (m_queue_head < m_queue.size() && n_seq < m_n_seq)
+        {
+            const QLlamaEmbeddingInput &input = m_queue[m_queue_head];
+
+            if (m_batch.n_tokens + (qint32) input.tokens.size() > m_n_batch)
+                break;
+
+            for (size_t i = 0; i < input.tokens.size(); ++i)
+                llama_batch_add(m_batch, input.tokens[i], i, { n_seq }, i == input.tokens.size() - 1);
+
+            ++n_seq;
+            ++m_queue_head;
+        }
+
+        // Every sequence starts at position 0 again.
+        llama_kv_cache_clear(m_ctx);
+
+        const bool ok = m_batch.n_tokens == 0 || llama_decode(m_ctx, m_batch) == 0;
+
+        if (!ok)
+            LOG_TEE("%s: llama_decode failed for a batch of %d sequences\n", __func__, n_seq);
+
+        QList<QList<float>> embeddings;
+        std::vector<float> normalized(m_n_embd);
+        qint32 i_out = -1;
+
+        for (size_t i = first; i < m_queue_head; ++i)
+        {
+            const QLlamaEmbeddingInput &input = m_queue[i];
+            const llama_seq_id seq = i - first;
+
+            i_out += input.tokens.size();
+
+            QList<float> embedding;
+
+            if (ok && !input.tokens.empty())
+            {
+                // Without pooling, the last token's embedding stands for the sequence.
+                const float *embd = llama_pooling_type(m_ctx) == LLAMA_POOLING_TYPE_NONE
+                                        ? llama_get_embeddings_ith(m_ctx, i_out)
+                                        : llama_get_embeddings_seq(m_ctx, seq);
+
+                if (embd)
+                {
+                    llama_embd_normalize(embd, normalized.data(), m_n_embd, m_params.embd_normalize);
+                    embedding = QList<float>(normalized.begin(), normalized.end());
+                }
+            }
+
+            embeddings.append(embedding);
+
+            // One signal per request per batch.
+            if (i + 1 == m_queue_head || m_queue[i + 1].id != input.id)
+            {
+                emit embeddingsReady(input.id, input.index - embeddings.size() + 1, embeddings);
+                embeddings.clear();
+            }
+
+            if (input.last)
+                emit embeddingFinished(input.id);
+        }
+
+        // Drop the consumed inputs once they make up most of the queue.
+        if (m_queue_head * 2 >= m_queue.size())
+        {
+            m_queue.erase(m_queue.begin(), m_queue.begin() + m_queue_head);
+            m_queue_head = 0;
+        }
+
+        schedule();
+    }
+};
+
+#endif // QLLAMAEMBEDDER_HPP
@@ -0,0 +1,156 @@
+#ifndef QLLAMAGRAMMARCACHE_HPP
+#define QLLAMAGRAMMARCACHE_HPP
+
+#include "common/common.h"
+#include "common/grammar-parser.h"
+#include "common/json-schema-to-grammar.h"
+#include <llama.h>
+
+#include <QByteArray>
+#include <QCache>
+#include <QCryptographicHash>
+#include <QMutex>
+#include <QMutexLocker>
+
+#include <string.h>
+#include <algorithm>
+#include <exception>
+#include <memory>
+#include <string>
+
+// A parsed grammar together with a llama_grammar in its initial state. Sampling contexts
+// start from a llama_grammar_copy() of it instead of parsing and initialising the grammar.
+struct QLlamaGrammar
+{
+    grammar_parser::parse_state parsed;
+    llama_grammar *initial                          {nullptr};
+
+    QLlamaGrammar() = default;
+    QLlamaGrammar(const QLlamaGrammar &) = delete;
+    QLlamaGrammar &operator=(const QLlamaGrammar &) = delete;
+
+    ~QLlamaGrammar()
+    {
+        if (initial) llama_grammar_free(initial);
+    }
+};
+
+// Process-wide cache of compiled grammars, keyed by a hash of the GBNF text or JSON schema
+// they were compiled from. Requests hold a shared_ptr, so evicting an entry never frees a
+// grammar that is still being sampled with. Sources that fail to compile are cached as
+// nullptr, so a client that keeps sending the same broken one does not recompile it each time.
+class QLlamaGrammarCache
+{
+public:
+    using Grammar = std::shared_ptr<const QLlamaGrammar>;
+
+    static QLlamaGrammarCache &instance()
+    {
+        static QLlamaGrammarCache cache;
+        return cache;
+    }
+
+    QLlamaGrammarCache(const QLlamaGrammarCache &) = delete;
+    QLlamaGrammarCache &operator=(const QLlamaGrammarCache &) = delete;
+
+    // Returns nullptr if the grammar does not parse or has no root rule.
+    Grammar grammar(const std::string &gbnf)
+    {
+        const QByteArray key = key_for("gbnf", QByteArray::fromStdString(gbnf));
+
+        Grammar cached;
+        if (find(key, cached))
+            return cached;
+
+        return insert(key, compile(gbnf));
+    }
+
+    // Converts a JSON schema with json_schema_to_grammar, then compiles the result.
+    Grammar schema(const QByteArray &schema)
+    {
+        const QByteArray key = key_for("schema", schema);
+
+        Grammar cached;
+        if (find(key, cached))
+            return cached;
+
+        std::string gbnf;
+
+        try
+        {
+            gbnf = json_schema_to_grammar(nlohmann::ordered_json::parse(schema.constData(), schema.constData() + schema.size()));
+        }
+        catch (const std::exception &e)
+        {
+            LOG_TEE("%s: failed to convert JSON schema: %s\n", __func__, e.what());
+            return insert(key, nullptr);
+        }
+
+        return insert(key, compile(gbnf));
+    }
+
+    void set_max_grammars(qint32 max_grammars = 64)
+    {
+        QMutexLocker locker(&m_mutex);
+        m_grammars.setMaxCost(std::max(max_grammars, 1));
+    }
+
+private:
+    QMutex m_mutex;
+    QCache<QByteArray, Grammar> m_grammars          {64};
+
+    QLlamaGrammarCache() = default;
+
+    static QByteArray key_for(const char *kind, const QByteArray &source)
+    {
+        QCryptographicHash hash(QCryptographicHash::Sha256);
+        hash.addData(kind, strlen(kind) + 1);
+        hash.addData(source);
+
+        return hash.result();
+    }
+
+    // False if key is not cached; grammar is nullptr if it is cached as a failure.
+    bool find(const QByteArray &key, Grammar &grammar)
+    {
+        QMutexLocker locker(&m_mutex);
+
+        const Grammar *cached = m_grammars.object(key);
+        if (!cached)
+            return false;
+
+        grammar = *cached;
+        return true;
+    }
+
+    Grammar insert(const QByteArray &key, Grammar grammar)
+    {
+        QMutexLocker locker(&m_mutex);
+        m_grammars.insert(key, new Grammar(grammar));
+
+        return grammar;
+    }
+
+    static Grammar compile(const std::string &gbnf)
+    {
+        auto grammar = std::make_shared<QLlamaGrammar>();
+        grammar->parsed = grammar_parser::parse(gbnf.c_str());
+
+        // rules is left empty on parse errors.
+        if (grammar->parsed.rules.empty() || !grammar->parsed.symbol_ids.count("root"))
+        {
+            LOG_TEE("%s: failed to parse grammar\n", __func__);
+            return nullptr;
+        }
+
+        std::vector<const llama_grammar_element *> rules = grammar->parsed.c_rules();
+        grammar->initial = llama_grammar_init(rules.data(), rules.size(), grammar->parsed.symbol_ids.at("root"));
+
+        if (!grammar->initial)
+            return nullptr;
+
+        return grammar;
+    }
+};
+
+#endif // QLLAMAGRAMMARCACHE_HPP
@@ -7,12 +7,23 @@
 #include "common/common.h"
 #include <llama.h>
 
+#include "QLlamaWorker.hpp"
+#include "QLlamaEmbedder.hpp"
+#include "QLlamaChat.hpp"
+#include "QLlamaModelPool.hpp"
+#include "QLlamaPrefetch.hpp"
+#include "QLlamaMetrics.hpp"
+#include "QLlamaThreadTuner.hpp"
+
 #include <QObject>
 
 #include <QList>
+#include <QStringList>
+#include <QHash>
 #include <QFile>
-#include <QCoreApplication>
-#include <QTextStream>
+#include <QThread>
+#include <QTimer>
+#include <QElapsedTimer>
 
 #include <string.h>
 #include <exception>
@@ -58,12 +69,44 @@ namespace QLlamaExceptions
     private:        
         char wut[512] = {0};
     };
+
+    class QModelLoadError : std::exception
+    {
+    public:
+        QModelLoadError(const QString &func, const QString &model)
+        {
+            QString qWut = func + ": error: failed to load model " + model + "\n";
+
+            for (int i = 0; i < qWut.size() && i < 511; ++i)
+                wut[i] = qWut.at(i).toLatin1();
+        }
+
+        const char *what() const throw() override
+        {
+            return wut;
+        }
+
+    private:
+        char wut[512] = {0};
+    };
 }
 
-class QLlamaInference : QObject
+class QLlamaInference : public QObject
 {
     Q_OBJECT
 
+    // Refreshed every metrics interval; throughputs are averages over the last interval.
+    Q_PROPERTY(double promptTokensPerSecond READ promptTokensPerSecond NOTIFY metricsChanged)
+    Q_PROPERTY(double generatedTokensPerSecond READ generatedTokensPerSecond NOTIFY metricsChanged)
+    Q_PROPERTY(double timeToFirstTokenMs READ timeToFirstTokenMs NOTIFY metricsChanged)
+    Q_PROPERTY(double interTokenLatencyMs READ interTokenLatencyMs NOTIFY metricsChanged)
+    Q_PROPERTY(qint32 activeSequences READ activeSequences NOTIFY metricsChanged)
+    Q_PROPERTY(qint32 queuedSequences READ queuedSequences NOTIFY metricsChanged)
+    Q_PROPERTY(qint32 kvCellsUsed READ kvCellsUsed NOTIFY metricsChanged)
+    Q_PROPERTY(quint64 kvDefragCount READ kvDefragCount NOTIFY metricsChanged)
+    Q_PROPERTY(qint32 batchChunkTokens READ batchChunkTokens NOTIFY metricsChanged)
+    Q_PROPERTY(qint32 ubatchTokens READ ubatchTokens NOTIFY metricsChanged)
+
 public:
     QLlamaInference(gpt_params *p = nullptr, QObject *parent = nullptr)
         : QObject(parent)
@@ -79,25 +122,344 @@ public:
 
             std::mt19937 rng(m_params.seed);
         }
+
+        qRegisterMetaType<QLlamaWorker::StopReason>();
+        qRegisterMetaType<QList<QLlamaCandidate>>();
+        m_thread.setObjectName("QLlamaWorker");
+        m_embd_thread.setObjectName("QLlamaEmbedder");
+
+        connect(&m_metrics_timer, &QTimer::timeout, this, &QLlamaInference::update_metrics);
     }
 
     ~QLlamaInference()
     {
+        if (m_loader)
+        {
+            cancelLoad();
+            m_loader->wait();
+            delete m_loader;
+        }
+
+        // Loaded, but the worker was never started.
+        if (!m_worker && m_ctx) llama_free(m_ctx);
+        if (!m_worker && m_ctx_draft) llama_free(m_ctx_draft);
+        if (!m_embedder && m_ctx_embd) llama_free(m_ctx_embd);
+
+        m_embd_thread.quit();
+        m_embd_thread.wait();
+
+        // The embedder owns m_ctx_embd and frees it.
+        delete m_embedder;
+
+        cancelAll();
+        m_thread.quit();
+        m_thread.wait();
+
+        // Drains the log queue; the writer still reads the model.
+        m_log_writer.reset();
+
+        // The worker owns its context and frees it.
+        delete m_worker;
+
         if (m_ctx_guidance) llama_free(m_ctx_guidance);
-        if (m_ctx) llama_free(m_ctx);
-        if (m_model) llama_free_model(m_model);
         //if (m_ctx_sampling) llama_sampling_free(m_ctx_sampling);
-        llama_backend_free();
+
+        // The weights go back to QLlamaModelPool, which keeps them while anyone else uses them.
+        m_model_draft_ref.reset();
+        m_model_ref.reset();
     }
 
     llama_model *model()            { return m_model; }
-    llama_context * ctx()           { return m_ctx; }
+    // There is no ctx(): once loaded, the context belongs to the worker's thread, which may
+    // recreate it with another n_ubatch.
     gpt_params params()             { return m_params; }
     llama_sampling_params sparams() { return m_sparams; }
     int n_ctx_train()               { return m_n_ctx_train; }
     int n_ctx()                     { return m_n_ctx; }
 
-    QList<llama_chat_msg> &chat_msgs() { return m_chat_msgs; }
+    // Loads the model and hands the context to a worker thread. Blocks until the weights are
+    // loaded, unless another instance already holds the same model in QLlamaModelPool.
+    void load() noexcept(false)
+    {
+        if (m_worker || m_loader)
+            return;
+
+        m_load_cancelled.store(false, std::memory_order_relaxed);
+
+        if (!load_model())
+            throw QLlamaExceptions::QModelLoadError(QString::fromLatin1(__func__), QString::fromStdString(m_params.model));
+
+        start_worker();
+    }
+
+    // Like load(), but returns immediately and reports through loadProgress and loadFinished.
+    // The params must not be changed until loadFinished has been emitted.
+    void loadAsync()
+    {
+        if (m_worker || m_loader)
+            return;
+
+        m_load_cancelled.store(false, std::memory_order_relaxed);
+
+        m_loader = QThread::create([this]() { m_load_ok = load_model(); });
+        m_loader->setObjectName("QLlamaLoader");
+
+        connect(m_loader, &QThread::finished, this, [this]() {
+            m_loader->deleteLater();
+            m_loader = nullptr;
+
+            if (m_load_ok)
+                start_worker();
+
+            emit loadFinished(m_load_ok);
+        });
+
+        m_loader->start();
+    }
+
+    // Aborts a running loadAsync(); loadFinished(false) follows.
+    void cancelLoad() { m_load_cancelled.store(true, std::memory_order_relaxed); }
+
+    bool isLoading() const { return m_loader != nullptr; }
+    bool isLoaded() const { return m_worker != nullptr; }
+
+    // Sessions pin a conversation to one of the n_parallel sequences so its KV cache survives
+    // between requests. Up to n_parallel sessions decode concurrently in one batch.
+    quint64 openSession() { return ++m_last_session_id; }
+
+    void closeSession(quint64 session)
+    {
+        m_chats.remove(session);
+        m_session_priorities.remove(session);
+
+        if (!m_worker || !session)
+            return;
+
+        QLlamaWorker *worker = m_worker;
+        QMetaObject::invokeMethod(worker, [worker, session]() { worker->releaseSession(session); }, Qt::QueuedConnection);
+    }
+
+    // Branches a session, e.g. to regenerate a reply or to compare two answers. The new session
+    // starts with the first n_msgs chat messages (all with -1), or the whole token history of a
+    // session that is not a chat, and shares their KV cells with the original: only tokens
+    // decoded after the fork cost new cells. Returns 0 while a reply for session is pending.
+    quint64 forkSession(quint64 session, qint32 n_msgs = -1)
+    {
+        if (!m_worker || !session)
+            return 0;
+
+        for (const QLlamaChatReply &reply : std::as_const(m_chat_replies))
+            if (reply.session == session) return 0;
+
+        const quint64 fork = openSession();
+        qint32 n_keep = -1;
+
+        if (m_session_priorities.contains(session))
+            m_session_priorities.insert(fork, m_session_priorities.value(session));
+
+        if (m_chats.contains(session))
+        {
+            QLlamaChatHistory history = m_chats.value(session);
+            if (n_msgs >= 0) history.truncate(n_msgs);
+
+            n_keep = history.n_tokens();
+            m_chats.insert(fork, history);
+        }
+
+        QLlamaWorker *worker = m_worker;
+        QMetaObject::invokeMethod(worker, [worker, session, fork, n_keep]() { worker->forkSession(session, fork, n_keep); }, Qt::QueuedConnection);
+
+        return fork;
+    }
+
+    // Queues a completion on the worker thread and returns its id. A negative timeout means no deadline.
+    quint64 generate(const QString &prompt, qint64 timeout_ms = -1, quint64 session = 0)
+    {
+        if (!m_worker)
+            return 0;
+
+        QLlamaRequest request = make_request(session, timeout_ms);
+        request.prompt = prompt;
+
+        return submit(request);
+    }
+
+    // Like generate(), with sampling parameters and a token limit of its own. A compiled grammar
+    // takes the place of sparams.grammar.
+    quint64 generate(const QString &prompt, const llama_sampling_params &sparams, qint32 n_predict, qint64 timeout_ms = -1,
+                     QLlamaGrammarCache::Grammar grammar = nullptr, quint64 session = 0)
+    {
+        if (!m_worker)
+            return 0;
+
+        QLlamaRequest request = make_request(session, timeout_ms);
+        request.prompt = prompt;
+        request.sparams = sparams;
+        request.n_predict = n_predict;
+        request.grammar = std::move(grammar);
+
+        return submit(request);
+    }
+
+    // Requests of a session with a higher priority are admitted first and may preempt running
+    // requests of a lower priority, which resume later where they stopped. Requests without a
+    // session priority get the one set with set_priority().
+    void setSessionPriority(quint64 session, qint32 priority) { m_session_priorities.insert(session, priority); }
+
+    // Adds a message to a chat session without generating; it is evaluated with the next turn.
+    void addChatMessage(quint64 session, const QString &role, const QString &content)
+    {
+        m_chats[session].add(role.toStdString(), content.toStdString());
+    }
+
+    // Sends a user message and generates the assistant's reply. Only the tokens that are not
+    // already in the session's KV cache are decoded. Returns 0 while a reply is still pending.
+    quint64 chat(quint64 session, const QString &content, qint64 timeout_ms = -1)
+    {
+        return chat_turn(make_request(session, timeout_ms), content);
+    }
+
+    // Generates n completions of prompt for reranking. The prompt is evaluated once and shared by
+    // all of them; they are then decoded together, one token each per batch. Without beam, every
+    // candidate is sampled independently (n-best); with beam, a beam search keeps the n most
+    // likely continuations. Needs n <= n_parallel. Results arrive through candidatesReady.
+    quint64 generateCandidates(const QString &prompt, qint32 n, bool beam = false, qint64 timeout_ms = -1)
+    {
+        if (!m_worker || n < 1)
+            return 0;
+
+        QLlamaRequest request = make_request(0, timeout_ms);
+        request.prompt = prompt;
+        request.n_candidates = n;
+        request.beam = beam;
+
+        return submit(request);
+    }
+
+    // Goes on generating where session stopped, with the sampler and grammar state it stopped
+    // with (or that it was forked with).
+    quint64 resume(quint64 session, qint64 timeout_ms = -1)
+    {
+        if (!m_worker || !session)
+            return 0;
+
+        QLlamaRequest request = make_request(session, timeout_ms);
+        request.resume_sampling = true;
+
+        return submit(request);
+    }
+
+    // Generates the assistant's reply to the messages added so far without adding one, e.g.
+    // in a session forked right after a user message.
+    quint64 reply(quint64 session, qint64 timeout_ms = -1)
+    {
+        return chat_turn(make_request(session, timeout_ms), QString());
+    }
+
+    // Like reply(), with sampling parameters and a token limit of its own.
+    quint64 reply(quint64 session, const llama_sampling_params &sparams, qint32 n_predict, qint64 timeout_ms = -1,
+                  QLlamaGrammarCache::Grammar grammar = nullptr)
+    {
+        QLlamaRequest request = make_request(session, timeout_ms);
+        request.sparams = sparams;
+        request.n_predict = n_predict;
+        request.grammar = std::move(grammar);
+
+        return chat_turn(request, QString());
+    }
+
+    // Like generate(), but the output is constrained to JSON matching schema. The schema is
+    // compiled once and cached by its hash. Returns 0 if it cannot be compiled.
+    quint64 generateJson(const QString &prompt, const QByteArray &schema, qint64 timeout_ms = -1, quint64 session = 0)
+    {
+        if (!m_worker)
+            return 0;
+
+        QLlamaGrammarCache::Grammar grammar = QLlamaGrammarCache::instance().schema(schema);
+        if (!grammar)
+            return 0;
+
+        QLlamaRequest request = make_request(session, timeout_ms);
+        request.prompt = prompt;
+        request.grammar = std::move(grammar);
+
+        return submit(request);
+    }
+
+    // Like chat(), but the reply is constrained to JSON matching schema.
+    quint64 chatJson(quint64 session, const QString &content, const QByteArray &schema, qint64 timeout_ms = -1)
+    {
+        QLlamaGrammarCache::Grammar grammar = QLlamaGrammarCache::instance().schema(schema);
+        if (!grammar)
+            return 0;
+
+        QLlamaRequest request = make_request(session, timeout_ms);
+        request.grammar = std::move(grammar);
+
+        return chat_turn(request, content);
+    }
+
+    const QLlamaChatHistory chatHistory(quint64 session) const { return m_chats.value(session); }
+
+    // Queues texts for embedding and returns the request id, or 0 unless params.embedding was
+    // set when loading. Results arrive through embeddingsReady, possibly in several parts,
+    // followed by embeddingFinished.
+    quint64 embed(const QStringList &texts)
+    {
+        if (!m_embedder)
+            return 0;
+
+        const quint64 id = ++m_last_request_id;
+
+        QLlamaEmbedder *embedder = m_embedder;
+        QMetaObject::invokeMethod(embedder, [embedder, id, texts]() { embedder->embed(id, texts); }, Qt::QueuedConnection);
+
+        return id;
+    }
+
+    // Splits text at embd_sep, like the embedding example, and embeds the parts.
+    quint64 embed(const QString &text)
+    {
+        return embed(text.split(QString::fromStdString(m_params.embd_sep)));
+    }
+
+    // How many draft tokens were proposed and accepted since load(); zero without model_draft.
+    QLlamaDraftStats draftStats() const { return m_worker ? m_worker->draft_stats() : QLlamaDraftStats(); }
+
+    // Counters and latency percentiles since load(); safe to call at any time.
+    QLlamaMetricsSnapshot metrics() const { return m_worker ? m_worker->metrics().snapshot() : QLlamaMetricsSnapshot(); }
+
+    // The same in Prometheus text exposition format.
+    QByteArray metricsText() const { return m_worker ? m_worker->metrics().prometheus() : QByteArray(); }
+
+    double promptTokensPerSecond() const    { return m_prompt_tokens_per_second; }
+    double generatedTokensPerSecond() const { return m_generated_tokens_per_second; }
+    double timeToFirstTokenMs() const       { return m_metrics_last.ttft_p50_ms; }
+    double interTokenLatencyMs() const      { return m_metrics_last.itl_p50_ms; }
+    qint32 activeSequences() const          { return m_metrics_last.n_active; }
+    qint32 queuedSequences() const          { return m_metrics_last.n_queued; }
+    qint32 kvCellsUsed() const              { return m_metrics_last.n_kv_cells_used; }
+    quint64 kvDefragCount() const           { return m_metrics_last.n_defrags; }
+    qint32 batchChunkTokens() const         { return m_metrics_last.n_batch_chunk; }
+    qint32 ubatchTokens() const             { return m_metrics_last.n_ubatch; }
+
+    // The flag cancel() sets for request id, or nullptr once it has finished. Setting it from
+    // any thread cancels the request the same way, even in the middle of a decode.
+    std::shared_ptr<std::atomic_bool> cancelToken(quint64 id) const { return m_cancel_flags.value(id); }
+
+    // Stops request id, within the ubatch being decoded if it is running; generationFinished
+    // follows with StopCancelled and the output so far.
+    void cancel(quint64 id)
+    {
+        auto flag = m_cancel_flags.value(id);
+        if (flag) flag->store(true, std::memory_order_relaxed);
+    }
+
+    void cancelAll()
+    {
+        for (const auto &flag : std::as_const(m_cancel_flags))
+            flag->store(true, std::memory_order_relaxed);
+    }
 
     // Setters (lots of them)
     void setParams(gpt_params params)
@@ -136,14 +498,48 @@ public:
     void set_main_gpu(qint32 main_gpu = 0)                              { m_params.main_gpu = main_gpu; }
     void set_tensor_split(float tensor_split[128] = 0)                  { memset(&m_params.tensor_split, 0, sizeof(float) * 128); for(int i = 0; i < 128 || tensor_split[i] == '0'; ++i) m_params.tensor_split[i] = tensor_split[i]; }
     void set_grp_attn_n(qint32 grp_attn_n = 1)                          { m_params.grp_attn_n = grp_attn_n; }
-
+    void set_grp_attn_w(qint32 grp_attn_w = 512)                        { m_params.grp_attn_w = grp_attn_w; }
+    void set_n_flush_tokens(qint32 n_flush_tokens = 4)                  { m_n_flush_tokens = n_flush_tokens; if (m_worker) m_worker->set_n_flush_tokens(n_flush_tokens); }
+    void set_flush_interval_ms(qint32 flush_interval_ms = 16)           { m_flush_interval_ms = flush_interval_ms; if (m_worker) m_worker->set_flush_interval_ms(flush_interval_ms); }
+    void set_priority(qint32 priority = 0)                              { m_priority = priority; }
+    void set_swap_space_mb(qint32 swap_space_mb = 2048)                 { m_swap_space_mb = swap_space_mb; if (m_worker) m_worker->set_swap_space_mb(swap_space_mb); }
+    // Idle sessions that lose their slot keep their cells, in memory up to session_memory_mb, then on disk.
+    void set_session_memory_mb(qint32 session_memory_mb = 1024)         { m_session_memory_mb = session_memory_mb; if (m_worker) m_worker->set_session_memory_mb(session_memory_mb); }
+    void set_session_disk_mb(qint32 session_disk_mb = 8192)             { m_session_disk_mb = session_disk_mb; if (m_worker) m_worker->set_session_disk_mb(session_disk_mb); }
+    void set_n_prefetch_threads(qint32 n_prefetch_threads = 4)          { m_n_prefetch_threads = std::max(n_prefetch_threads, 0); }
+    // Replaces n_threads and n_threads_batch with the ones measured for this model and CPU, benchmarking on the first load.
+    void set_autotune_threads(bool autotune_threads = true)             { m_autotune_threads = autotune_threads; }
+    void set_log_format(QLlamaLogWriter::Format log_format = QLlamaLogWriter::Yaml) { m_log_format = log_format; }
+    // Lookup decoding is also on whenever lookup_cache_static or lookup_cache_dynamic is set.
+    void set_lookup_decoding(bool lookup_decoding = true)               { m_lookup_decoding = lookup_decoding; if (m_worker) m_worker->set_lookup_decoding(lookup_decoding); }
+    // Sizes prompt chunks by measured throughput and, while idle, recreates the context when another n_ubatch fits them better.
+    void set_adaptive_batch(bool adaptive_batch = true)                 { m_adaptive_batch = adaptive_batch; if (m_worker) m_worker->set_adaptive_batch(adaptive_batch); }
+    // 0 stops metricsChanged; metrics() and metricsText() keep working.
+    void set_metrics_interval_ms(qint32 metrics_interval_ms = 1000)     { m_metrics_interval_ms = std::max(metrics_interval_ms, 0); if (m_worker) restart_metrics_timer(); }
+
+signals:
+    void loadProgress(float progress);
+    void loadFinished(bool success);
+
+    void tokensGenerated(quint64 id, const QList<llama_token> &tokens, const QString &text);
+    void generationFinished(quint64 id, QLlamaWorker::StopReason reason, const QString &output);
+    void candidatesReady(quint64 id, const QList<QLlamaCandidate> &candidates);
+    void contextShifted(quint64 id, qint32 n_keep, qint32 n_discard);
+    void embeddingsReady(quint64 id, qint32 first, const QList<QList<float>> &embeddings);
+    void embeddingFinished(quint64 id);
+    void promptCacheRestored(qint32 n_tokens);
+    void metricsChanged();
 
 private:
     gpt_params m_params;
 
+    std::shared_ptr<llama_model> m_model_ref;
     llama_model *m_model                    {nullptr};
 
     llama_context *m_ctx                    {nullptr};
+    std::shared_ptr<llama_model> m_model_draft_ref;
+    llama_context *m_ctx_draft              {nullptr};
+    llama_context *m_ctx_embd               {nullptr};
     llama_sampling_params m_sparams;
     llama_sampling_context *ctx_sampling    {nullptr};
     llama_context *m_ctx_guidance           {nullptr};
@@ -154,7 +550,49 @@ private:
     bool is_interacting                     {false};
     bool need_insert_eot                    {false};
 
-    QList<llama_chat_msg> m_chat_msgs;
+    // Replies in flight, so their token counts can be recorded in the chat history.
+    struct QLlamaChatReply
+    {
+        quint64 session     {0};
+        qint32 n_tokens     {0};
+    };
+
+    QHash<quint64, QLlamaChatHistory> m_chats;
+    QHash<quint64, QLlamaChatReply> m_chat_replies;
+    QHash<quint64, qint32> m_session_priorities;
+    qint32 m_priority                       {0};
+
+    QThread *m_loader                       {nullptr};
+    std::atomic_bool m_load_cancelled       {false};
+    bool m_load_ok                          {false};
+    qint32 m_n_prefetch_threads             {4};
+    bool m_autotune_threads                 {false};
+    bool m_lookup_decoding                  {false};
+    bool m_adaptive_batch                   {true};
+    qint32 m_flush_interval_ms              {16};
+    qint32 m_n_flush_tokens                 {4};
+    qint32 m_session_disk_mb                {8192};
+    qint32 m_session_memory_mb              {1024};
+    qint32 m_swap_space_mb                  {2048};
+
+    std::unique_ptr<QLlamaLogWriter> m_log_writer;
+    QLlamaLogWriter::Format m_log_format    {QLlamaLogWriter::Yaml};
+
+    QThread m_thread;
+    QLlamaWorker *m_worker                  {nullptr};
+
+    QThread m_embd_thread;
+    QLlamaEmbedder *m_embedder              {nullptr};
+    quint64 m_last_request_id               {0};
+    quint64 m_last_session_id               {0};
+    QHash<quint64, std::shared_ptr<std::atomic_bool>> m_cancel_flags;
+
+    QTimer m_metrics_timer;
+    QElapsedTimer m_metrics_clock;
+    QLlamaMetricsSnapshot m_metrics_last;
+    qint32 m_metrics_interval_ms            {1000};
+    double m_prompt_tokens_per_second       {0.0};
+    double m_generated_tokens_per_second    {0.0};
 
 private helpers:
 
@@ -180,118 +618,382 @@ private helpers:
         return empty;
     }
 
-    void write_logfile(
-        const QList<llama_token> &input_tokens,
-        const QString &output,
-        const QList<llama_token> &output_tokens
-    )
+    void llama_log_callbck_logTee(ggml_log_level level, const QString &text, void *user_data)
     {
-        if (!m_ctx || !m_model) return;
+        Q_UNUSED(level);
+        Q_UNUSED(user_data);
 
-        if (m_params.logdir.empty()) return;
+        LOG_TEE("%s", text.toStdString().c_str());
+    }
 
-        const QString timestamp = QString::fromStdString(string_get_sortable_timestamp());
+    // Acquires the model and creates the context. Runs on the loader thread for loadAsync().
+    bool load_model()
+    {
+        if (m_params.numa != GGML_NUMA_STRATEGY_DISABLED)
+            llama_numa_init(m_params.numa);
+
+        // Reading the file from several threads keeps more requests in flight than
+        // llama.cpp's sequential page faults; pointless if the weights are already resident.
+        std::unique_ptr<QLlamaPrefetch> prefetch;
+        if (m_n_prefetch_threads > 0 && !QLlamaModelPool::instance().contains(m_params))
+            prefetch = std::make_unique<QLlamaPrefetch>(QString::fromStdString(m_params.model), m_n_prefetch_threads);
+
+        float reported = -1.0f;
+
+        m_model_ref = QLlamaModelPool::instance().acquire(m_params, [this, &reported](float progress) {
+            // llama.cpp reports every tensor; one percent steps are plenty for a progress bar.
+            if (progress >= 1.0f || progress - reported >= 0.01f)
+            {
+                reported = progress;
+                emit loadProgress(progress);
+            }
+
+            return !m_load_cancelled.load(std::memory_order_relaxed);
+        });
+        m_model = m_model_ref.get();
+
+        // Let the prefetch finish so the warmup and the first request do not fault.
+        if (prefetch)
+        {
+            if (!m_model || m_load_cancelled.load(std::memory_order_relaxed))
+                prefetch->cancel();
 
-        const bool success = fs_create_directory_with_parents(m_params.logdir);
+            prefetch->wait();
+        }
+
+        QLlamaThreadTuner::Result threads;
+
+        if (m_model && m_autotune_threads)
+        {
+            threads = QLlamaThreadTuner::lookup(m_model, m_params);
 
-        if (!success) {
-            fprintf(stderr, "%s: Warning: Failed to create logdir %s. Cannot write logfile.\n", __func__, m_params.logdir.c_str());
-            throw QLlamaExceptions::QLogfileError(QString::fromLatin1(__func__), QString::fromLatin1(m_params.logdir));
+            if (threads.valid())
+            {
+                m_params.n_threads = threads.n_threads;
+                m_params.n_threads_batch = threads.n_threads_batch;
+            }
         }
 
-        const QString logfile_path = QString::fromLatin1(m_params.logdir) + timestamp + ".yml";
+        if (m_model && !m_load_cancelled.load(std::memory_order_relaxed))
+            m_ctx = new_context(m_params);
 
-        QFile logfile(logfile_path);
+        // Measured on the real context, before the draft and embedding contexts copy the params.
+        if (m_ctx && m_autotune_threads && !threads.valid())
+        {
+            threads = QLlamaThreadTuner::tune(m_ctx, m_params, &m_load_cancelled);
+
+            if (threads.valid())
+            {
+                m_params.n_threads = threads.n_threads;
+                m_params.n_threads_batch = threads.n_threads_batch;
+                QLlamaThreadTuner::store(m_model, m_params, threads);
+            }
+        }
+
+        if (m_ctx && m_load_cancelled.load(std::memory_order_relaxed))
+        {
+            llama_free(m_ctx);
+            m_ctx = nullptr;
+        }
 
-        if (!logfile.open(QIODevice::WriteOnly | QIODevice::Text))
+        if (!m_ctx)
         {
-            fprintf(stderr, "%s: Warning: Failed to open logfile %s.\n", __func__, logfile_path.toStdString().c_str());
-            throw QLlamaExceptions::QLogfileError(QString::fromLatin1(__func__), logfile_path);
+            m_model_ref.reset();
+            m_model = nullptr;
+            return false;
         }
 
-        //logfile.write("Binary: " + QCoreApplication::applicationName());
-        QTextStream logStream(&logfile);
+        if (!m_params.model_draft.empty())
+            load_draft();
+
+        if (m_params.embedding && !(m_ctx_embd = new_embedding_context()))
+            LOG_TEE("%s: failed to create the embedding context, embed() is disabled\n", __func__);
 
-        logStream << "Binary: " << QCoreApplication::applicationName() << '\n';
-        logStream.flush();
-        char model_desc[128];
-        llama_model_desc(m_model, model_desc, sizeof(model_desc));
-        std::vector<llama_token> input_tokens_vec;
-        input_tokens_vec.reserve(input_tokens.size());
+        return true;
+    }
 
-        foreach(llama_token t, input_tokens)
-            input_tokens_vec.push_back(t);
+    // A second context on the same weights. Every batch is decoded in one ubatch, so that
+    // non-causal models see whole sequences, and many short texts share it as separate sequences.
+    llama_context *new_embedding_context()
+    {
+        llama_context_params cparams = llama_context_params_from_gpt_params(m_params);
+        cparams.embeddings = true;
+        cparams.n_ubatch = cparams.n_batch;
+        cparams.n_ctx = cparams.n_batch;
+        cparams.n_seq_max = std::min<uint32_t>(cparams.n_batch, 128);
 
-        int fileHandle = logfile.handle();
+        return llama_new_context_with_model(m_model, cparams);
+    }
 
-        FILE *fileDescriptor = fdopen(fileHandle, "a");
+    // Loads model_draft for speculative decoding. A draft model that cannot be used only
+    // disables speculation.
+    void load_draft()
+    {
+        gpt_params params = m_params;
+        params.model = m_params.model_draft;
+        params.hf_repo.clear();
+        params.hf_file.clear();
+        params.model_url.clear();
+        params.lora_adapter.clear();
+        params.control_vectors.clear();
+        params.n_gpu_layers = m_params.n_gpu_layers_draft;
+        params.n_parallel = 1;
+
+        if (m_params.n_threads_draft > 0)       params.n_threads = m_params.n_threads_draft;
+        if (m_params.n_threads_batch_draft > 0) params.n_threads_batch = m_params.n_threads_batch_draft;
+
+        m_model_draft_ref = QLlamaModelPool::instance().acquire(params);
+        llama_model *draft = m_model_draft_ref.get();
+
+        if (!draft)
+        {
+            LOG_TEE("%s: failed to load draft model %s, speculative decoding is disabled\n", __func__, params.model.c_str());
+            return;
+        }
 
-        if (!fileDescriptor)
+        // Draft tokens are compared by id, so both models have to share the vocabulary.
+        if (llama_vocab_type(draft) != llama_vocab_type(m_model) ||
+            std::abs(llama_n_vocab(draft) - llama_n_vocab(m_model)) > 100 ||
+            llama_token_bos(draft) != llama_token_bos(m_model) ||
+            llama_token_eos(draft) != llama_token_eos(m_model))
         {
-            fprintf(stderr, "%s: Warning: Failed to associate logfile %s. with file descriptor\n", __func__, logfile_path.toStdString().c_str());
-            throw QLlamaExceptions::QLogfileError(QString::fromLatin1(__func__), QString::fromLatin1(m_params.logdir));
-            logfile.close();
+            LOG_TEE("%s: draft model %s does not share the vocabulary of the target, speculative decoding is disabled\n", __func__, params.model.c_str());
+            m_model_draft_ref.reset();
+            return;
         }
 
-        yaml_dump_non_result_info(fileDescriptor, m_params, m_ctx, timestamp.toStdString().c_str(), input_tokens_vec, model_desc);
-        fflush(fileDescriptor);
+        m_ctx_draft = llama_new_context_with_model(draft, llama_context_params_from_gpt_params(params));
 
-        logStream << "\n"
-                  << "######################\n"
-                  << "# Generation Results #\n"
-                  << "######################\n"
-                  << "\n";
-        logStream.flush();
+        if (!m_ctx_draft)
+            m_model_draft_ref.reset();
+    }
 
-        yaml_dump_string_multiline(fileDescriptor, "output", output.toStdString().c_str());
-        fflush(fileDescriptor);
+    // Creates a context on the shared model and applies what llama_init_from_gpt_params
+    // would: control vectors, LoRA adapters, ignore_eos and the warmup run. The worker calls
+    // it from its thread with a copy of the params to recreate its context.
+    llama_context *new_context(gpt_params &params)
+    {
+        // With params.embedding, embeddings come from their own context; this one generates.
+        llama_context_params cparams = llama_context_params_from_gpt_params(params);
+        cparams.embeddings = false;
+
+        llama_context *ctx = llama_new_context_with_model(m_model, cparams);
 
-        std::vector<llama_token> output_tokens_vec;
+        if (!ctx)
+            return nullptr;
 
-        foreach(llama_token t, output_tokens)
-            output_tokens_vec.push_back(t);
+        if (!params.control_vectors.empty())
+        {
+            if (params.control_vector_layer_start <= 0) params.control_vector_layer_start = 1;
+            if (params.control_vector_layer_end   <= 0) params.control_vector_layer_end   = llama_n_layer(m_model);
+
+            const llama_control_vector_data cvec = llama_control_vector_load(params.control_vectors);
+
+            if (cvec.n_embd == -1 ||
+                llama_control_vector_apply(ctx, cvec.data.data(), cvec.data.size(), cvec.n_embd,
+                                           params.control_vector_layer_start, params.control_vector_layer_end))
+            {
+                llama_free(ctx);
+                return nullptr;
+            }
+        }
 
-        yaml_dump_vector_int(fileDescriptor, "output_tokens", output_tokens_vec);
-        fflush(fileDescriptor);
+        // Adapters are loaded once per model and shared like its weights; a context only applies them.
+        for (const auto &lora : params.lora_adapter)
+        {
+            llama_lora_adapter *adapter = QLlamaModelPool::instance().lora_adapter(m_model, std::get<0>(lora));
 
-        llama_dump_timing_info_yaml(fileDescriptor, m_ctx);
-        fflush(fileDescriptor);
+            if (!adapter)
+            {
+                LOG_TEE("%s: error: failed to apply lora adapter %s\n", __func__, std::get<0>(lora).c_str());
+                llama_free(ctx);
+                return nullptr;
+            }
 
-        fclose(fileDescriptor);
-        logfile.close();
+            llama_lora_adapter_set(ctx, adapter, std::get<1>(lora));
+        }
+
+        if (params.ignore_eos)
+            params.sparams.logit_bias[llama_token_eos(m_model)] = -INFINITY;
+
+        if (params.warmup)
+        {
+            std::vector<llama_token> tmp;
+
+            const llama_token bos = llama_token_bos(m_model);
+            const llama_token eos = llama_token_eos(m_model);
+
+            if (bos != -1) tmp.push_back(bos);
+            if (eos != -1) tmp.push_back(eos);
+            if (tmp.empty()) tmp.push_back(0);
+
+            llama_decode(ctx, llama_batch_get_one(tmp.data(), std::min<qint32>(tmp.size(), params.n_batch), 0, 0));
+            llama_kv_cache_clear(ctx);
+            llama_synchronize(ctx);
+            llama_reset_timings(ctx);
+        }
+
+        return ctx;
     }
 
-    void llama_log_callbck_logTee(ggml_log_level level, const QString &text, void *user_data)
+    void start_worker()
     {
-        Q_UNUSED(level);
-        Q_UNUSED(user_data);
+        // new_context may have adjusted the sampling params (e.g. ignore_eos).
+        m_sparams = m_params.sparams;
+        m_n_ctx_train = llama_n_ctx_train(m_model);
+        m_n_ctx = llama_n_ctx(m_ctx);
+
+        m_worker = new QLlamaWorker(m_ctx, m_params, m_ctx_draft);
+        if (m_lookup_decoding) m_worker->set_lookup_decoding(true);
+        m_worker->set_adaptive_batch(m_adaptive_batch);
+        m_worker->set_flush_interval_ms(m_flush_interval_ms);
+        m_worker->set_n_flush_tokens(m_n_flush_tokens);
+        m_worker->set_session_disk_mb(m_session_disk_mb);
+        m_worker->set_session_memory_mb(m_session_memory_mb);
+        m_worker->set_swap_space_mb(m_swap_space_mb);
+        m_worker->set_context_factory([this, params = m_params](qint32 n_ubatch) mutable {
+            params.n_ubatch = n_ubatch;
+            return new_context(params);
+        });
+
+        if (!m_params.logdir.empty())
+        {
+            m_log_writer = std::make_unique<QLlamaLogWriter>(m_params, m_model, m_log_format);
+            m_worker->set_log_writer(m_log_writer.get());
+        }
+        m_worker->moveToThread(&m_thread);
 
-        LOG_TEE("%s", text.toStdString().c_str());
+        // From here on only the worker's thread touches its context.
+        m_ctx = nullptr;
+
+        connect(m_worker, &QLlamaWorker::tokensGenerated, this, [this](quint64 id, const QList<llama_token> &tokens, const QString &text) {
+            auto reply = m_chat_replies.find(id);
+            if (reply != m_chat_replies.end())
+                reply->n_tokens += tokens.size();
+
+            emit tokensGenerated(id, tokens, text);
+        });
+        connect(m_worker, &QLlamaWorker::generationFinished, this, [this](quint64 id, QLlamaWorker::StopReason reason, const QString &output) {
+            m_cancel_flags.remove(id);
+
+            const QLlamaChatReply reply = m_chat_replies.take(id);
+            if (reply.session && m_chats.contains(reply.session))
+            {
+                QLlamaChatHistory &history = m_chats[reply.session];
+                history.add_reply(output.toStdString(), reply.n_tokens);
+
+                // The worker did not record the turn; evaluate the whole chat again next time.
+                if (reason == QLlamaWorker::StopError)
+                    history.invalidate();
+            }
+
+            emit generationFinished(id, reason, output);
+        });
+
+        connect(m_worker, &QLlamaWorker::contextShifted, this, [this](quint64 id, qint32 n_keep, qint32 n_discard) {
+            auto reply = m_chat_replies.find(id);
+            if (reply != m_chat_replies.end() && m_chats.contains(reply->session))
+                reply->n_tokens -= m_chats[reply->session].discard(n_keep, n_discard);
+
+            emit contextShifted(id, n_keep, n_discard);
+        });
+
+        connect(m_worker, &QLlamaWorker::candidatesReady, this, &QLlamaInference::candidatesReady);
+        connect(m_worker, &QLlamaWorker::promptCacheRestored, this, &QLlamaInference::promptCacheRestored);
+
+        m_thread.start();
+
+        if (m_ctx_embd)
+        {
+            m_embedder = new QLlamaEmbedder(m_ctx_embd, m_params);
+            m_embedder->moveToThread(&m_embd_thread);
+
+            connect(m_embedder, &QLlamaEmbedder::embeddingsReady, this, &QLlamaInference::embeddingsReady);
+            connect(m_embedder, &QLlamaEmbedder::embeddingFinished, this, &QLlamaInference::embeddingFinished);
+
+            m_embd_thread.start();
+        }
+
+        QMetaObject::invokeMethod(m_worker, &QLlamaWorker::restorePromptCache, Qt::QueuedConnection);
+
+        restart_metrics_timer();
+    }
+
+    void restart_metrics_timer()
+    {
+        m_metrics_timer.stop();
+        m_metrics_clock.start();
+
+        if (m_metrics_interval_ms > 0)
+            m_metrics_timer.start(m_metrics_interval_ms);
+    }
+
+    void update_metrics()
+    {
+        const QLlamaMetricsSnapshot s = metrics();
+        const double t_s = m_metrics_clock.restart() / 1000.0;
+
+        if (t_s > 0)
+        {
+            m_prompt_tokens_per_second = (s.n_prompt_tokens - m_metrics_last.n_prompt_tokens) / t_s;
+            m_generated_tokens_per_second = (s.n_generated_tokens - m_metrics_last.n_generated_tokens) / t_s;
+        }
+
+        m_metrics_last = s;
+        emit metricsChanged();
     }
 
-    QString chat_add_and_format(QList<llama_chat_msg> &chat_msgs, QString role, QString content)
+    quint64 chat_turn(QLlamaRequest request, const QString &content)
     {
-        std::vector<llama_chat_msg> v_chat_msgs;
-        foreach(llama_chat_msg m , chat_msgs)
-            v_chat_msgs.push_back(m);
+        const quint64 session = request.session;
+
+        if (!m_worker || !session)
+            return 0;
+
+        for (const QLlamaChatReply &reply : std::as_const(m_chat_replies))
+            if (reply.session == session) return 0;
+
+        QLlamaChatHistory &history = m_chats[session];
+        if (!content.isNull())
+            history.add("user", content.toStdString());
+
+        QLlamaChatHistory::Turn turn = history.prepare(m_model, m_params.chat_template, true);
 
-        std::string role_str = role.toStdString();
-        std::string content_str = content.toStdString();
+        request.n_keep = turn.n_keep;
+        request.tokens = std::move(turn.tokens);
 
-        llama_chat_msg new_msg{role_str, content_str};
+        m_chat_replies.insert(request.id, {session, 0});
 
-        std::string formatted = llama_chat_format_single(
-            m_model,
-            m_params.chat_template,
-            v_chat_msgs,
-            new_msg,
-            role == "user"
-        );
+        return submit(request);
+    }
+
+    QLlamaRequest make_request(quint64 session, qint64 timeout_ms)
+    {
+        QLlamaRequest request;
+        request.id = ++m_last_request_id;
+        request.session = session;
+        request.n_predict = m_params.n_predict;
+        request.sparams = m_sparams;
+        request.priority = m_session_priorities.value(session, m_priority);
+
+        // The default grammar is compiled once here, not once per request by the worker. A
+        // grammar that does not compile makes the worker reject the request.
+        if (!request.sparams.grammar.empty())
+            request.grammar = QLlamaGrammarCache::instance().grammar(request.sparams.grammar);
+        if (timeout_ms >= 0)
+            request.deadline = QDeadlineTimer(timeout_ms);
+
+        return request;
+    }
+
+    quint64 submit(const QLlamaRequest &request)
+    {
+        m_cancel_flags.insert(request.id, request.cancelled);
 
-        chat_msgs.push_back({role_str, content_str});
-        LOG("Formatted: %s\n", formatted.c_str());
+        QLlamaWorker *worker = m_worker;
+        QMetaObject::invokeMethod(worker, [worker, request]() { worker->submit(request); }, Qt::QueuedConnection);
 
-        return QString::fromStdString(formatted);
+        return request.id;
     }
 };
 
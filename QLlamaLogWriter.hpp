@@ -0,0 +1,258 @@
+#ifndef QLLAMALOGWRITER_HPP
+#define QLLAMALOGWRITER_HPP
+
+#include "common/common.h"
+#include <llama.h>
+
+#include <QCoreApplication>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QString>
+#include <QThread>
+#include <QWaitCondition>
+
+#include <cinttypes>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Everything logged about one finished request. Built by the worker and handed over by move.
+struct QLlamaRunRecord
+{
+    std::string timestamp;
+    std::string stop_reason;
+    llama_sampling_params sparams;
+
+    std::vector<llama_token> input_tokens;
+    std::vector<llama_token> output_tokens;
+    QString output;
+
+    qint32 n_reused                                 {0}; // prompt tokens served from the KV cache
+    qint64 t_prompt_us                              {0};
+    qint64 t_eval_us                                {0};
+};
+
+// Writes run records to params.logdir on a thread of its own. enqueue() only moves the record
+// into a queue; the writer drains the queue in one go whenever it wakes up. Yaml writes one
+// <timestamp>.yml per run, like the llama.cpp examples; Jsonl appends one compact line per run
+// to runs.jsonl.
+class QLlamaLogWriter
+{
+public:
+    enum Format
+    {
+        Yaml,
+        Jsonl
+    };
+
+    // model is only used for its metadata and must outlive the writer.
+    QLlamaLogWriter(const gpt_params &params, llama_model *model, Format format = Yaml)
+        : m_params(params)
+        , m_format(format)
+        , m_binary(QCoreApplication::applicationName().toStdString())
+    {
+        if (!m_params.logdir.empty() && m_params.logdir.back() != DIRECTORY_SEPARATOR)
+            m_params.logdir += DIRECTORY_SEPARATOR;
+
+        llama_model_desc(model, m_model_desc, sizeof(m_model_desc));
+
+        // yaml_dump_non_result_info reads the model through a context. The worker may recreate
+        // its own, so the writer keeps the smallest context it can for that.
+        if (m_format == Yaml)
+        {
+            llama_context_params cparams = llama_context_default_params();
+            cparams.n_ctx = 32;
+            cparams.n_batch = 1;
+            cparams.n_ubatch = 1;
+            cparams.n_seq_max = 1;
+            cparams.offload_kqv = false;
+
+            m_ctx = llama_new_context_with_model(model, cparams);
+
+            if (!m_ctx)
+                LOG_TEE("%s: warning: failed to create a context for the run log, its files get no parameters\n", __func__);
+        }
+
+        m_thread = QThread::create([this]() { run(); });
+        m_thread->setObjectName("QLlamaLogWriter");
+        m_thread->start(QThread::LowPriority);
+    }
+
+    // Writes whatever is still queued before returning.
+    ~QLlamaLogWriter()
+    {
+        {
+            QMutexLocker locker(&m_mutex);
+            m_stop = true;
+            m_queued.wakeOne();
+        }
+
+        m_thread->wait();
+        delete m_thread;
+
+        if (m_ctx) llama_free(m_ctx);
+    }
+
+    QLlamaLogWriter(const QLlamaLogWriter &) = delete;
+    QLlamaLogWriter &operator=(const QLlamaLogWriter &) = delete;
+
+    void enqueue(QLlamaRunRecord &&record)
+    {
+        QMutexLocker locker(&m_mutex);
+        m_queue.push_back(std::move(record));
+        m_queued.wakeOne();
+    }
+
+private:
+    gpt_params m_params;
+    llama_context *m_ctx                            {nullptr}; // metadata only, never decodes
+    Format m_format;
+    std::string m_binary;
+    char m_model_desc[128]                          = {0};
+
+    QThread *m_thread                               {nullptr};
+    QMutex m_mutex;
+    QWaitCondition m_queued;
+    std::vector<QLlamaRunRecord> m_queue;
+    bool m_stop                                     {false};
+    bool m_logdir_created                           {false};
+
+    void run()
+    {
+        for (;;)
+        {
+            std::vector<QLlamaRunRecord> records;
+
+            {
+                QMutexLocker locker(&m_mutex);
+
+                while (m_queue.empty() && !m_stop)
+                    m_queued.wait(&m_mutex);
+
+                if (m_queue.empty())
+                    return;
+
+                records.swap(m_queue);
+            }
+
+            if (!m_logdir_created && !fs_create_directory_with_parents(m_params.logdir))
+            {
+                LOG_TEE("%s: warning: failed to create logdir %s, cannot write logfile\n", __func__, m_params.logdir.c_str());
+                continue;
+            }
+
+            m_logdir_created = true;
+
+            if (m_format == Jsonl)
+                write_jsonl(records);
+            else
+                for (const QLlamaRunRecord &record : records) write_yaml(record);
+        }
+    }
+
+    void write_yaml(const QLlamaRunRecord &record)
+    {
+        const std::string path = m_params.logdir + record.timestamp + ".yml";
+        FILE *stream = fopen(path.c_str(), "w");
+
+        if (!stream)
+        {
+            LOG_TEE("%s: warning: failed to open logfile %s\n", __func__, path.c_str());
+            return;
+        }
+
+        // One buffer for the whole file, flushed once by fclose.
+        setvbuf(stream, nullptr, _IOFBF, 1 << 16);
+
+        gpt_params params = m_params;
+        params.sparams = record.sparams;
+
+        fprintf(stream, "Binary: %s\n", m_binary.c_str());
+        if (m_ctx) yaml_dump_non_result_info(stream, params, m_ctx, record.timestamp, record.input_tokens, m_model_desc);
+
+        fprintf(stream, "\n");
+        fprintf(stream, "######################\n");
+        fprintf(stream, "# Generation Results #\n");
+        fprintf(stream, "######################\n");
+        fprintf(stream, "\n");
+
+        yaml_dump_string_multiline(stream, "output", record.output.toStdString().c_str());
+        yaml_dump_vector_int(stream, "output_tokens", record.output_tokens);
+        fprintf(stream, "stop_reason: %s\n", record.stop_reason.c_str());
+
+        // Per request rather than llama_dump_timing_info_yaml's context totals, which mix
+        // every slot that shared the context.
+        const qint32 n_p_eval = record.input_tokens.size() - record.n_reused;
+        const qint32 n_eval = std::max<qint32>(record.output_tokens.size() - 1, 0);
+
+        fprintf(stream, "\n");
+        fprintf(stream, "###########\n");
+        fprintf(stream, "# Timings #\n");
+        fprintf(stream, "###########\n");
+        fprintf(stream, "\n");
+
+        fprintf(stream, "mst_eval: %.2f  # ms / token during generation\n", n_eval ? 1.0e-3 * record.t_eval_us / n_eval : 0.0);
+        fprintf(stream, "mst_p_eval: %.2f  # ms / token during prompt processing\n", n_p_eval ? 1.0e-3 * record.t_prompt_us / n_p_eval : 0.0);
+        fprintf(stream, "n_eval: %d  # number of tokens generated (excluding the first one)\n", n_eval);
+        fprintf(stream, "n_p_eval: %d  # number of tokens processed in batches at the beginning\n", n_p_eval);
+        fprintf(stream, "n_reused: %d  # prompt tokens served from the KV cache\n", record.n_reused);
+        fprintf(stream, "t_eval_us: %" PRId64 "  # total microseconds spent generating tokens\n", (int64_t) record.t_eval_us);
+        fprintf(stream, "t_p_eval_us: %" PRId64 "  # total microseconds spent prompt processing\n", (int64_t) record.t_prompt_us);
+        fprintf(stream, "ts_eval: %.2f  # tokens / second during generation\n", record.t_eval_us ? 1.0e6 * n_eval / record.t_eval_us : 0.0);
+        fprintf(stream, "ts_p_eval: %.2f  # tokens / second during prompt processing\n", record.t_prompt_us ? 1.0e6 * n_p_eval / record.t_prompt_us : 0.0);
+
+        fclose(stream);
+    }
+
+    void write_jsonl(const std::vector<QLlamaRunRecord> &records)
+    {
+        QByteArray lines;
+
+        for (const QLlamaRunRecord &record : records)
+        {
+            QJsonArray input_tokens;
+            for (llama_token t : record.input_tokens)
+                input_tokens.append(t);
+
+            QJsonArray output_tokens;
+            for (llama_token t : record.output_tokens)
+                output_tokens.append(t);
+
+            QJsonObject json;
+            json["binary"] = QString::fromStdString(m_binary);
+            json["time"] = QString::fromStdString(record.timestamp);
+            json["model_desc"] = QString::fromLatin1(m_model_desc);
+            json["model"] = QString::fromStdString(m_params.model);
+            json["seed"] = (qint64) m_params.seed;
+            json["temp"] = record.sparams.temp;
+            json["top_k"] = record.sparams.top_k;
+            json["top_p"] = record.sparams.top_p;
+            json["prompt_tokens"] = input_tokens;
+            json["output"] = record.output;
+            json["output_tokens"] = output_tokens;
+            json["stop_reason"] = QString::fromStdString(record.stop_reason);
+            json["n_reused"] = record.n_reused;
+            json["t_p_eval_us"] = record.t_prompt_us;
+            json["t_eval_us"] = record.t_eval_us;
+
+            lines += QJsonDocument(json).toJson(QJsonDocument::Compact);
+            lines += '\n';
+        }
+
+        QFile file(QString::fromStdString(m_params.logdir + "runs.jsonl"));
+
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Append))
+        {
+            LOG_TEE("%s: warning: failed to open %s\n", __func__, file.fileName().toStdString().c_str());
+            return;
+        }
+
+        file.write(lines);
+    }
+};
+
+#endif // QLLAMALOGWRITER_HPP
@@ -0,0 +1,271 @@
+#ifndef QLLAMAMETRICS_HPP
+#define QLLAMAMETRICS_HPP
+
+#include <QByteArray>
+#include <QtGlobal>
+
+#include <array>
+#include <atomic>
+#include <cmath>
+
+// Latency histogram with fixed, roughly logarithmic buckets. Observations are relaxed atomic
+// increments, so the decode loop never blocks on a reader; readers see a slightly torn but
+// monotonic view, which is what Prometheus histograms expect anyway.
+class QLlamaHistogram
+{
+public:
+    // Upper bounds in milliseconds; a last, implicit bucket takes everything above.
+    static constexpr std::array<double, 14> bounds_ms = {1, 2.5, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 30000};
+
+    void observe(double ms)
+    {
+        size_t i = 0;
+        while (i < bounds_ms.size() && ms > bounds_ms[i])
+            ++i;
+
+        m_buckets[i].fetch_add(1, std::memory_order_relaxed);
+        m_sum_us.fetch_add(std::llround(ms * 1000.0), std::memory_order_relaxed);
+    }
+
+    quint64 count() const
+    {
+        quint64 n = 0;
+        for (const auto &bucket : m_buckets)
+            n += bucket.load(std::memory_order_relaxed);
+
+        return n;
+    }
+
+    double sum_ms() const { return m_sum_us.load(std::memory_order_relaxed) / 1000.0; }
+
+    // Estimate of the q-quantile, interpolated linearly inside its bucket; 0 without observations.
+    double quantile(double q) const
+    {
+        std::array<quint64, bounds_ms.size() + 1> counts;
+        quint64 n = 0;
+
+        for (size_t i = 0; i < counts.size(); ++i)
+            n += counts[i] = m_buckets[i].load(std::memory_order_relaxed);
+
+        if (n == 0)
+            return 0.0;
+
+        const double rank = q * n;
+        quint64 below = 0;
+
+        for (size_t i = 0; i < counts.size(); ++i)
+        {
+            if (below + counts[i] >= rank && counts[i] > 0)
+            {
+                // The overflow bucket has no upper bound to interpolate towards.
+                if (i == bounds_ms.size())
+                    return bounds_ms.back();
+
+                const double lower = i == 0 ? 0.0 : bounds_ms[i - 1];
+                return lower + (bounds_ms[i] - lower) * (rank - below) / counts[i];
+            }
+
+            below += counts[i];
+        }
+
+        return bounds_ms.back();
+    }
+
+    // Appends the histogram in Prometheus text format, in seconds.
+    void write(QByteArray &text, const char *name, const char *help) const
+    {
+        text += QByteArray("# HELP ") + name + ' ' + help + "\n";
+        text += QByteArray("# TYPE ") + name + " histogram\n";
+
+        quint64 cumulative = 0;
+
+        for (size_t i = 0; i < bounds_ms.size(); ++i)
+        {
+            cumulative += m_buckets[i].load(std::memory_order_relaxed);
+            text += QByteArray(name) + "_bucket{le=\"" + QByteArray::number(bounds_ms[i] / 1000.0) + "\"} " + QByteArray::number(cumulative) + "\n";
+        }
+
+        cumulative += m_buckets[bounds_ms.size()].load(std::memory_order_relaxed);
+        text += QByteArray(name) + "_bucket{le=\"+Inf\"} " + QByteArray::number(cumulative) + "\n";
+        text += QByteArray(name) + "_sum " + QByteArray::number(sum_ms() / 1000.0) + "\n";
+        text += QByteArray(name) + "_count " + QByteArray::number(cumulative) + "\n";
+    }
+
+private:
+    std::array<std::atomic<quint64>, bounds_ms.size() + 1> m_buckets {};
+    std::atomic<quint64> m_sum_us                   {0};
+};
+
+// Point-in-time copy of QLlamaMetrics.
+struct QLlamaMetricsSnapshot
+{
+    quint64 n_prompt_tokens                         {0};
+    quint64 n_generated_tokens                      {0};
+    quint64 t_prompt_us                             {0}; // decode time attributed to prompt tokens
+    quint64 t_generation_us                         {0}; // decode time attributed to generated tokens
+    quint64 n_decodes                               {0};
+    quint64 n_requests                              {0}; // finished requests
+    quint64 n_defrags                               {0};
+    quint64 n_aborted                               {0}; // decodes given up for cancelled or expired requests
+    quint64 n_shared_tokens                         {0}; // prompt tokens copied from other sequences
+    quint64 n_batch_adjustments                     {0}; // changes of the prompt chunk size
+    quint64 n_ctx_recreations                       {0}; // contexts recreated with another n_ubatch
+    qint32 n_active                                 {0};
+    qint32 n_queued                                 {0};
+    qint32 n_kv_cells_used                          {0};
+    qint32 n_kv_cells                               {0};
+    qint32 n_batch_chunk                            {0}; // prompt tokens per decode
+    qint32 n_ubatch                                 {0};
+    double ttft_p50_ms                              {0.0};
+    double ttft_p99_ms                              {0.0};
+    double itl_p50_ms                               {0.0};
+    double itl_p99_ms                               {0.0};
+
+    // Tokens per second of decode time, not of wall time.
+    double prompt_tokens_per_second() const     { return t_prompt_us ? n_prompt_tokens * 1e6 / t_prompt_us : 0.0; }
+    double generated_tokens_per_second() const  { return t_generation_us ? n_generated_tokens * 1e6 / t_generation_us : 0.0; }
+};
+
+// Counters, gauges and histograms of a QLlamaWorker. The worker writes them from its thread
+// with relaxed atomics; any thread can read them at any time without taking a lock.
+class QLlamaMetrics
+{
+public:
+    // One llama_decode of n_prompt prompt tokens and n_generation tokens of generating slots.
+    // Its time is split between both in proportion to the token counts.
+    void decoded(qint32 n_prompt, qint32 n_generation, qint64 t_us)
+    {
+        const qint32 n_tokens = n_prompt + n_generation;
+        if (n_tokens <= 0)
+            return;
+
+        const quint64 t_prompt_us = t_us * n_prompt / n_tokens;
+
+        m_n_prompt_tokens.fetch_add(n_prompt, std::memory_order_relaxed);
+        m_t_prompt_us.fetch_add(t_prompt_us, std::memory_order_relaxed);
+        m_t_generation_us.fetch_add(t_us - t_prompt_us, std::memory_order_relaxed);
+        m_n_decodes.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void generated(quint64 n_tokens = 1)            { m_n_generated_tokens.fetch_add(n_tokens, std::memory_order_relaxed); }
+    void finished()                                 { m_n_requests.fetch_add(1, std::memory_order_relaxed); }
+    void defragmented()                             { m_n_defrags.fetch_add(1, std::memory_order_relaxed); }
+    void aborted()                                  { m_n_aborted.fetch_add(1, std::memory_order_relaxed); }
+    void shared(quint64 n_tokens)                   { m_n_shared_tokens.fetch_add(n_tokens, std::memory_order_relaxed); }
+    void batch_adjusted()                           { m_n_batch_adjustments.fetch_add(1, std::memory_order_relaxed); }
+    void context_recreated()                        { m_n_ctx_recreations.fetch_add(1, std::memory_order_relaxed); }
+
+    void first_token(double ms)                     { m_ttft.observe(ms); }
+    void next_token(double ms)                      { m_itl.observe(ms); }
+
+    void set_sequences(qint32 n_active, qint32 n_queued)
+    {
+        m_n_active.store(n_active, std::memory_order_relaxed);
+        m_n_queued.store(n_queued, std::memory_order_relaxed);
+    }
+
+    void set_kv_cells(qint32 n_used, qint32 n_cells)
+    {
+        m_n_kv_cells_used.store(n_used, std::memory_order_relaxed);
+        m_n_kv_cells.store(n_cells, std::memory_order_relaxed);
+    }
+
+    void set_batching(qint32 n_chunk, qint32 n_ubatch)
+    {
+        m_n_batch_chunk.store(n_chunk, std::memory_order_relaxed);
+        m_n_ubatch.store(n_ubatch, std::memory_order_relaxed);
+    }
+
+    const QLlamaHistogram &ttft() const             { return m_ttft; }
+    const QLlamaHistogram &itl() const              { return m_itl; }
+
+    QLlamaMetricsSnapshot snapshot() const
+    {
+        QLlamaMetricsSnapshot s;
+        s.n_prompt_tokens = m_n_prompt_tokens.load(std::memory_order_relaxed);
+        s.n_generated_tokens = m_n_generated_tokens.load(std::memory_order_relaxed);
+        s.t_prompt_us = m_t_prompt_us.load(std::memory_order_relaxed);
+        s.t_generation_us = m_t_generation_us.load(std::memory_order_relaxed);
+        s.n_decodes = m_n_decodes.load(std::memory_order_relaxed);
+        s.n_requests = m_n_requests.load(std::memory_order_relaxed);
+        s.n_defrags = m_n_defrags.load(std::memory_order_relaxed);
+        s.n_aborted = m_n_aborted.load(std::memory_order_relaxed);
+        s.n_shared_tokens = m_n_shared_tokens.load(std::memory_order_relaxed);
+        s.n_batch_adjustments = m_n_batch_adjustments.load(std::memory_order_relaxed);
+        s.n_ctx_recreations = m_n_ctx_recreations.load(std::memory_order_relaxed);
+        s.n_active = m_n_active.load(std::memory_order_relaxed);
+        s.n_queued = m_n_queued.load(std::memory_order_relaxed);
+        s.n_kv_cells_used = m_n_kv_cells_used.load(std::memory_order_relaxed);
+        s.n_kv_cells = m_n_kv_cells.load(std::memory_order_relaxed);
+        s.n_batch_chunk = m_n_batch_chunk.load(std::memory_order_relaxed);
+        s.n_ubatch = m_n_ubatch.load(std::memory_order_relaxed);
+        s.ttft_p50_ms = m_ttft.quantile(0.50);
+        s.ttft_p99_ms = m_ttft.quantile(0.99);
+        s.itl_p50_ms = m_itl.quantile(0.50);
+        s.itl_p99_ms = m_itl.quantile(0.99);
+
+        return s;
+    }
+
+    // Everything in Prometheus text exposition format.
+    QByteArray prometheus() const
+    {
+        const QLlamaMetricsSnapshot s = snapshot();
+        QByteArray text;
+
+        auto write = [&text](const char *name, const char *type, const char *help, double value) {
+            text += QByteArray("# HELP ") + name + ' ' + help + "\n";
+            text += QByteArray("# TYPE ") + name + ' ' + type + "\n";
+            text += QByteArray(name) + ' ' + QByteArray::number(value, 'g', 15) + "\n";
+        };
+
+        write("qllama_prompt_tokens_total", "counter", "Prompt tokens decoded.", s.n_prompt_tokens);
+        write("qllama_prompt_seconds_total", "counter", "Decode time attributed to prompt tokens.", s.t_prompt_us / 1e6);
+        write("qllama_tokens_predicted_total", "counter", "Tokens generated.", s.n_generated_tokens);
+        write("qllama_tokens_predicted_seconds_total", "counter", "Decode time attributed to generated tokens.", s.t_generation_us / 1e6);
+        write("qllama_decode_total", "counter", "Calls to llama_decode.", s.n_decodes);
+        write("qllama_requests_total", "counter", "Requests that ran in a slot until they stopped, for whatever reason.", s.n_requests);
+        write("qllama_kv_cache_defrag_total", "counter", "KV cache defragmentations requested.", s.n_defrags);
+        write("qllama_decode_aborted_total", "counter", "Calls to llama_decode aborted because their requests were cancelled or ran out of time.", s.n_aborted);
+        write("qllama_prompt_tokens_shared_total", "counter", "Prompt tokens whose cells were copied from another sequence instead of decoded.", s.n_shared_tokens);
+        write("qllama_batch_adjustments_total", "counter", "Changes of the number of prompt tokens per decode.", s.n_batch_adjustments);
+        write("qllama_context_recreations_total", "counter", "Contexts recreated with another n_ubatch while idle.", s.n_ctx_recreations);
+        write("qllama_prompt_tokens_per_second", "gauge", "Average prompt throughput over decode time.", s.prompt_tokens_per_second());
+        write("qllama_predicted_tokens_per_second", "gauge", "Average generation throughput over decode time.", s.generated_tokens_per_second());
+        write("qllama_requests_processing", "gauge", "Sequences being decoded.", s.n_active);
+        write("qllama_requests_deferred", "gauge", "Requests waiting for a slot.", s.n_queued);
+        write("qllama_kv_cache_used_cells", "gauge", "KV cells in use.", s.n_kv_cells_used);
+        write("qllama_kv_cache_cells", "gauge", "KV cells in the context.", s.n_kv_cells);
+        write("qllama_batch_chunk_tokens", "gauge", "Prompt tokens the scheduler puts into one decode.", s.n_batch_chunk);
+        write("qllama_ubatch_tokens", "gauge", "n_ubatch of the context.", s.n_ubatch);
+
+        m_ttft.write(text, "qllama_time_to_first_token_seconds", "Time from arrival at the worker to the first sampled token.");
+        m_itl.write(text, "qllama_inter_token_latency_seconds", "Time between consecutive tokens of a request.");
+
+        return text;
+    }
+
+private:
+    std::atomic<quint64> m_n_prompt_tokens          {0};
+    std::atomic<quint64> m_n_generated_tokens       {0};
+    std::atomic<quint64> m_t_prompt_us              {0};
+    std::atomic<quint64> m_t_generation_us          {0};
+    std::atomic<quint64> m_n_decodes                {0};
+    std::atomic<quint64> m_n_requests               {0};
+    std::atomic<quint64> m_n_defrags                {0};
+    std::atomic<quint64> m_n_aborted                {0};
+    std::atomic<quint64> m_n_shared_tokens          {0};
+    std::atomic<quint64> m_n_batch_adjustments      {0};
+    std::atomic<quint64> m_n_ctx_recreations        {0};
+    std::atomic<qint32> m_n_active                  {0};
+    std::atomic<qint32> m_n_queued                  {0};
+    std::atomic<qint32> m_n_kv_cells_used           {0};
+    std::atomic<qint32> m_n_kv_cells                {0};
+    std::atomic<qint32> m_n_batch_chunk             {0};
+    std::atomic<qint32> m_n_ubatch                  {0};
+
+    QLlamaHistogram m_ttft;
+    QLlamaHistogram m_itl;
+};
+
+#endif // QLLAMAMETRICS_HPP
@@ -0,0 +1,338 @@
+#ifndef QLLAMAMODELPOOL_HPP
+#define QLLAMAMODELPOOL_HPP
+
+#include "common/common.h"
+#include <llama.h>
+
+#include <QCoreApplication>
+#include <QDeadlineTimer>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QWaitCondition>
+#include <QHash>
+#include <QString>
+#include <QElapsedTimer>
+#include <QTimer>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <string>
+
+// Process-wide registry of loaded models. Models are keyed by path and the model params
+// that affect how the weights are loaded, and handed out as shared_ptrs so any number of
+// contexts can share one set of weights. When the last handle goes away the model is not
+// freed right away but kept on warm standby, so switching back to a recently used model
+// does not reload it; standby models are freed once there are more than max_standby of
+// them or they have been unused for longer than the standby ttl. A timer on the
+// application's thread frees them when the ttl runs out even if the pool is not used
+// again; without a QCoreApplication the ttl is only checked when the pool is used.
+//
+// LoRA adapters are loaded once per model and kept with it, since every context that applies
+// one (llama_lora_adapter_set) only refers to it; they are freed together with the model.
+class QLlamaModelPool
+{
+public:
+    static QLlamaModelPool &instance()
+    {
+        static QLlamaModelPool pool;
+        return pool;
+    }
+
+    QLlamaModelPool(const QLlamaModelPool &) = delete;
+    QLlamaModelPool &operator=(const QLlamaModelPool &) = delete;
+
+    // Called with the load progress in [0, 1]; returning false aborts the load.
+    using Progress = std::function<bool(float)>;
+
+    // Returns a handle to the model described by params, loading it if it is neither in use nor on standby.
+    std::shared_ptr<llama_model> acquire(const gpt_params &params, const Progress &progress = {})
+    {
+        const QString key = key_for(params);
+
+        QMutexLocker locker(&m_mutex);
+
+        expire();
+
+        // Someone else is loading the same model; share their result.
+        while (m_entries.value(key).loading)
+            m_loaded.wait(&m_mutex);
+
+        Entry &entry = m_entries[key];
+
+        if (std::shared_ptr<llama_model> model = entry.handle.lock())
+        {
+            locker.unlock();
+            if (progress) progress(1.0f);
+
+            return model;
+        }
+
+        const bool cached = entry.model != nullptr;
+
+        if (!cached)
+        {
+            // Loading can take a while; other keys stay available meanwhile.
+            entry.loading = true;
+            locker.unlock();
+
+            llama_model *model = load(params, progress);
+
+            locker.relock();
+            m_loaded.wakeAll();
+
+            Entry &loaded = m_entries[key];
+            loaded.loading = false;
+
+            if (!model)
+            {
+                m_entries.remove(key);
+                return nullptr;
+            }
+
+            loaded.model = model;
+        }
+
+        Entry &ready = m_entries[key];
+        ready.released.invalidate();
+
+        std::shared_ptr<llama_model> model(ready.model, [this, key](llama_model *) { release(key); });
+        ready.handle = model;
+
+        locker.unlock();
+        if (cached && progress) progress(1.0f);
+
+        return model;
+    }
+
+    // The adapter at path for model, a handle from acquire(), loading it on first use.
+    llama_lora_adapter *lora_adapter(llama_model *model, const std::string &path)
+    {
+        QMutexLocker locker(&m_mutex);
+
+        for (Entry &entry : m_entries)
+        {
+            if (entry.model != model)
+                continue;
+
+            const QString key = QString::fromStdString(path);
+
+            if (llama_lora_adapter *adapter = entry.adapters.value(key))
+                return adapter;
+
+            llama_lora_adapter *adapter = llama_lora_adapter_init(model, path.c_str());
+            if (adapter)
+                entry.adapters.insert(key, adapter);
+
+            return adapter;
+        }
+
+        return nullptr;
+    }
+
+    // Whether the model described by params is loaded, in use or on standby.
+    bool contains(const gpt_params &params)
+    {
+        QMutexLocker locker(&m_mutex);
+        return m_entries.value(key_for(params)).model != nullptr;
+    }
+
+    void set_max_standby(qint32 max_standby = 1)   { QMutexLocker locker(&m_mutex); m_max_standby = std::max(max_standby, 0); expire(); }
+    void set_standby_ttl(qint64 ttl_ms = 600000)   { QMutexLocker locker(&m_mutex); m_standby_ttl_ms = ttl_ms; expire(); schedule_expire(); }
+
+    // Frees every model on standby.
+    void trim()
+    {
+        QMutexLocker locker(&m_mutex);
+
+        const qint32 max_standby = m_max_standby;
+        m_max_standby = 0;
+        expire();
+        m_max_standby = max_standby;
+    }
+
+private:
+    struct Entry
+    {
+        llama_model *model              {nullptr};
+        QHash<QString, llama_lora_adapter *> adapters;
+        std::weak_ptr<llama_model> handle;
+        QElapsedTimer released;          // valid while on standby
+        bool loading                    {false};
+    };
+
+    QMutex m_mutex;
+    QWaitCondition m_loaded;
+    QHash<QString, Entry> m_entries;
+
+    qint32 m_max_standby                {1};
+    qint64 m_standby_ttl_ms             {600000};
+    QDeadlineTimer m_expire_at          {QDeadlineTimer::Forever}; // when the armed timer fires
+
+    QLlamaModelPool()
+    {
+        llama_backend_init();
+    }
+
+    ~QLlamaModelPool()
+    {
+        for (const Entry &entry : std::as_const(m_entries))
+            unload(entry);
+
+        llama_backend_free();
+    }
+
+    static QString key_for(const gpt_params &params)
+    {
+        QString key = QString::fromStdString(params.model);
+
+        key += QString(" ngl=%1 split=%2 main=%3 mmap=%4 mlock=%5 check=%6")
+                   .arg(params.n_gpu_layers)
+                   .arg((int) params.split_mode)
+                   .arg(params.main_gpu)
+                   .arg(params.use_mmap)
+                   .arg(params.use_mlock)
+                   .arg(params.check_tensors);
+
+        key += " rpc=" + QString::fromStdString(params.rpc_servers) + " ts=";
+
+        for (size_t i = 0; i < llama_max_devices() && i < 128; ++i)
+            key += QString::number(params.tensor_split[i]) + ",";
+
+        for (const llama_model_kv_override &kvo : params.kv_overrides)
+        {
+            key += QString(" kv=") + kvo.key + "=";
+
+            switch (kvo.tag)
+            {
+            case LLAMA_KV_OVERRIDE_TYPE_INT:    key += "int:" + QString::number(kvo.val_i64); break;
+            case LLAMA_KV_OVERRIDE_TYPE_FLOAT:  key += "float:" + QString::number(kvo.val_f64, 'g', 17); break;
+            case LLAMA_KV_OVERRIDE_TYPE_BOOL:   key += kvo.val_bool ? "bool:true" : "bool:false"; break;
+            case LLAMA_KV_OVERRIDE_TYPE_STR:    key += "str:" + QString::fromUtf8(kvo.val_str); break;
+            }
+        }
+
+        return key;
+    }
+
+    static void unload(const Entry &entry)
+    {
+        for (llama_lora_adapter *adapter : entry.adapters)
+            llama_lora_adapter_free(adapter);
+
+        if (entry.model) llama_free_model(entry.model);
+    }
+
+    static llama_model *load(const gpt_params &params, const Progress &progress)
+    {
+        llama_model_params mparams = llama_model_params_from_gpt_params(params);
+
+        if (progress)
+        {
+            mparams.progress_callback = [](float p, void *user_data) { return (*static_cast<const Progress *>(user_data))(p); };
+            mparams.progress_callback_user_data = const_cast<Progress *>(&progress);
+        }
+
+        if (!params.hf_repo.empty() && !params.hf_file.empty())
+            return llama_load_model_from_hf(params.hf_repo.c_str(), params.hf_file.c_str(), params.model.c_str(), params.hf_token.c_str(), mparams);
+
+        if (!params.model_url.empty())
+            return llama_load_model_from_url(params.model_url.c_str(), params.model.c_str(), params.hf_token.c_str(), mparams);
+
+        return llama_load_model_from_file(params.model.c_str(), mparams);
+    }
+
+    void release(const QString &key)
+    {
+        QMutexLocker locker(&m_mutex);
+
+        auto it = m_entries.find(key);
+        if (it == m_entries.end())
+            return;
+
+        it->released.start();
+        expire();
+        schedule_expire();
+    }
+
+    static bool on_standby(const Entry &entry)
+    {
+        return entry.model && !entry.loading && entry.released.isValid() && entry.handle.expired();
+    }
+
+    // Frees standby models beyond the ttl and the max_standby most recently released ones.
+    // Must be called with m_mutex held.
+    void expire()
+    {
+        for (;;)
+        {
+            qint32 n_standby = 0;
+            QString oldest;
+            qint64 oldest_age = -1;
+
+            for (auto it = m_entries.cbegin(); it != m_entries.cend(); ++it)
+            {
+                if (!on_standby(*it))
+                    continue;
+
+                ++n_standby;
+
+                const qint64 age = it->released.elapsed();
+                if (age > oldest_age)
+                {
+                    oldest = it.key();
+                    oldest_age = age;
+                }
+            }
+
+            if (n_standby == 0 || (n_standby <= m_max_standby && oldest_age <= m_standby_ttl_ms))
+                return;
+
+            unload(m_entries.value(oldest));
+            m_entries.remove(oldest);
+        }
+    }
+
+    // Arms a timer for the first standby model to outlive the ttl, unless one fires before
+    // that already. Must be called with m_mutex held.
+    void schedule_expire()
+    {
+        QCoreApplication *app = QCoreApplication::instance();
+        if (!app)
+            return;
+
+        qint64 next_ms = -1;
+
+        for (const Entry &entry : std::as_const(m_entries))
+        {
+            if (!on_standby(entry))
+                continue;
+
+            const qint64 left_ms = std::max<qint64>(m_standby_ttl_ms - entry.released.elapsed(), 0) + 1;
+            if (next_ms < 0 || left_ms < next_ms)
+                next_ms = left_ms;
+        }
+
+        if (next_ms < 0 || (!m_expire_at.isForever() && m_expire_at.remainingTime() <= next_ms))
+            return;
+
+        // QTimer takes an int; a longer ttl just arms the timer again when it fires.
+        const std::chrono::milliseconds interval(std::min<qint64>(next_ms, std::numeric_limits<int>::max()));
+        m_expire_at.setRemainingTime(interval);
+
+        // The caller may be on any thread; the timer lives on the application's.
+        QMetaObject::invokeMethod(app, [this, app, interval]() {
+            QTimer::singleShot(interval, app, [this]() {
+                QMutexLocker locker(&m_mutex);
+
+                m_expire_at = QDeadlineTimer(QDeadlineTimer::Forever);
+                expire();
+                schedule_expire();
+            });
+        }, Qt::QueuedConnection);
+    }
+};
+
+#endif // QLLAMAMODELPOOL_HPP
@@ -0,0 +1,122 @@
+#ifndef QLLAMAPREFETCH_HPP
+#define QLLAMAPREFETCH_HPP
+
+#include <QFile>
+#include <QList>
+#include <QString>
+#include <QThread>
+
+#include <atomic>
+
+#ifdef Q_OS_UNIX
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Pulls a model file into the page cache from several threads while llama.cpp loads it.
+// llama.cpp mmaps the weights and touches them lazily, so without this the first requests
+// fault them in a page at a time. The file is cut into chunks that the threads claim one
+// after another; each chunk is mapped, advised as about to be read and touched page by
+// page. llama.cpp's own mapping of the file then finds the pages already cached.
+class QLlamaPrefetch
+{
+public:
+    static constexpr qint64 chunk_size = 16 * 1024 * 1024;
+
+    // Starts prefetching right away. A file that does not exist (yet) is silently skipped.
+    QLlamaPrefetch(const QString &path, qint32 n_threads)
+        : m_path(path)
+        , m_size(QFile(path).size())
+    {
+        for (qint32 i = 0; i < n_threads && m_size > 0; ++i)
+        {
+            QThread *thread = QThread::create([this]() { run(); });
+            thread->setObjectName("QLlamaPrefetch");
+            thread->start(QThread::LowPriority);
+            m_threads.append(thread);
+        }
+    }
+
+    ~QLlamaPrefetch()
+    {
+        cancel();
+        wait();
+    }
+
+    QLlamaPrefetch(const QLlamaPrefetch &) = delete;
+    QLlamaPrefetch &operator=(const QLlamaPrefetch &) = delete;
+
+    // Stops after the chunks that are currently being read.
+    void cancel() { m_cancelled.store(true, std::memory_order_relaxed); }
+
+    void wait()
+    {
+        for (QThread *thread : std::as_const(m_threads))
+        {
+            thread->wait();
+            delete thread;
+        }
+
+        m_threads.clear();
+    }
+
+    qint64 bytes_done() const { return m_bytes_done.load(std::memory_order_relaxed); }
+
+private:
+    QString m_path;
+    qint64 m_size;
+
+    QList<QThread *> m_threads;
+
+    std::atomic<qint64> m_next_chunk                {0};
+    std::atomic<qint64> m_bytes_done                {0};
+    std::atomic_bool m_cancelled                    {false};
+
+    static qint64 page_size()
+    {
+#ifdef Q_OS_UNIX
+        return sysconf(_SC_PAGESIZE);
+#else
+        return 4096;
+#endif
+    }
+
+    void run()
+    {
+        // QFile is not thread-safe, so every thread maps through its own handle.
+        QFile file(m_path);
+
+        if (!file.open(QIODevice::ReadOnly))
+            return;
+
+        const qint64 page = page_size();
+
+        while (!m_cancelled.load(std::memory_order_relaxed))
+        {
+            const qint64 offset = m_next_chunk.fetch_add(1, std::memory_order_relaxed) * chunk_size;
+
+            if (offset >= m_size)
+                break;
+
+            const qint64 size = std::min(chunk_size, m_size - offset);
+            uchar *data = file.map(offset, size);
+
+            if (!data)
+                break;
+
+#ifdef Q_OS_UNIX
+            // Lets the kernel queue the whole chunk instead of waiting on one fault at a time.
+            madvise(data, size, MADV_WILLNEED);
+#endif
+
+            volatile uchar sink = 0;
+            for (qint64 i = 0; i < size; i += page)
+                sink = sink + data[i];
+
+            file.unmap(data);
+            m_bytes_done.fetch_add(size, std::memory_order_relaxed);
+        }
+    }
+};
+
+#endif // QLLAMAPREFETCH_HPP
@@ -0,0 +1,196 @@
+#ifndef QLLAMAPREFIXTREE_HPP
+#define QLLAMAPREFIXTREE_HPP
+
+#include <llama.h>
+
+#include <QHash>
+#include <QSet>
+
+#include <map>
+#include <memory>
+#include <vector>
+
+// Token-level radix tree of the prefixes resident in the KV cache. Every sequence that holds
+// tokens at positions 0..n-1 is registered with them; a node lists the sequences holding at
+// least the tokens on the path down to its end, so the number of holders is its reference
+// count. A node nobody holds any more is dropped, and a chain that no longer branches is
+// merged back into one edge.
+//
+// The tree only indexes cells, it never owns them: whoever asks for a match has to check
+// that the holder still has the tokens before copying its cells.
+class QLlamaPrefixTree
+{
+public:
+    struct Match
+    {
+        size_t n_tokens                             {0};
+        QSet<llama_seq_id> holders;
+    };
+
+    // Registers seq as holding tokens, replacing what it was registered with before.
+    void insert(llama_seq_id seq, const std::vector<llama_token> &tokens)
+    {
+        remove(seq);
+
+        if (tokens.empty())
+            return;
+
+        QLlamaPrefixNode *node = &m_root;
+        size_t i = 0;
+
+        while (i < tokens.size())
+        {
+            auto it = node->children.find(tokens[i]);
+
+            if (it == node->children.end())
+            {
+                auto child = std::make_unique<QLlamaPrefixNode>();
+                child->edge.assign(tokens.begin() + i, tokens.end());
+                child->holders.insert(seq);
+                node->children.emplace(tokens[i], std::move(child));
+                break;
+            }
+
+            QLlamaPrefixNode *child = it->second.get();
+            const size_t n = common(child->edge, tokens, i);
+
+            if (n < child->edge.size())
+                split(*child, n);
+
+            child->holders.insert(seq);
+            node = child;
+            i += n;
+        }
+
+        m_registered.insert(seq, tokens);
+    }
+
+    void remove(llama_seq_id seq)
+    {
+        auto it = m_registered.find(seq);
+        if (it == m_registered.end())
+            return;
+
+        const std::vector<llama_token> tokens = std::move(it.value());
+        m_registered.erase(it);
+
+        // The path of seq, parents first.
+        std::vector<QLlamaPrefixNode *> path = {&m_root};
+
+        for (size_t i = 0; i < tokens.size();)
+        {
+            QLlamaPrefixNode *child = path.back()->children.at(tokens[i]).get();
+            child->holders.remove(seq);
+            path.push_back(child);
+            i += child->edge.size();
+        }
+
+        // Holders of a node also hold its parent, so the first node left without holders
+        // takes the rest of the path with it.
+        for (size_t i = 1; i < path.size(); ++i)
+        {
+            if (path[i]->holders.isEmpty())
+            {
+                path[i - 1]->children.erase(path[i]->edge.front());
+                path.resize(i);
+                break;
+            }
+        }
+
+        for (size_t i = path.size() - 1; i > 0; --i)
+            merge(*path[i]);
+    }
+
+    // Cuts the registration of seq back to the part that tokens still starts with.
+    void revalidate(llama_seq_id seq, const std::vector<llama_token> &tokens)
+    {
+        const auto it = m_registered.constFind(seq);
+        if (it == m_registered.constEnd())
+            return;
+
+        const size_t n = common(*it, tokens, 0);
+
+        if (n < it->size())
+            insert(seq, std::vector<llama_token>(it->begin(), it->begin() + n));
+    }
+
+    // The longest prefix of tokens some sequence holds, and every sequence holding it.
+    Match match(const std::vector<llama_token> &tokens) const
+    {
+        Match best;
+        const QLlamaPrefixNode *node = &m_root;
+        size_t i = 0;
+
+        while (i < tokens.size())
+        {
+            const auto it = node->children.find(tokens[i]);
+            if (it == node->children.end())
+                break;
+
+            const QLlamaPrefixNode *child = it->second.get();
+            const size_t n = common(child->edge, tokens, i);
+
+            best.n_tokens = i + n;
+            best.holders = child->holders;
+
+            if (n < child->edge.size())
+                break;
+
+            node = child;
+            i += n;
+        }
+
+        return best;
+    }
+
+    size_t n_tokens(llama_seq_id seq) const { return m_registered.value(seq).size(); }
+
+private:
+    struct QLlamaPrefixNode
+    {
+        std::vector<llama_token> edge;
+        std::map<llama_token, std::unique_ptr<QLlamaPrefixNode>> children;
+        QSet<llama_seq_id> holders;
+    };
+
+    QLlamaPrefixNode m_root;
+    QHash<llama_seq_id, std::vector<llama_token>> m_registered;
+
+    // Length of the common prefix of edge and tokens from offset.
+    static size_t common(const std::vector<llama_token> &edge, const std::vector<llama_token> &tokens, size_t offset)
+    {
+        size_t n = 0;
+        while (n < edge.size() && offset + n < tokens.size() && edge[n] == tokens[offset + n])
+            ++n;
+
+        return n;
+    }
+
+    // Ends node after n tokens of its edge; the rest becomes its only child.
+    static void split(QLlamaPrefixNode &node, size_t n)
+    {
+        auto rest = std::make_unique<QLlamaPrefixNode>();
+        rest->edge.assign(node.edge.begin() + n, node.edge.end());
+        rest->children = std::move(node.children);
+        rest->holders = node.holders;
+
+        node.edge.resize(n);
+        node.children.clear();
+        node.children.emplace(rest->edge.front(), std::move(rest));
+    }
+
+    // Folds an only child held by the same sequences back into node.
+    static void merge(QLlamaPrefixNode &node)
+    {
+        if (node.children.size() != 1 || node.children.begin()->second->holders != node.holders)
+            return;
+
+        std::unique_ptr<QLlamaPrefixNode> child = std::move(node.children.begin()->second);
+        node.children.clear();
+
+        node.edge.insert(node.edge.end(), child->edge.begin(), child->edge.end());
+        node.children = std::move(child->children);
+    }
+};
+
+#endif // QLLAMAPREFIXTREE_HPP
@@ -0,0 +1,206 @@
+#ifndef QLLAMAPROMPTCACHE_HPP
+#define QLLAMAPROMPTCACHE_HPP
+
+#include "common/common.h"
+#include <llama.h>
+
+#include <QFile>
+#include <QString>
+#include <QByteArray>
+#include <QCryptographicHash>
+
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Saves and restores the KV state of one sequence together with the tokens it holds.
+//
+// Layout: a fixed header, the tokens as int32, then the llama_state_seq_* blob at a 64 byte
+// aligned offset. Files are written and read through QFile::map(), so the state goes straight
+// between the page cache and llama_state_seq_get_data/llama_state_seq_set_data without an
+// intermediate buffer. The header carries a fingerprint of the model and of every parameter
+// that changes the KV contents; a file that does not match is ignored.
+class QLlamaPromptCache
+{
+public:
+    static constexpr quint32 magic      = 0x43504c51; // "QLPC"
+    static constexpr quint32 version    = 1;
+
+    struct Header
+    {
+        quint32 magic;
+        quint32 version;
+        char fingerprint[32];
+        quint32 n_tokens;
+        quint32 reserved;
+        quint64 state_size;
+    };
+
+    static bool save(llama_context *ctx, llama_seq_id seq_id, const gpt_params &params, const std::vector<llama_token> &tokens)
+    {
+        const QString path = QString::fromStdString(params.path_prompt_cache);
+        const QString tmp_path = path + ".tmp";
+
+        const size_t state_size = llama_state_seq_get_size(ctx, seq_id);
+        const qint64 state_offset = state_offset_for(tokens.size());
+        const qint64 size = state_offset + state_size;
+
+        QFile file(tmp_path);
+
+        if (!file.open(QIODevice::ReadWrite | QIODevice::Truncate) || !file.resize(size))
+        {
+            LOG_TEE("%s: failed to create %s: %s\n", __func__, tmp_path.toStdString().c_str(), file.errorString().toStdString().c_str());
+            return false;
+        }
+
+        uchar *data = file.map(0, size);
+
+        if (!data)
+        {
+            LOG_TEE("%s: failed to map %s: %s\n", __func__, tmp_path.toStdString().c_str(), file.errorString().toStdString().c_str());
+            file.remove();
+            return false;
+        }
+
+        Header header = {};
+        header.magic = magic;
+        header.version = version;
+        header.n_tokens = tokens.size();
+        header.state_size = state_size;
+
+        const QByteArray fp = fingerprint(ctx, params);
+        memcpy(header.fingerprint, fp.constData(), sizeof(header.fingerprint));
+
+        memcpy(data, &header, sizeof(header));
+        memcpy(data + sizeof(header), tokens.data(), tokens.size() * sizeof(llama_token));
+
+        const size_t n_written = llama_state_seq_get_data(ctx, data + state_offset, state_size, seq_id);
+
+        file.unmap(data);
+        file.close();
+
+        if (n_written != state_size)
+        {
+            LOG_TEE("%s: failed to read the state of sequence %d\n", __func__, seq_id);
+            file.remove();
+            return false;
+        }
+
+        QFile::remove(path);
+        return QFile::rename(tmp_path, path);
+    }
+
+    // On success tokens holds what the restored sequence contains. n_ctx_seq is how many cells
+    // the sequence may hold (0: the whole context); a longer cache is cut down to fit.
+    static bool load(llama_context *ctx, llama_seq_id seq_id, const gpt_params &params, std::vector<llama_token> &tokens, qint32 n_ctx_seq = 0)
+    {
+        tokens.clear();
+
+        const QString path = QString::fromStdString(params.path_prompt_cache);
+        QFile file(path);
+
+        if (!file.exists())
+            return false;
+
+        if (!file.open(QIODevice::ReadOnly))
+        {
+            LOG_TEE("%s: failed to open %s: %s\n", __func__, path.toStdString().c_str(), file.errorString().toStdString().c_str());
+            return false;
+        }
+
+        const qint64 size = file.size();
+
+        if (size < (qint64) sizeof(Header))
+            return false;
+
+        uchar *data = file.map(0, size);
+
+        if (!data)
+        {
+            LOG_TEE("%s: failed to map %s: %s\n", __func__, path.toStdString().c_str(), file.errorString().toStdString().c_str());
+            return false;
+        }
+
+        Header header;
+        memcpy(&header, data, sizeof(header));
+
+        const QByteArray fp = fingerprint(ctx, params);
+        const qint64 state_offset = state_offset_for(header.n_tokens);
+
+        if (header.magic != magic || header.version != version ||
+            memcmp(header.fingerprint, fp.constData(), sizeof(header.fingerprint)) != 0 ||
+            state_offset + (qint64) header.state_size > size ||
+            header.n_tokens >= llama_n_ctx(ctx))
+        {
+            LOG_TEE("%s: %s does not match the model or parameters, ignoring it\n", __func__, path.toStdString().c_str());
+            file.unmap(data);
+            return false;
+        }
+
+        const llama_token *cached = reinterpret_cast<const llama_token *>(data + sizeof(header));
+
+        llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+
+        const size_t n_read = llama_state_seq_set_data(ctx, data + state_offset, header.state_size, seq_id);
+
+        if (n_read == 0)
+        {
+            LOG_TEE("%s: failed to restore %s\n", __func__, path.toStdString().c_str());
+            llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+            file.unmap(data);
+            return false;
+        }
+
+        // Saved with fewer slots: the tail goes, the sequence keeps room for the next token.
+        const quint32 n_max = n_ctx_seq > 0 ? std::min<quint32>(n_ctx_seq - 1, header.n_tokens) : header.n_tokens;
+
+        if (n_max < header.n_tokens)
+        {
+            LOG_TEE("%s: %s holds %u tokens, keeping the first %u\n", __func__, path.toStdString().c_str(), header.n_tokens, n_max);
+            llama_kv_cache_seq_rm(ctx, seq_id, n_max, -1);
+        }
+
+        tokens.assign(cached, cached + n_max);
+        file.unmap(data);
+
+        return true;
+    }
+
+private:
+    static qint64 state_offset_for(size_t n_tokens)
+    {
+        const qint64 end = sizeof(Header) + n_tokens * sizeof(llama_token);
+        return (end + 63) & ~qint64(63);
+    }
+
+    // Everything that changes what ends up in the KV cells for a given token sequence.
+    static QByteArray fingerprint(const llama_context *ctx, const gpt_params &params)
+    {
+        const llama_model *model = llama_get_model(ctx);
+
+        char desc[128];
+        llama_model_desc(model, desc, sizeof(desc));
+
+        std::string info = desc;
+        info += " " + std::to_string(llama_model_n_params(model));
+        info += " " + std::to_string(llama_model_size(model));
+        info += " " + std::to_string(llama_n_vocab(model));
+        info += " " + std::to_string(llama_n_embd(model));
+        info += " " + std::to_string(llama_n_layer(model));
+        info += " " + params.cache_type_k + " " + params.cache_type_v;
+        info += " " + std::to_string(params.flash_attn);
+        info += " " + std::to_string(params.rope_freq_base) + " " + std::to_string(params.rope_freq_scale);
+        info += " " + std::to_string(params.yarn_ext_factor) + " " + std::to_string(params.yarn_orig_ctx);
+
+        for (const auto &lora : params.lora_adapter)
+            info += " " + std::get<0>(lora) + ":" + std::to_string(std::get<1>(lora));
+
+        for (const auto &cvec : params.control_vectors)
+            info += " " + cvec.fname + ":" + std::to_string(cvec.strength);
+
+        return QCryptographicHash::hash(QByteArray::fromStdString(info), QCryptographicHash::Sha256);
+    }
+};
+
+#endif // QLLAMAPROMPTCACHE_HPP
@@ -0,0 +1,746 @@
+#ifndef QLLAMASERVER_HPP
+#define QLLAMASERVER_HPP
+
+#include "common/common.h"
+#include <llama.h>
+
+#include "QLlamaInference.hpp"
+#include "QLlamaGrammarCache.hpp"
+
+#include <QObject>
+
+#include <QByteArray>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QHash>
+#include <QHostAddress>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonValue>
+#include <QList>
+#include <QString>
+#include <QStringList>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTimer>
+
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+
+// A small OpenAI-compatible HTTP/1.1 server in front of a QLlamaInference. It lives in the
+// thread of the inference object and is fully event driven: sockets are read and written
+// from the event loop while the worker thread decodes, so no HTTP thread pool is needed
+// (n_threads_http is not used). Connections are kept alive between requests, requests
+// are answered in order, and streamed responses are sent as server-sent events in HTTP
+// chunks. A client that disconnects cancels its generation.
+//
+//  GET  /health                                    200 when the model is loaded, 503 before
+//  GET  /v1/models
+//  POST /v1/completions                            prompt, optionally "stream"
+//  POST /v1/chat/completions                       messages, optionally "stream"
+//  GET  /slots                                     with endpoint_slots
+//  GET  /metrics                                   with endpoint_metrics, Prometheus text format
+//
+// The /v1 prefix is optional. When api_keys is set, everything but /health needs an
+// "Authorization: Bearer <key>" header.
+//
+// Chat requests carry the whole conversation. Finished conversations stay open as idle
+// sessions (up to n_parallel); a request whose messages extend one of them continues it,
+// so only the new messages are decoded. One that diverges inside it forks the matching
+// prefix and shares its KV cells.
+class QLlamaServer : public QObject
+{
+    Q_OBJECT
+
+public:
+    QLlamaServer(QLlamaInference *inference, QObject *parent = nullptr)
+        : QObject(parent)
+        , m_inference(inference)
+        , m_params(inference->params())
+    {
+        const QString alias = QString::fromStdString(m_params.model_alias);
+        m_model_name = alias == "unknown" ? QFileInfo(QString::fromStdString(m_params.model)).fileName() : alias;
+
+        connect(&m_server, &QTcpServer::newConnection, this, &QLlamaServer::accept);
+        connect(m_inference, &QLlamaInference::tokensGenerated, this, &QLlamaServer::tokensGenerated);
+        connect(m_inference, &QLlamaInference::generationFinished, this, &QLlamaServer::generationFinished);
+    }
+
+    ~QLlamaServer()
+    {
+        // Sockets still connected are aborted when m_server deletes them; nobody is listening then.
+        for (const auto &[socket, connection] : m_connections)
+            socket->disconnect(this);
+
+        for (const auto &[id, request] : m_requests)
+            m_inference->cancel(id);
+    }
+
+    // Listens on hostname:port from the params; returns false if the address is taken.
+    bool listen()
+    {
+        const QString hostname = QString::fromStdString(m_params.hostname);
+        const QHostAddress address = hostname == "localhost" ? QHostAddress(QHostAddress::LocalHost) : QHostAddress(hostname);
+
+        if (!m_server.listen(address, m_params.port))
+        {
+            LOG_TEE("%s: cannot listen on %s:%d: %s\n", __func__, m_params.hostname.c_str(), m_params.port, m_server.errorString().toStdString().c_str());
+            return false;
+        }
+
+        LOG_TEE("%s: listening on http://%s:%d\n", __func__, m_params.hostname.c_str(), m_server.serverPort());
+        return true;
+    }
+
+private:
+    struct QLlamaHttpRequest
+    {
+        QByteArray method;
+        QByteArray path;
+        QHash<QByteArray, QByteArray> headers;          // lowercase names
+        QByteArray body;
+        bool keep_alive                             {true};
+    };
+
+    struct QLlamaConnection
+    {
+        QTcpSocket *socket                          {nullptr};
+        QTimer timer;                                   // read timeout while idle, write timeout while sending
+        QByteArray buffer;
+        quint64 request_id                          {0}; // generation being answered, 0 if none
+        bool keep_alive                             {true};
+        bool closed                                 {false};
+    };
+
+    // A generation the server waits for. connection is null once the client has gone.
+    struct QLlamaServerRequest
+    {
+        QLlamaConnection *connection                {nullptr};
+        bool chat                                   {false};
+        bool stream                                 {false};
+        quint64 session                             {0};
+        qint64 created                              {0};
+        QStringList stop;
+        qsizetype n_hold                            {0}; // characters held back while they may start a stop string
+        QString text;
+        qsizetype n_sent                            {0};
+        qint32 n_tokens                             {0};
+        bool stopped                                {false};
+        QElapsedTimer t_start;
+    };
+
+    static constexpr qsizetype max_header_size      = 16 * 1024;
+    static constexpr qsizetype max_body_size        = 16 * 1024 * 1024;
+
+    QLlamaInference *m_inference;
+    gpt_params m_params;
+    QString m_model_name;
+
+    QTcpServer m_server;
+    std::unordered_map<QTcpSocket *, std::unique_ptr<QLlamaConnection>> m_connections;
+    std::unordered_map<quint64, QLlamaServerRequest> m_requests;
+    QList<quint64> m_idle_sessions;                     // least recently used first
+
+    void accept()
+    {
+        while (QTcpSocket *socket = m_server.nextPendingConnection())
+        {
+            socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+
+            auto connection = std::make_unique<QLlamaConnection>();
+            QLlamaConnection *c = connection.get();
+            c->socket = socket;
+            c->timer.setSingleShot(true);
+
+            // Timeouts only abort; the cleanup runs from disconnected.
+            connect(&c->timer, &QTimer::timeout, socket, &QAbstractSocket::abort);
+            connect(socket, &QIODevice::readyRead, this, [this, c]() { read(c); });
+            connect(socket, &QIODevice::bytesWritten, this, [this, c]() { arm_timer(c); });
+            connect(socket, &QAbstractSocket::disconnected, this, [this, socket]() { drop(socket); });
+
+            m_connections.emplace(socket, std::move(connection));
+            arm_timer(c);
+        }
+    }
+
+    // Disconnects can be reported from inside a write; the connection goes away on the next
+    // event loop pass, never under the feet of the code that is using it.
+    void drop(QTcpSocket *socket)
+    {
+        auto it = m_connections.find(socket);
+        if (it == m_connections.end() || it->second->closed)
+            return;
+
+        QLlamaConnection *c = it->second.get();
+        c->closed = true;
+        c->timer.stop();
+
+        if (c->request_id)
+        {
+            auto request = m_requests.find(c->request_id);
+            if (request != m_requests.end())
+                request->second.connection = nullptr;
+
+            m_inference->cancel(c->request_id);
+        }
+
+        QMetaObject::invokeMethod(this, [this, socket]() {
+            m_connections.erase(socket);
+            socket->deleteLater();
+        }, Qt::QueuedConnection);
+    }
+
+    void arm_timer(QLlamaConnection *c)
+    {
+        if (c->closed)
+            return;
+
+        if (c->socket->bytesToWrite() > 0)
+            c->timer.start(std::max(m_params.timeout_write, 1) * 1000);
+        else if (c->request_id)
+            c->timer.stop();
+        else
+            c->timer.start(std::max(m_params.timeout_read, 1) * 1000);
+    }
+
+    void read(QLlamaConnection *c)
+    {
+        c->buffer += c->socket->readAll();
+
+        if (!c->request_id)
+            arm_timer(c);
+
+        process(c);
+    }
+
+    // Answers the buffered requests in order; stops at one that is still generating.
+    void process(QLlamaConnection *c)
+    {
+        while (!c->closed && !c->request_id)
+        {
+            const qsizetype header_end = c->buffer.indexOf("\r\n\r\n");
+
+            if (header_end < 0)
+            {
+                if (c->buffer.size() > max_header_size)
+                    close_with_error(c, 431, "request header too large");
+                return;
+            }
+
+            QLlamaHttpRequest request;
+            const QList<QByteArray> lines = c->buffer.left(header_end).split('\n');
+            const QList<QByteArray> request_line = lines.value(0).trimmed().split(' ');
+
+            if (request_line.size() != 3 || !request_line[2].startsWith("HTTP/1."))
+            {
+                close_with_error(c, 400, "malformed request line");
+                return;
+            }
+
+            request.method = request_line[0];
+            request.path = request_line[1].left(request_line[1].indexOf('?') < 0 ? request_line[1].size() : request_line[1].indexOf('?'));
+
+            for (qsizetype i = 1; i < lines.size(); ++i)
+            {
+                const qsizetype colon = lines[i].indexOf(':');
+                if (colon > 0)
+                    request.headers.insert(lines[i].left(colon).trimmed().toLower(), lines[i].mid(colon + 1).trimmed());
+            }
+
+            const QByteArray connection = request.headers.value("connection").toLower();
+            request.keep_alive = request_line[2] == "HTTP/1.1" ? connection != "close" : connection == "keep-alive";
+
+            if (request.headers.contains("transfer-encoding"))
+            {
+                close_with_error(c, 501, "chunked request bodies are not supported");
+                return;
+            }
+
+            bool ok = true;
+            const qint64 content_length = request.headers.value("content-length", "0").toLongLong(&ok);
+
+            if (!ok || content_length < 0 || content_length > max_body_size)
+            {
+                close_with_error(c, 413, "request body too large");
+                return;
+            }
+
+            const qsizetype request_size = header_end + 4 + content_length;
+            if (c->buffer.size() < request_size)
+                return;
+
+            request.body = c->buffer.mid(header_end + 4, content_length);
+            c->buffer.remove(0, request_size);
+            c->keep_alive = request.keep_alive;
+
+            handle(c, request);
+        }
+    }
+
+    void handle(QLlamaConnection *c, const QLlamaHttpRequest &request)
+    {
+        const QByteArray path = request.path.startsWith("/v1/") ? request.path.mid(3) : request.path;
+
+        if (path == "/health")
+        {
+            if (m_inference->isLoaded())
+                respond(c, 200, QJsonObject{{"status", "ok"}});
+            else
+                respond(c, 503, error_body(503, "loading model", "unavailable_error"));
+            return;
+        }
+
+        if (!authorized(request))
+        {
+            respond(c, 401, error_body(401, "invalid api key", "authentication_error"));
+            return;
+        }
+
+        const bool get = request.method == "GET";
+        const bool post = request.method == "POST";
+
+        if (path == "/models" && get)
+            respond(c, 200, models());
+        else if (path == "/slots" && get && m_params.endpoint_slots)
+            respond(c, 200, slot_info());
+        else if (path == "/metrics" && get && m_params.endpoint_metrics)
+            respond(c, 200, m_inference->metricsText(), "text/plain; version=0.0.4");
+        else if ((path == "/completions" || path == "/chat/completions") && post)
+            complete(c, request.body, path == "/chat/completions");
+        else if (path == "/models" || path == "/completions" || path == "/chat/completions")
+            respond(c, 405, error_body(405, "method not allowed"));
+        else
+            respond(c, 404, error_body(404, "not found"));
+    }
+
+    bool authorized(const QLlamaHttpRequest &request) const
+    {
+        if (m_params.api_keys.empty())
+            return true;
+
+        const QByteArray authorization = request.headers.value("authorization");
+        if (!authorization.startsWith("Bearer "))
+            return false;
+
+        const std::string key = authorization.mid(7).trimmed().toStdString();
+        return std::find(m_params.api_keys.begin(), m_params.api_keys.end(), key) != m_params.api_keys.end();
+    }
+
+    void complete(QLlamaConnection *c, const QByteArray &body, bool chat)
+    {
+        if (!m_inference->isLoaded())
+        {
+            respond(c, 503, error_body(503, "loading model", "unavailable_error"));
+            return;
+        }
+
+        const QJsonDocument document = QJsonDocument::fromJson(body);
+        const QJsonObject input = document.object();
+
+        if (!document.isObject() || (chat ? !input.value("messages").isArray() : !input.value("prompt").isString()))
+        {
+            respond(c, 400, error_body(400, chat ? "expected an object with a messages array" : "expected an object with a prompt string"));
+            return;
+        }
+
+        llama_sampling_params sparams = m_inference->sparams();
+        sparams.temp = input.value("temperature").toDouble(sparams.temp);
+        sparams.top_k = input.value("top_k").toInt(sparams.top_k);
+        sparams.top_p = input.value("top_p").toDouble(sparams.top_p);
+        sparams.min_p = input.value("min_p").toDouble(sparams.min_p);
+        sparams.penalty_repeat = input.value("repeat_penalty").toDouble(sparams.penalty_repeat);
+        sparams.penalty_freq = input.value("frequency_penalty").toDouble(sparams.penalty_freq);
+        sparams.penalty_present = input.value("presence_penalty").toDouble(sparams.penalty_present);
+        sparams.seed = input.value("seed").toInteger(sparams.seed);
+        sparams.grammar = input.value("grammar").toString(QString::fromStdString(sparams.grammar)).toStdString();
+
+        const qint32 n_predict = input.value("max_tokens").toInt(input.value("n_predict").toInt(m_params.n_predict));
+
+        QLlamaGrammarCache::Grammar grammar;
+        const QJsonObject response_format = input.value("response_format").toObject();
+        const QString format = response_format.value("type").toString();
+        const QJsonValue schema = format == "json_schema" ? response_format.value("json_schema").toObject().value("schema")
+                                : format == "json_object" ? response_format.value("schema")
+                                : input.value("json_schema");
+
+        if (schema.isObject() || format == "json_object")
+        {
+            grammar = QLlamaGrammarCache::instance().schema(QJsonDocument(schema.toObject()).toJson(QJsonDocument::Compact));
+
+            if (!grammar)
+            {
+                respond(c, 400, error_body(400, "the json schema cannot be compiled"));
+                return;
+            }
+        }
+
+        QLlamaServerRequest request;
+        request.connection = c;
+        request.chat = chat;
+        request.stream = input.value("stream").toBool(false);
+        request.created = QDateTime::currentSecsSinceEpoch();
+        request.t_start.start();
+
+        const QJsonValue stop = input.value("stop");
+        if (stop.isString())
+            request.stop.append(stop.toString());
+        for (const QJsonValue &value : stop.toArray())
+            if (!value.toString().isEmpty()) request.stop.append(value.toString());
+
+        for (const QString &s : std::as_const(request.stop))
+            request.n_hold = std::max(request.n_hold, s.size() - 1);
+
+        quint64 id = 0;
+
+        if (chat)
+        {
+            request.session = acquire_session(input.value("messages").toArray());
+
+            if (input.contains("priority"))
+                m_inference->setSessionPriority(request.session, input.value("priority").toInt());
+
+            id = m_inference->reply(request.session, sparams, n_predict, -1, std::move(grammar));
+
+            if (!id)
+                m_inference->closeSession(request.session);
+        }
+        else
+        {
+            id = m_inference->generate(input.value("prompt").toString(), sparams, n_predict, -1, std::move(grammar));
+        }
+
+        if (!id)
+        {
+            respond(c, 500, error_body(500, "the request could not be queued", "server_error"));
+            return;
+        }
+
+        c->request_id = id;
+        arm_timer(c);
+
+        if (request.stream)
+        {
+            write_head(c, 200, "text/event-stream", -1, "Cache-Control: no-cache\r\n");
+
+            // Chat streams announce the role first.
+            if (chat)
+                send_event(c, chunk(id, request, QJsonObject{{"role", "assistant"}, {"content", ""}}, QJsonValue::Null));
+        }
+
+        m_requests.emplace(id, std::move(request));
+    }
+
+    // An idle session whose messages are a prefix of messages is continued. If it only shares
+    // some of its messages, a fork of them is. The remaining messages are added to the session.
+    quint64 acquire_session(const QJsonArray &messages)
+    {
+        qsizetype best = -1;
+        size_t n_best = 0;
+
+        for (qsizetype i = 0; i < m_idle_sessions.size(); ++i)
+        {
+            const QLlamaChatHistory history = m_inference->chatHistory(m_idle_sessions[i]);
+            const std::vector<llama_chat_msg> &msgs = history.msgs();
+
+            size_t n_match = 0;
+            while (n_match < msgs.size() && n_match + 1 < (size_t) messages.size() &&
+                   msgs[n_match].role == messages[n_match].toObject().value("role").toString().toStdString() &&
+                   msgs[n_match].content == messages[n_match].toObject().value("content").toString().toStdString())
+            {
+                ++n_match;
+            }
+
+            if (n_match > n_best)
+            {
+                best = i;
+                n_best = n_match;
+            }
+        }
+
+        quint64 session = 0;
+
+        if (best >= 0)
+        {
+            const quint64 idle = m_idle_sessions[best];
+
+            if (n_best == m_inference->chatHistory(idle).msgs().size())
+            {
+                session = m_idle_sessions.takeAt(best);
+            }
+            else
+            {
+                session = m_inference->forkSession(idle, n_best);
+
+                // The idle session is the least likely to be continued now.
+                m_idle_sessions.move(best, 0);
+            }
+        }
+
+        if (!session)
+        {
+            session = m_inference->openSession();
+            n_best = 0;
+        }
+
+        for (qsizetype i = n_best; i < messages.size(); ++i)
+        {
+            const QJsonObject message = messages[i].toObject();
+            m_inference->addChatMessage(session, message.value("role").toString(), message.value("content").toString());
+        }
+
+        return session;
+    }
+
+    void release_session(quint64 session)
+    {
+        m_idle_sessions.append(session);
+
+        while (m_idle_sessions.size() > std::max(m_params.n_parallel, 1))
+            m_inference->closeSession(m_idle_sessions.takeFirst());
+    }
+
+    void tokensGenerated(quint64 id, const QList<llama_token> &tokens, const QString &text)
+    {
+        auto it = m_requests.find(id);
+        if (it == m_requests.end())
+            return;
+
+        QLlamaServerRequest &request = it->second;
+        request.n_tokens += tokens.size();
+
+        if (request.stopped)
+            return;
+
+        const qsizetype from = std::max<qsizetype>(0, request.text.size() - request.n_hold);
+        request.text += text;
+
+        for (const QString &s : std::as_const(request.stop))
+        {
+            const qsizetype pos = request.text.indexOf(s, from);
+
+            if (pos >= 0)
+            {
+                request.text.truncate(pos);
+                request.stopped = true;
+                m_inference->cancel(id);
+            }
+        }
+
+        if (!request.stream || !request.connection)
+            return;
+
+        const qsizetype n_ready = request.stopped ? request.text.size() : std::max(request.n_sent, request.text.size() - request.n_hold);
+
+        if (n_ready > request.n_sent)
+        {
+            send_event(request.connection, chunk(id, request, request.text.mid(request.n_sent, n_ready - request.n_sent), QJsonValue::Null));
+            request.n_sent = n_ready;
+        }
+    }
+
+    void generationFinished(quint64 id, QLlamaWorker::StopReason reason, const QString &)
+    {
+        auto it = m_requests.find(id);
+        if (it == m_requests.end())
+            return;
+
+        QLlamaServerRequest request = std::move(it->second);
+        m_requests.erase(it);
+
+        if (request.session)
+            release_session(request.session);
+
+        QLlamaConnection *c = request.connection;
+        if (!c)
+            return;
+
+        c->request_id = 0;
+
+        const QString finish_reason = request.stopped || reason == QLlamaWorker::StopEog ? "stop" : "length";
+
+        if (request.stream)
+        {
+            if (reason == QLlamaWorker::StopError)
+            {
+                send_event(c, QJsonDocument(error_body(500, "generation failed", "server_error")).toJson(QJsonDocument::Compact));
+            }
+            else
+            {
+                if (request.n_sent < request.text.size())
+                    send_event(c, chunk(id, request, request.text.mid(request.n_sent), QJsonValue::Null));
+
+                send_event(c, chunk(id, request, QString(), finish_reason));
+            }
+
+            send_event(c, "[DONE]");
+
+            // The last chunk of the chunked body.
+            c->socket->write("0\r\n\r\n");
+            finish_response(c);
+        }
+        else if (reason == QLlamaWorker::StopError)
+        {
+            respond(c, 500, error_body(500, "generation failed", "server_error"));
+        }
+        else
+        {
+            QJsonObject choice{{"index", 0}, {"finish_reason", finish_reason}};
+
+            if (request.chat)
+                choice["message"] = QJsonObject{{"role", "assistant"}, {"content", request.text}};
+            else
+                choice["text"] = request.text;
+
+            respond(c, 200, QJsonObject{
+                {"id", response_id(id, request.chat)},
+                {"object", request.chat ? "chat.completion" : "text_completion"},
+                {"created", request.created},
+                {"model", m_model_name},
+                {"choices", QJsonArray{choice}},
+                {"usage", QJsonObject{{"completion_tokens", request.n_tokens}}},
+            });
+        }
+
+        // Requests that arrived while this one was generating.
+        process(c);
+    }
+
+    QString response_id(quint64 id, bool chat) const
+    {
+        return (chat ? "chatcmpl-" : "cmpl-") + QString::number(id);
+    }
+
+    // One streamed chunk; content is the delta object for chat, the text otherwise.
+    QByteArray chunk(quint64 id, const QLlamaServerRequest &request, const QJsonValue &content, const QJsonValue &finish_reason) const
+    {
+        QJsonObject choice{{"index", 0}, {"finish_reason", finish_reason}};
+
+        if (request.chat)
+            choice["delta"] = content.isString() ? (content.toString().isEmpty() ? QJsonObject() : QJsonObject{{"content", content}}) : content;
+        else
+            choice["text"] = content;
+
+        return QJsonDocument(QJsonObject{
+            {"id", response_id(id, request.chat)},
+            {"object", request.chat ? "chat.completion.chunk" : "text_completion"},
+            {"created", request.created},
+            {"model", m_model_name},
+            {"choices", QJsonArray{choice}},
+        }).toJson(QJsonDocument::Compact);
+    }
+
+    QJsonObject error_body(int status, const QString &message, const QString &type = "invalid_request_error") const
+    {
+        return QJsonObject{{"error", QJsonObject{{"code", status}, {"message", message}, {"type", type}}}};
+    }
+
+    QJsonObject models() const
+    {
+        return QJsonObject{
+            {"object", "list"},
+            {"data", QJsonArray{QJsonObject{{"id", m_model_name}, {"object", "model"}, {"owned_by", "llamacpp"},
+                                            {"meta", QJsonObject{{"n_ctx", m_inference->n_ctx()}, {"n_ctx_train", m_inference->n_ctx_train()}}}}}},
+        };
+    }
+
+    QJsonObject slot_info() const
+    {
+        QJsonArray requests;
+
+        for (const auto &[id, request] : m_requests)
+        {
+            requests.append(QJsonObject{
+                {"id", (qint64) id},
+                {"endpoint", request.chat ? "chat" : "completion"},
+                {"session", (qint64) request.session},
+                {"n_tokens", request.n_tokens},
+                {"elapsed_ms", request.t_start.elapsed()},
+            });
+        }
+
+        return QJsonObject{{"n_parallel", m_params.n_parallel}, {"idle_sessions", m_idle_sessions.size()}, {"requests", requests}};
+    }
+
+    static QByteArray status_text(int status)
+    {
+        switch (status)
+        {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 401: return "Unauthorized";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 413: return "Payload Too Large";
+        case 431: return "Request Header Fields Too Large";
+        case 500: return "Internal Server Error";
+        case 501: return "Not Implemented";
+        case 503: return "Service Unavailable";
+        default:  return "Unknown";
+        }
+    }
+
+    // A negative content_length starts a chunked body.
+    void write_head(QLlamaConnection *c, int status, const QByteArray &content_type, qint64 content_length, const QByteArray &extra = QByteArray())
+    {
+        QByteArray head;
+        head.reserve(256);
+        head += "HTTP/1.1 " + QByteArray::number(status) + ' ' + status_text(status) + "\r\n";
+        head += "Content-Type: " + content_type + "\r\n";
+        head += content_length < 0 ? QByteArray("Transfer-Encoding: chunked\r\n") : "Content-Length: " + QByteArray::number(content_length) + "\r\n";
+        head += c->keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+        head += extra;
+        head += "\r\n";
+
+        c->socket->write(head);
+        arm_timer(c);
+    }
+
+    // The body is handed to the socket as it is; it is not copied into a response buffer first.
+    void respond(QLlamaConnection *c, int status, const QByteArray &body, const QByteArray &content_type)
+    {
+        write_head(c, status, content_type, body.size());
+        c->socket->write(body);
+        finish_response(c);
+    }
+
+    void respond(QLlamaConnection *c, int status, const QJsonObject &body)
+    {
+        respond(c, status, QJsonDocument(body).toJson(QJsonDocument::Compact), "application/json");
+    }
+
+    void close_with_error(QLlamaConnection *c, int status, const QString &message)
+    {
+        c->keep_alive = false;
+        respond(c, status, error_body(status, message));
+    }
+
+    // One server-sent event in one HTTP chunk.
+    void send_event(QLlamaConnection *c, const QByteArray &data)
+    {
+        QByteArray frame;
+        frame.reserve(data.size() + 24);
+        frame += QByteArray::number(data.size() + 8, 16) + "\r\n";
+        frame += "data: " + data + "\n\n";
+        frame += "\r\n";
+
+        c->socket->write(frame);
+        arm_timer(c);
+    }
+
+    void finish_response(QLlamaConnection *c)
+    {
+        if (!c->keep_alive)
+        {
+            c->buffer.clear();
+            c->socket->disconnectFromHost();
+            return;
+        }
+
+        arm_timer(c);
+    }
+};
+
+#endif // QLLAMASERVER_HPP
@@ -0,0 +1,379 @@
+#ifndef QLLAMASESSIONSTORE_HPP
+#define QLLAMASESSIONSTORE_HPP
+
+#include "common/common.h"
+#include <llama.h>
+
+#include <QByteArray>
+#include <QCoreApplication>
+#include <QDir>
+#include <QFile>
+#include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QString>
+#include <QThread>
+#include <QWaitCondition>
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <vector>
+
+// Keeps the KV cells of idle sessions that had to give up their slot, so that the session's
+// next request restores them instead of evaluating its whole history again. States are kept
+// in host memory as they are; when the memory budget is exceeded the least recently used ones
+// go to disk, under fs_get_cache_directory(), and when the disk budget is exceeded the least
+// recently used ones are dropped. A dropped session is rebuilt from its tokens.
+//
+// Files are written on a thread of the store's own, so spilling never waits for the disk. A
+// state counts against the disk budget as soon as its write is queued, and against the memory
+// budget until the write has finished; a session restored before that uses the copy in
+// memory. States that would push the writes in flight over the memory budget are dropped
+// instead of queued, so a slow disk cannot make host memory grow.
+//
+// Session ids only mean something to one QLlamaInference, so every store writes to a
+// directory of its own, named after the process and a per-process store number, and removes
+// it again when it is destroyed. Used from the worker
+// thread only, apart from the budget setters.
+class QLlamaSessionStore
+{
+public:
+    explicit QLlamaSessionStore(llama_context *ctx)
+        : m_ctx(ctx)
+    {
+    }
+
+    ~QLlamaSessionStore()
+    {
+        if (m_thread)
+        {
+            {
+                QMutexLocker locker(&m_mutex);
+                m_stop = true;
+                m_queued.wakeOne();
+            }
+
+            m_thread->wait();
+            delete m_thread;
+        }
+
+        if (!m_directory.isEmpty())
+            QDir(m_directory).removeRecursively();
+    }
+
+    // Safe to call from any thread.
+    void set_memory_budget_mb(qint32 memory_mb = 1024) { m_memory_budget.store(qint64(std::max(memory_mb, 0)) << 20, std::memory_order_relaxed); }
+    void set_disk_budget_mb(qint32 disk_mb = 8192)      { m_disk_budget.store(qint64(std::max(disk_mb, 0)) << 20, std::memory_order_relaxed); }
+
+    // The worker recreated its context; stored states fit any context of the same model.
+    void set_context(llama_context *ctx) { m_ctx = ctx; }
+
+    bool contains(quint64 session) const { return m_entries.contains(session); }
+
+    // Stores the cells of seq_id for session, which holds tokens at positions up to n_past with
+    // self-extend at ga_i. False if the state does not fit into either budget.
+    bool spill(quint64 session, llama_seq_id seq_id, const std::vector<llama_token> &tokens, qint32 n_past, qint32 ga_i)
+    {
+        remove(session);
+
+        if (tokens.empty())
+            return false;
+
+        QByteArray state(llama_state_seq_get_size(m_ctx, seq_id), Qt::Uninitialized);
+
+        if (llama_state_seq_get_data(m_ctx, reinterpret_cast<uint8_t *>(state.data()), state.size(), seq_id) != (size_t) state.size())
+        {
+            LOG_TEE("%s: cannot serialize sequence %d\n", __func__, seq_id);
+            return false;
+        }
+
+        QLlamaSessionEntry entry;
+        entry.data = std::move(state);
+        entry.size = entry.data.size();
+        entry.tokens = tokens;
+        entry.n_past = n_past;
+        entry.ga_i = ga_i;
+        entry.last_used = ++m_tick;
+
+        if (entry.size > std::max(m_memory_budget.load(std::memory_order_relaxed), m_disk_budget.load(std::memory_order_relaxed)))
+        {
+            LOG("%s: session %llu needs %lld bytes, more than any budget\n", __func__, (unsigned long long) session, (long long) entry.size);
+            return false;
+        }
+
+        m_memory_bytes += entry.size;
+        m_entries.insert(session, std::move(entry));
+
+        LOG("%s: session %llu, %zu tokens in %lld bytes\n", __func__, (unsigned long long) session, tokens.size(), (long long) m_entries[session].size);
+
+        enforce_budgets();
+
+        return m_entries.contains(session);
+    }
+
+    // Restores session into seq_id and hands over what it holds. The stored copy is dropped
+    // either way; false leaves seq_id empty.
+    bool restore(quint64 session, llama_seq_id seq_id, std::vector<llama_token> &tokens, qint32 &n_past, qint32 &ga_i)
+    {
+        auto it = m_entries.find(session);
+        if (it == m_entries.end())
+            return false;
+
+        QLlamaSessionEntry entry = std::move(it.value());
+        m_entries.erase(it);
+
+        QByteArray state = std::move(entry.data);
+
+        if (entry.write)
+        {
+            // A write that has not finished yet gives back its copy in memory and removes the file itself.
+            if (!take_write(*entry.write, state))
+            {
+                QFile file(entry.write->path);
+
+                if (file.open(QIODevice::ReadOnly))
+                    state = file.readAll();
+                else
+                    LOG_TEE("%s: failed to open %s: %s\n", __func__, entry.write->path.toStdString().c_str(), file.errorString().toStdString().c_str());
+
+                file.close();
+                file.remove();
+            }
+
+            m_disk_bytes -= entry.size;
+        }
+        else
+        {
+            m_memory_bytes -= entry.size;
+        }
+
+        llama_kv_cache_seq_rm(m_ctx, seq_id, -1, -1);
+
+        if (state.isEmpty() || llama_state_seq_set_data(m_ctx, reinterpret_cast<const uint8_t *>(state.constData()), state.size(), seq_id) == 0)
+        {
+            LOG_TEE("%s: cannot restore session %llu, it is evaluated again\n", __func__, (unsigned long long) session);
+            llama_kv_cache_seq_rm(m_ctx, seq_id, -1, -1);
+            return false;
+        }
+
+        tokens = std::move(entry.tokens);
+        n_past = entry.n_past;
+        ga_i = entry.ga_i;
+
+        return true;
+    }
+
+    void remove(quint64 session)
+    {
+        auto it = m_entries.find(session);
+        if (it == m_entries.end())
+            return;
+
+        if (it->write)
+        {
+            QByteArray unused;
+            if (!take_write(*it->write, unused))
+                QFile::remove(it->write->path);
+
+            m_disk_bytes -= it->size;
+        }
+        else
+        {
+            m_memory_bytes -= it->size;
+        }
+
+        m_entries.erase(it);
+    }
+
+private:
+    // A state on its way to disk. Shared by the entry and the writer's queue; the fields other
+    // than path are guarded by m_mutex.
+    struct QLlamaSessionWrite
+    {
+        QString path;
+        QByteArray data;                            // released once written
+        qint64 size                                 {0};
+        bool done                                   {false};
+        bool dropped                                {false}; // the writer removes the file
+    };
+
+    struct QLlamaSessionEntry
+    {
+        QByteArray data;                            // the state while in memory
+        std::shared_ptr<QLlamaSessionWrite> write;  // set once it went to disk
+        qint64 size                                 {0};
+        std::vector<llama_token> tokens;
+        qint32 n_past                               {0};
+        qint32 ga_i                                 {0};
+        quint64 last_used                           {0};
+    };
+
+    llama_context *m_ctx;
+    QString m_directory;
+
+    QHash<quint64, QLlamaSessionEntry> m_entries;
+    qint64 m_memory_bytes                           {0};
+    qint64 m_disk_bytes                             {0};
+    quint64 m_tick                                  {0};
+
+    std::atomic<qint64> m_memory_budget             {qint64(1024) << 20};
+    std::atomic<qint64> m_disk_budget               {qint64(8192) << 20};
+
+    QThread *m_thread                               {nullptr};
+    QMutex m_mutex;
+    QWaitCondition m_queued;
+    std::deque<std::shared_ptr<QLlamaSessionWrite>> m_writes;
+    bool m_stop                                     {false};
+    std::atomic<qint64> m_writing_bytes             {0}; // queued or being written, still in memory
+
+    // The least recently used entry in memory (on_disk false) or on disk.
+    quint64 lru(bool on_disk) const
+    {
+        quint64 session = 0;
+        quint64 last_used = 0;
+
+        for (auto it = m_entries.cbegin(); it != m_entries.cend(); ++it)
+        {
+            if (!it->write == on_disk)
+                continue;
+
+            if (!session || it->last_used < last_used)
+            {
+                session = it.key();
+                last_used = it->last_used;
+            }
+        }
+
+        return session;
+    }
+
+    void enforce_budgets()
+    {
+        const qint64 memory_budget = m_memory_budget.load(std::memory_order_relaxed);
+
+        while (m_memory_bytes + m_writing_bytes.load(std::memory_order_relaxed) > memory_budget)
+        {
+            // Only writes in flight are left; they give their memory back as they finish.
+            const quint64 session = lru(false);
+            if (!session)
+                break;
+
+            const bool fits = m_writing_bytes.load(std::memory_order_relaxed) + m_entries[session].size <= memory_budget;
+
+            if (m_disk_budget.load(std::memory_order_relaxed) == 0 || !fits || !write_out(session))
+                remove(session);
+        }
+
+        while (m_disk_bytes > m_disk_budget.load(std::memory_order_relaxed))
+            remove(lru(true));
+    }
+
+    bool write_out(quint64 session)
+    {
+        if (m_directory.isEmpty())
+        {
+            // Session ids of different QLlamaInference instances overlap.
+            static std::atomic<quint32> n_stores {0};
+
+            m_directory = QString::fromStdString(fs_get_cache_directory()) + "qllama-sessions/"
+                        + QString::number(QCoreApplication::applicationPid()) + "-" + QString::number(n_stores.fetch_add(1, std::memory_order_relaxed));
+
+            if (!QDir().mkpath(m_directory))
+            {
+                LOG_TEE("%s: cannot create %s\n", __func__, m_directory.toStdString().c_str());
+                m_directory.clear();
+                return false;
+            }
+
+            m_thread = QThread::create([this]() { run(); });
+            m_thread->setObjectName("QLlamaSessionStore");
+            m_thread->start(QThread::LowPriority);
+        }
+
+        QLlamaSessionEntry &entry = m_entries[session];
+
+        entry.write = std::make_shared<QLlamaSessionWrite>();
+        entry.write->path = m_directory + "/" + QString::number(session) + ".kv";
+        entry.write->data = std::move(entry.data);
+        entry.write->size = entry.size;
+
+        m_memory_bytes -= entry.size;
+        m_disk_bytes += entry.size;
+        m_writing_bytes.fetch_add(entry.size, std::memory_order_relaxed);
+
+        QMutexLocker locker(&m_mutex);
+        m_writes.push_back(entry.write);
+        m_queued.wakeOne();
+
+        return true;
+    }
+
+    // Takes the state of a write that has not finished yet into data and leaves the file to the
+    // writer. False once it has finished; the file, if the write succeeded, is the caller's.
+    bool take_write(QLlamaSessionWrite &write, QByteArray &data)
+    {
+        QMutexLocker locker(&m_mutex);
+
+        if (write.done)
+            return false;
+
+        data = std::move(write.data);
+        write.data.clear();
+        write.dropped = true;
+
+        return true;
+    }
+
+    void run()
+    {
+        QMutexLocker locker(&m_mutex);
+
+        for (;;)
+        {
+            while (m_writes.empty() && !m_stop)
+                m_queued.wait(&m_mutex);
+
+            // The directory goes with the store, so what is still queued need not be written.
+            if (m_stop)
+                return;
+
+            const std::shared_ptr<QLlamaSessionWrite> write = std::move(m_writes.front());
+            m_writes.pop_front();
+
+            // Its state went back to the store, which has let go of it since.
+            if (write->dropped)
+            {
+                m_writing_bytes.fetch_sub(write->size, std::memory_order_relaxed);
+                continue;
+            }
+
+            const QByteArray data = write->data;
+
+            locker.unlock();
+
+            QFile file(write->path);
+            const bool written = file.open(QIODevice::WriteOnly | QIODevice::Truncate) && file.write(data) == data.size();
+
+            // A failed write leaves no file, and restoring the session evaluates it again.
+            if (!written)
+            {
+                LOG_TEE("%s: failed to write %s: %s\n", __func__, write->path.toStdString().c_str(), file.errorString().toStdString().c_str());
+                file.remove();
+            }
+
+            file.close();
+
+            locker.relock();
+
+            write->done = true;
+            write->data.clear();
+            m_writing_bytes.fetch_sub(write->size, std::memory_order_relaxed);
+
+            if (write->dropped)
+                QFile::remove(write->path);
+        }
+    }
+};
+
+#endif // QLLAMASESSIONSTORE_HPP
@@ -0,0 +1,293 @@
+#ifndef QLLAMATHREADTUNER_HPP
+#define QLLAMATHREADTUNER_HPP
+
+#include "common/common.h"
+#include <llama.h>
+
+#include <QByteArray>
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+#include <QString>
+#include <QSysInfo>
+
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Picks n_threads and n_threads_batch by measuring instead of guessing. cpu_get_num_math()
+// only counts cores, which is wrong as often as not with SMT, hybrid cores or several sockets.
+// tune() times a short prompt (prompt processing, n_threads_batch) and a run of single-token
+// decodes (generation, n_threads) for a handful of thread counts on the real context.
+//
+// Results are kept in fs_get_cache_directory()/qllama-threads.json, keyed by a hash of the
+// CPU and of the model and parameters that change the work per token, so each machine pays
+// for the benchmark once per model.
+class QLlamaThreadTuner
+{
+public:
+    struct Result
+    {
+        qint32 n_threads                            {0};
+        qint32 n_threads_batch                      {0};
+
+        bool valid() const { return n_threads > 0 && n_threads_batch > 0; }
+    };
+
+    static Result lookup(const llama_model *model, const gpt_params &params)
+    {
+        QFile file(path());
+
+        if (!file.open(QIODevice::ReadOnly))
+            return {};
+
+        const QJsonObject entry = QJsonDocument::fromJson(file.readAll()).object().value(key_for(model, params)).toObject();
+
+        return {entry.value("n_threads").toInt(), entry.value("n_threads_batch").toInt()};
+    }
+
+    static bool store(const llama_model *model, const gpt_params &params, const Result &result)
+    {
+        const QString cache = path();
+
+        if (!fs_create_directory_with_parents(fs_get_cache_directory()))
+            return false;
+
+        QJsonObject entries;
+        QFile file(cache);
+
+        if (file.open(QIODevice::ReadOnly))
+            entries = QJsonDocument::fromJson(file.readAll()).object();
+
+        file.close();
+
+        QJsonObject entry;
+        entry["n_threads"] = result.n_threads;
+        entry["n_threads_batch"] = result.n_threads_batch;
+        entry["cpu"] = cpu_signature();
+
+        entries[key_for(model, params)] = entry;
+
+        // Several processes may tune at once; the last one to finish wins, nobody reads half a file.
+        QSaveFile out(cache);
+
+        if (!out.open(QIODevice::WriteOnly) || out.write(QJsonDocument(entries).toJson()) < 0 || !out.commit())
+        {
+            LOG_TEE("%s: failed to write %s: %s\n", __func__, cache.toStdString().c_str(), out.errorString().toStdString().c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    // Benchmarks ctx, which must be otherwise unused, and leaves it empty and set to the best
+    // thread counts. Returns an invalid result if cancelled or if decoding fails.
+    static Result tune(llama_context *ctx, const gpt_params &params, const std::atomic_bool *cancelled = nullptr)
+    {
+        const llama_model *model = llama_get_model(ctx);
+        const qint32 n_ctx = llama_n_ctx(ctx);
+        const qint32 n_pp = std::min({(qint32) llama_n_ubatch(ctx), 128, n_ctx - n_tg - 1});
+
+        if (n_pp < 1)
+            return {};
+
+        // The contents do not matter for the timing, only that they are valid tokens.
+        std::mt19937 rng(42);
+        std::uniform_int_distribution<llama_token> dist(0, llama_n_vocab(model) - 1);
+
+        std::vector<llama_token> tokens(n_pp + n_tg);
+        for (llama_token &token : tokens)
+            token = dist(rng);
+
+        llama_batch batch = llama_batch_init(n_pp, 0, 1);
+
+        Result best;
+        double best_pp = 0.0;
+        double best_tg = 0.0;
+
+        for (const qint32 n_threads : candidates())
+        {
+            if (cancelled && cancelled->load(std::memory_order_relaxed))
+            {
+                best = {};
+                break;
+            }
+
+            llama_set_n_threads(ctx, n_threads, n_threads);
+
+            double pp = 0.0;
+            double tg = 0.0;
+
+            // The faster of two runs; the first one also warms up the threads.
+            for (int rep = 0; rep < 2; ++rep)
+            {
+                double t_pp = 0.0;
+                double t_tg = 0.0;
+
+                if (!measure(ctx, batch, tokens, n_pp, t_pp, t_tg))
+                {
+                    llama_batch_free(batch);
+                    llama_kv_cache_clear(ctx);
+                    return {};
+                }
+
+                pp = std::max(pp, n_pp / t_pp);
+                tg = std::max(tg, n_tg / t_tg);
+            }
+
+            LOG("%s: %d threads: %.1f prompt t/s, %.1f generation t/s\n", __func__, n_threads, pp, tg);
+
+            if (pp > best_pp) { best_pp = pp; best.n_threads_batch = n_threads; }
+            if (tg > best_tg) { best_tg = tg; best.n_threads = n_threads; }
+
+            // Past the point where both got clearly slower, more threads only contend for memory bandwidth.
+            if (pp < 0.75 * best_pp && tg < 0.75 * best_tg)
+                break;
+        }
+
+        llama_batch_free(batch);
+        llama_kv_cache_clear(ctx);
+        llama_reset_timings(ctx);
+
+        if (best.valid())
+        {
+            llama_set_n_threads(ctx, best.n_threads, best.n_threads_batch);
+            LOG_TEE("%s: n_threads = %d, n_threads_batch = %d\n", __func__, best.n_threads, best.n_threads_batch);
+        }
+        else
+        {
+            llama_set_n_threads(ctx, params.n_threads, params.n_threads_batch > 0 ? params.n_threads_batch : params.n_threads);
+        }
+
+        return best;
+    }
+
+    // Removes --autotune-threads from the command line, which gpt_params_parse would reject,
+    // and returns whether it was there.
+    static bool take_flag(int &argc, char *argv[])
+    {
+        char **end = std::remove_if(argv + 1, argv + argc, [](const char *arg) { return strcmp(arg, "--autotune-threads") == 0; });
+        const bool found = end != argv + argc;
+
+        argc = end - argv;
+        argv[argc] = nullptr;
+
+        return found;
+    }
+
+private:
+    static constexpr qint32 n_tg = 16;
+
+    static QString path()
+    {
+        return QString::fromStdString(fs_get_cache_directory()) + "qllama-threads.json";
+    }
+
+    // Powers of two up to the hardware threads, and what the heuristics would have picked.
+    static std::vector<qint32> candidates()
+    {
+        const qint32 n_hw = std::max<qint32>(std::thread::hardware_concurrency(), 1);
+
+        std::vector<qint32> counts = {n_hw, n_hw / 2, cpu_get_num_physical_cores(), cpu_get_num_math()};
+
+        for (qint32 n = 1; n < n_hw; n *= 2)
+            counts.push_back(n);
+
+        counts.erase(std::remove_if(counts.begin(), counts.end(), [n_hw](qint32 n) { return n < 1 || n > n_hw; }), counts.end());
+        std::sort(counts.begin(), counts.end());
+        counts.erase(std::unique(counts.begin(), counts.end()), counts.end());
+
+        return counts;
+    }
+
+    // Times one n_pp token prompt and n_tg single-token decodes after it, in seconds.
+    static bool measure(llama_context *ctx, llama_batch &batch, const std::vector<llama_token> &tokens, qint32 n_pp, double &t_pp, double &t_tg)
+    {
+        llama_kv_cache_clear(ctx);
+
+        llama_batch_clear(batch);
+        for (qint32 i = 0; i < n_pp; ++i)
+            llama_batch_add(batch, tokens[i], i, { 0 }, i == n_pp - 1);
+
+        QElapsedTimer timer;
+        timer.start();
+
+        if (llama_decode(ctx, batch) != 0)
+            return false;
+
+        llama_synchronize(ctx);
+        t_pp = std::max<qint64>(timer.nsecsElapsed(), 1) / 1e9;
+
+        timer.restart();
+
+        for (qint32 i = 0; i < n_tg; ++i)
+        {
+            llama_batch_clear(batch);
+            llama_batch_add(batch, tokens[n_pp + i], n_pp + i, { 0 }, true);
+
+            if (llama_decode(ctx, batch) != 0)
+                return false;
+
+            llama_synchronize(ctx);
+        }
+
+        t_tg = std::max<qint64>(timer.nsecsElapsed(), 1) / 1e9;
+
+        return true;
+    }
+
+    static QString cpu_signature()
+    {
+        QString model;
+        QFile cpuinfo("/proc/cpuinfo");
+
+        if (cpuinfo.open(QIODevice::ReadOnly))
+        {
+            for (QByteArray line = cpuinfo.readLine(); !line.isEmpty(); line = cpuinfo.readLine())
+            {
+                if (line.startsWith("model name"))
+                {
+                    model = QString::fromUtf8(line.mid(line.indexOf(':') + 1)).trimmed();
+                    break;
+                }
+            }
+        }
+
+        return QString("%1 %2 hw=%3 physical=%4 math=%5")
+            .arg(QSysInfo::currentCpuArchitecture(), model)
+            .arg(std::thread::hardware_concurrency())
+            .arg(cpu_get_num_physical_cores())
+            .arg(cpu_get_num_math());
+    }
+
+    // The CPU, the ggml build, and everything about the model that changes the work per token.
+    static QString key_for(const llama_model *model, const gpt_params &params)
+    {
+        char desc[128];
+        llama_model_desc(model, desc, sizeof(desc));
+
+        std::string info = cpu_signature().toStdString();
+        info += " ";
+        info += llama_print_system_info();
+        info += " ";
+        info += desc;
+        info += " " + std::to_string(llama_model_n_params(model));
+        info += " " + std::to_string(llama_model_size(model));
+        info += " ngl=" + std::to_string(params.n_gpu_layers);
+        info += " ub=" + std::to_string(params.n_ubatch);
+        info += " " + params.cache_type_k + " " + params.cache_type_v;
+        info += " fa=" + std::to_string(params.flash_attn);
+        info += " numa=" + std::to_string((int) params.numa);
+
+        return QString::fromLatin1(QCryptographicHash::hash(QByteArray::fromStdString(info), QCryptographicHash::Sha256).toHex());
+    }
+};
+
+#endif // QLLAMATHREADTUNER_HPP
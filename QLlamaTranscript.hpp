@@ -0,0 +1,761 @@
+#ifndef QLLAMATRANSCRIPT_HPP
+#define QLLAMATRANSCRIPT_HPP
+
+#include <QAbstractItemView>
+#include <QAbstractListModel>
+#include <QStyledItemDelegate>
+
+#include <QCache>
+#include <QFont>
+#include <QFontMetrics>
+#include <QHash>
+#include <QList>
+#include <QPainter>
+#include <QPaintEvent>
+#include <QResizeEvent>
+#include <QScrollBar>
+#include <QString>
+#include <QTextLayout>
+#include <QtMath>
+
+#include <algorithm>
+#include <bit>
+#include <limits>
+#include <memory>
+#include <vector>
+
+struct QLlamaTranscriptMessage
+{
+    QString role;
+    QString text;
+    quint64 key                                     {0}; // never reused, keys the layout cache
+    quint32 revision                                {0}; // bumped on every change to text
+    bool streaming                                  {false};
+};
+
+// The messages of a conversation, one row each. Streamed text is appended to the row of the
+// request that produces it; text is only ever appended, which lets the delegate keep the
+// layout of everything but the last paragraph.
+class QLlamaTranscriptModel : public QAbstractListModel
+{
+    Q_OBJECT
+
+public:
+    enum Role
+    {
+        RoleRole = Qt::UserRole,
+        KeyRole,
+        RevisionRole,
+        StreamingRole
+    };
+
+    explicit QLlamaTranscriptModel(QObject *parent = nullptr)
+        : QAbstractListModel(parent)
+    {
+    }
+
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override
+    {
+        return parent.isValid() ? 0 : m_messages.size();
+    }
+
+    QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override
+    {
+        if (!index.isValid() || index.row() >= m_messages.size())
+            return QVariant();
+
+        const QLlamaTranscriptMessage &message = m_messages.at(index.row());
+
+        switch (role)
+        {
+        case Qt::DisplayRole:   return message.text;
+        case RoleRole:          return message.role;
+        case KeyRole:           return message.key;
+        case RevisionRole:      return message.revision;
+        case StreamingRole:     return message.streaming;
+        default:                return QVariant();
+        }
+    }
+
+    // A non-zero request_id marks the message as streaming; text generated for that request
+    // is appended to it until finishMessage().
+    qint32 appendMessage(const QString &role, const QString &text = QString(), quint64 request_id = 0)
+    {
+        const qint32 row = m_messages.size();
+
+        beginInsertRows(QModelIndex(), row, row);
+
+        QLlamaTranscriptMessage message;
+        message.role = role;
+        message.text = text;
+        message.key = ++m_last_key;
+        message.streaming = request_id != 0;
+        m_messages.append(message);
+
+        if (request_id)
+            m_streaming.insert(request_id, row);
+
+        endInsertRows();
+
+        return row;
+    }
+
+    // Matches QLlamaStreamBuffer::textReady. Text for unknown requests is dropped.
+    void appendText(quint64 request_id, const QString &text)
+    {
+        const auto it = m_streaming.constFind(request_id);
+
+        if (it == m_streaming.constEnd() || text.isEmpty())
+            return;
+
+        QLlamaTranscriptMessage &message = m_messages[it.value()];
+        message.text += text;
+        ++message.revision;
+
+        const QModelIndex changed = index(it.value());
+        emit dataChanged(changed, changed, { Qt::DisplayRole, RevisionRole });
+    }
+
+    void finishMessage(quint64 request_id)
+    {
+        const auto it = m_streaming.constFind(request_id);
+
+        if (it == m_streaming.constEnd())
+            return;
+
+        const qint32 row = it.value();
+        m_streaming.erase(it);
+        m_messages[row].streaming = false;
+
+        const QModelIndex changed = index(row);
+        emit dataChanged(changed, changed, { StreamingRole });
+    }
+
+    void clear()
+    {
+        beginResetModel();
+        m_messages.clear();
+        m_streaming.clear();
+        endResetModel();
+    }
+
+private:
+    QList<QLlamaTranscriptMessage> m_messages;
+    QHash<quint64, qint32> m_streaming;             // request id -> row
+    quint64 m_last_key                              {0};
+};
+
+// Paints a message as a role header followed by its text. Layouts are built per paragraph and
+// cached per message, so appending to a message only lays out its last paragraph again, and
+// messages that are never painted are never laid out: sizeHint() falls back to an estimate
+// from the text length until the view asks for the exact size with layoutSize().
+class QLlamaTranscriptDelegate : public QStyledItemDelegate
+{
+    Q_OBJECT
+
+public:
+    static constexpr qint32 padding = 8;
+
+    explicit QLlamaTranscriptDelegate(QObject *parent = nullptr)
+        : QStyledItemDelegate(parent)
+    {
+    }
+
+    void set_max_layouts(qint32 max_layouts = 256) { m_layouts.setMaxCost(std::max(max_layouts, 1)); }
+
+    QSize sizeHint(const QStyleOptionViewItem &option, const QModelIndex &index) const override
+    {
+        const qint32 width = text_width(option);
+        const QLlamaTextLayout *layout = m_layouts.object(index.data(QLlamaTranscriptModel::KeyRole).toULongLong());
+
+        if (layout && layout->width == width && layout->revision == index.data(QLlamaTranscriptModel::RevisionRole).toUInt())
+            return size_for(option, layout->height);
+
+        // Rough line count from the average character width; corrected once the row is painted.
+        const QFontMetrics metrics(option.font);
+        const qint64 n_chars = index.data(Qt::DisplayRole).toString().size();
+        const qint64 n_lines = std::max<qint64>(1, (n_chars * metrics.averageCharWidth() + width - 1) / width);
+
+        return size_for(option, n_lines * metrics.lineSpacing());
+    }
+
+    // Exact size; lays the message out if the cached layout is stale.
+    QSize layoutSize(const QStyleOptionViewItem &option, const QModelIndex &index) const
+    {
+        return size_for(option, layout_for(option, index).height);
+    }
+
+    void paint(QPainter *painter, const QStyleOptionViewItem &option, const QModelIndex &index) const override
+    {
+        const QLlamaTextLayout &layout = layout_for(option, index);
+
+        painter->save();
+
+        if (option.state & QStyle::State_Selected)
+            painter->fillRect(option.rect, option.palette.highlight());
+        else if (index.data(QLlamaTranscriptModel::RoleRole).toString() == "user")
+            painter->fillRect(option.rect, option.palette.alternateBase());
+
+        QFont header = option.font;
+        header.setBold(true);
+
+        const QFontMetrics metrics(header);
+        painter->setFont(header);
+        painter->setPen(option.palette.color(QPalette::Text));
+        painter->drawText(option.rect.left() + padding, option.rect.top() + padding + metrics.ascent(),
+                          index.data(QLlamaTranscriptModel::RoleRole).toString());
+
+        const QPointF origin(option.rect.left() + padding, option.rect.top() + padding + metrics.lineSpacing());
+
+        painter->setFont(option.font);
+        for (const QLlamaParagraph &paragraph : layout.paragraphs)
+            paragraph.layout->draw(painter, origin + QPointF(0, paragraph.y));
+
+        painter->restore();
+    }
+
+private:
+    struct QLlamaParagraph
+    {
+        std::unique_ptr<QTextLayout> layout;
+        qint32 start                                {0};
+        qreal y                                     {0};
+        qreal height                                {0};
+    };
+
+    struct QLlamaTextLayout
+    {
+        qint32 width                                {0};
+        quint32 revision                            {0};
+        qint32 n_chars                              {0};
+        qreal height                                {0};
+        std::vector<QLlamaParagraph> paragraphs;
+    };
+
+    mutable QCache<quint64, QLlamaTextLayout> m_layouts {256};
+
+    static qint32 text_width(const QStyleOptionViewItem &option)
+    {
+        return std::max(option.rect.width() - 2 * padding, 1);
+    }
+
+    static QSize size_for(const QStyleOptionViewItem &option, qreal text_height)
+    {
+        QFont header = option.font;
+        header.setBold(true);
+
+        const qint32 header_height = QFontMetrics(header).lineSpacing();
+
+        return QSize(option.rect.width(), 2 * padding + header_height + qCeil(text_height));
+    }
+
+    const QLlamaTextLayout &layout_for(const QStyleOptionViewItem &option, const QModelIndex &index) const
+    {
+        const quint64 key = index.data(QLlamaTranscriptModel::KeyRole).toULongLong();
+        const quint32 revision = index.data(QLlamaTranscriptModel::RevisionRole).toUInt();
+        const qint32 width = text_width(option);
+
+        QLlamaTextLayout *layout = m_layouts.object(key);
+
+        if (layout && layout->width == width && layout->revision == revision)
+            return *layout;
+
+        const QString text = index.data(Qt::DisplayRole).toString();
+
+        if (!layout || layout->width != width || text.size() < layout->n_chars)
+        {
+            layout = new QLlamaTextLayout;
+            layout->width = width;
+            m_layouts.insert(key, layout);
+        }
+
+        // Text was appended: only the last paragraph can have changed.
+        qint32 start = 0;
+        if (!layout->paragraphs.empty())
+        {
+            start = layout->paragraphs.back().start;
+            layout->height = layout->paragraphs.back().y;
+            layout->paragraphs.pop_back();
+        }
+
+        while (start <= text.size())
+        {
+            qint32 end = text.indexOf('\n', start);
+            if (end < 0) end = text.size();
+
+            QLlamaParagraph paragraph;
+            paragraph.start = start;
+            paragraph.y = layout->height;
+            paragraph.layout = std::make_unique<QTextLayout>(text.mid(start, end - start), option.font);
+            paragraph.layout->setCacheEnabled(true);
+            paragraph.layout->beginLayout();
+
+            for (;;)
+            {
+                QTextLine line = paragraph.layout->createLine();
+                if (!line.isValid())
+                    break;
+
+                line.setLineWidth(width);
+                line.setPosition(QPointF(0, paragraph.height));
+                paragraph.height += line.height();
+            }
+
+            paragraph.layout->endLayout();
+
+            layout->height += paragraph.height;
+            layout->paragraphs.push_back(std::move(paragraph));
+
+            start = end + 1;
+        }
+
+        layout->revision = revision;
+        layout->n_chars = text.size();
+
+        return *layout;
+    }
+};
+
+// Prefix sums over row heights (a Fenwick tree), so the offset of a row and the row at an
+// offset are found in O(log n) and appending a row costs O(log n) instead of a relayout.
+class QLlamaRowHeights
+{
+public:
+    qint32 size() const { return m_heights.size(); }
+    qint64 total() const { return offset(size()); }
+    qint32 height(qint32 row) const { return m_heights[row]; }
+
+    void clear()
+    {
+        m_heights.clear();
+        m_tree.clear();
+    }
+
+    void append(qint32 height)
+    {
+        const qint32 i = m_heights.size() + 1;
+        const qint32 lowbit = i & -i;
+
+        m_heights.push_back(height);
+        m_tree.push_back(height + offset(i - 1) - offset(i - lowbit));
+    }
+
+    void set(qint32 row, qint32 height)
+    {
+        const qint64 delta = height - m_heights[row];
+        m_heights[row] = height;
+
+        for (qint32 i = row + 1; i <= size(); i += i & -i)
+            m_tree[i - 1] += delta;
+    }
+
+    // Sum of the heights of rows [0, row).
+    qint64 offset(qint32 row) const
+    {
+        qint64 sum = 0;
+        for (qint32 i = row; i > 0; i -= i & -i)
+            sum += m_tree[i - 1];
+
+        return sum;
+    }
+
+    // The row covering y, or size() if y is past the end.
+    qint32 row_at(qint64 y) const
+    {
+        qint32 i = 0;
+
+        for (qint32 step = std::bit_floor<quint32>(size()); step > 0; step >>= 1)
+        {
+            if (i + step <= size() && m_tree[i + step - 1] <= y)
+            {
+                i += step;
+                y -= m_tree[i - 1];
+            }
+        }
+
+        return i;
+    }
+
+private:
+    std::vector<qint32> m_heights;
+    std::vector<qint64> m_tree;
+};
+
+// A vertical list for QLlamaTranscriptModel that only measures and paints the rows in the
+// viewport. Rows outside of it keep the delegate's estimate until they are scrolled into view,
+// so scrolling and appending cost the same however long the transcript is. While the view is
+// scrolled to the bottom it follows new text.
+//
+// Measuring happens in a queued call after the geometry or the scroll position changed, never
+// while painting, since it changes the scroll bar. Offsets are 64-bit; a transcript taller
+// than the int range of QScrollBar scrolls in steps of m_scale pixels.
+class QLlamaTranscriptView : public QAbstractItemView
+{
+    Q_OBJECT
+
+public:
+    static constexpr qint32 single_step = 20;
+
+    explicit QLlamaTranscriptView(QWidget *parent = nullptr)
+        : QAbstractItemView(parent)
+        , m_delegate(new QLlamaTranscriptDelegate(this))
+    {
+        setItemDelegate(m_delegate);
+        setSelectionMode(QAbstractItemView::ExtendedSelection);
+        setVerticalScrollMode(QAbstractItemView::ScrollPerPixel);
+        setHorizontalScrollBarPolicy(Qt::ScrollBarAlwaysOff);
+
+        connect(verticalScrollBar(), &QScrollBar::valueChanged, this, &QLlamaTranscriptView::schedule_measure);
+    }
+
+    QRect visualRect(const QModelIndex &index) const override
+    {
+        if (!index.isValid() || index.row() >= m_rows.size())
+            return QRect();
+
+        return QRect(0, to_viewport(m_rows.offset(index.row())), viewport()->width(), m_rows.height(index.row()));
+    }
+
+    void scrollTo(const QModelIndex &index, ScrollHint hint = EnsureVisible) override
+    {
+        if (!index.isValid() || index.row() >= m_rows.size())
+            return;
+
+        const qint64 top = m_rows.offset(index.row());
+        const qint64 bottom = top + m_rows.height(index.row());
+        const qint32 height = viewport()->height();
+        const qint64 offset = content_offset();
+
+        switch (hint)
+        {
+        case PositionAtTop:     set_content_offset(top); break;
+        case PositionAtBottom:  set_content_offset(bottom - height); break;
+        case PositionAtCenter:  set_content_offset(top - (height - (bottom - top)) / 2); break;
+        case EnsureVisible:
+            if (top < offset) set_content_offset(top);
+            else if (bottom > offset + height) set_content_offset(std::min<qint64>(top, bottom - height));
+            break;
+        }
+    }
+
+    QModelIndex indexAt(const QPoint &point) const override
+    {
+        const qint32 row = m_rows.row_at(point.y() + content_offset());
+
+        return model() && row < m_rows.size() ? model()->index(row, 0, rootIndex()) : QModelIndex();
+    }
+
+public slots:
+    void reset() override
+    {
+        QAbstractItemView::reset();
+        rebuild();
+    }
+
+protected slots:
+    void rowsInserted(const QModelIndex &parent, int start, int end) override
+    {
+        QAbstractItemView::rowsInserted(parent, start, end);
+
+        if (parent != rootIndex())
+            return;
+
+        const bool follow = at_bottom();
+
+        // Appending is the common case; anything else shifts every offset after it.
+        if (start == m_rows.size())
+        {
+            const QStyleOptionViewItem option = item_option();
+            for (qint32 row = start; row <= end; ++row)
+                m_rows.append(m_delegate->sizeHint(option, model()->index(row, 0, rootIndex())).height());
+        }
+        else
+        {
+            rebuild();
+        }
+
+        updateGeometries();
+        if (follow) verticalScrollBar()->setValue(verticalScrollBar()->maximum());
+    }
+
+    void rowsAboutToBeRemoved(const QModelIndex &parent, int start, int end) override
+    {
+        QAbstractItemView::rowsAboutToBeRemoved(parent, start, end);
+
+        if (parent != rootIndex())
+            return;
+
+        // The model still has the rows; drop them from the heights by hand.
+        QLlamaRowHeights rows;
+        for (qint32 row = 0; row < m_rows.size(); ++row)
+            if (row < start || row > end) rows.append(m_rows.height(row));
+
+        m_rows = std::move(rows);
+        updateGeometries();
+    }
+
+    void dataChanged(const QModelIndex &top_left, const QModelIndex &bottom_right, const QList<int> &roles = QList<int>()) override
+    {
+        QAbstractItemView::dataChanged(top_left, bottom_right, roles);
+
+        if (top_left.parent() != rootIndex())
+            return;
+
+        const bool follow = at_bottom();
+        const QStyleOptionViewItem option = item_option();
+        const qint32 first_visible = m_rows.row_at(content_offset());
+        const qint32 last_visible = m_rows.row_at(content_offset() + viewport()->height());
+
+        for (qint32 row = top_left.row(); row <= bottom_right.row() && row < m_rows.size(); ++row)
+        {
+            const QModelIndex index = model()->index(row, 0, rootIndex());
+
+            // Rows on screen are laid out right away so a streaming message does not jump
+            // between its estimated and exact height every frame.
+            const bool visible = row >= first_visible && row <= last_visible;
+            m_rows.set(row, (visible ? m_delegate->layoutSize(option, index) : m_delegate->sizeHint(option, index)).height());
+        }
+
+        updateGeometries();
+        if (follow) verticalScrollBar()->setValue(verticalScrollBar()->maximum());
+        viewport()->update();
+    }
+
+    void updateGeometries() override
+    {
+        QScrollBar *bar = verticalScrollBar();
+        const qint64 offset = content_offset();
+        const qint64 range = max_offset();
+        const qint64 scale = range / std::numeric_limits<int>::max() + 1;
+
+        bar->setPageStep(std::max<qint64>(viewport()->height() / scale, 1));
+        bar->setSingleStep(std::max<qint64>(single_step / scale, 1));
+        bar->setRange(0, (range + scale - 1) / scale);
+
+        // Keep the same content on screen when the step size changes.
+        if (scale != m_scale)
+        {
+            m_scale = scale;
+            set_content_offset(offset);
+        }
+
+        QAbstractItemView::updateGeometries();
+        schedule_measure();
+    }
+
+protected:
+    QModelIndex moveCursor(CursorAction action, Qt::KeyboardModifiers) override
+    {
+        if (!model() || m_rows.size() == 0)
+            return QModelIndex();
+
+        const qint32 row = currentIndex().isValid() ? currentIndex().row() : 0;
+        const qint32 page = std::max(m_rows.row_at(m_rows.offset(row) + viewport()->height()) - row, 1);
+
+        switch (action)
+        {
+        case MoveUp:
+        case MovePrevious:  return model()->index(std::max(row - 1, 0), 0, rootIndex());
+        case MoveDown:
+        case MoveNext:      return model()->index(std::min(row + 1, m_rows.size() - 1), 0, rootIndex());
+        case MovePageUp:    return model()->index(std::max(row - page, 0), 0, rootIndex());
+        case MovePageDown:  return model()->index(std::min(row + page, m_rows.size() - 1), 0, rootIndex());
+        case MoveHome:      return model()->index(0, 0, rootIndex());
+        case MoveEnd:       return model()->index(m_rows.size() - 1, 0, rootIndex());
+        default:            return currentIndex();
+        }
+    }
+
+    int horizontalOffset() const override { return 0; }
+    int verticalOffset() const override { return std::min<qint64>(content_offset(), std::numeric_limits<int>::max()); }
+
+    bool isIndexHidden(const QModelIndex &) const override { return false; }
+
+    void setSelection(const QRect &rect, QItemSelectionModel::SelectionFlags flags) override
+    {
+        if (!model() || m_rows.size() == 0)
+            return;
+
+        const QRect normalized = rect.normalized();
+        const qint32 first = std::min(m_rows.row_at(normalized.top() + content_offset()), m_rows.size() - 1);
+        const qint32 last = std::min(m_rows.row_at(normalized.bottom() + content_offset()), m_rows.size() - 1);
+
+        selectionModel()->select(QItemSelection(model()->index(first, 0, rootIndex()), model()->index(last, 0, rootIndex())), flags);
+    }
+
+    QRegion visualRegionForSelection(const QItemSelection &selection) const override
+    {
+        QRegion region;
+
+        for (const QItemSelectionRange &range : selection)
+        {
+            const QRect top = visualRect(model()->index(range.top(), 0, rootIndex()));
+            const QRect bottom = visualRect(model()->index(range.bottom(), 0, rootIndex()));
+            region += top.united(bottom);
+        }
+
+        return region;
+    }
+
+    void paintEvent(QPaintEvent *event) override
+    {
+        if (!model())
+            return;
+
+        QPainter painter(viewport());
+        QStyleOptionViewItem option = item_option();
+
+        const qint64 offset = content_offset();
+        qint32 row = m_rows.row_at(offset);
+
+        for (qint64 y = m_rows.offset(row) - offset; row < m_rows.size() && y < event->rect().bottom() + 1; ++row)
+        {
+            const QModelIndex index = model()->index(row, 0, rootIndex());
+
+            option.rect = QRect(0, y, viewport()->width(), m_rows.height(row));
+            option.state &= ~QStyle::State_Selected;
+            if (selectionModel() && selectionModel()->isSelected(index))
+                option.state |= QStyle::State_Selected;
+
+            if (option.rect.intersects(event->rect()))
+                itemDelegateForIndex(index)->paint(&painter, option, index);
+
+            y += m_rows.height(row);
+        }
+    }
+
+    void resizeEvent(QResizeEvent *event) override
+    {
+        QAbstractItemView::resizeEvent(event);
+
+        // Every layout depends on the width; estimates are cheap, visible rows get measured
+        // again right after.
+        if (event->size().width() != event->oldSize().width())
+            rebuild();
+        else
+            updateGeometries();
+    }
+
+    void scrollContentsBy(int dx, int dy) override
+    {
+        // dy is in scroll bar steps, which are only pixels while m_scale is 1.
+        if (m_scale == 1)
+            QAbstractItemView::scrollContentsBy(dx, dy);
+        else
+            viewport()->update();
+    }
+
+private:
+    QLlamaTranscriptDelegate *m_delegate;
+    QLlamaRowHeights m_rows;
+    qint64 m_scale                                  {1}; // pixels per scroll bar step
+    bool m_measure_scheduled                        {false};
+    bool m_measuring                                {false};
+
+    qint64 max_offset() const
+    {
+        return std::max<qint64>(m_rows.total() - viewport()->height(), 0);
+    }
+
+    // The offset of the top of the viewport into the transcript, in pixels.
+    qint64 content_offset() const
+    {
+        return std::min(qint64(verticalScrollBar()->value()) * m_scale, max_offset());
+    }
+
+    void set_content_offset(qint64 offset)
+    {
+        verticalScrollBar()->setValue(std::clamp<qint64>(offset, 0, max_offset()) / m_scale);
+    }
+
+    // A transcript offset relative to the viewport, kept where QRect arithmetic cannot overflow.
+    qint32 to_viewport(qint64 y) const
+    {
+        constexpr qint64 limit = std::numeric_limits<int>::max() / 2;
+
+        return std::clamp<qint64>(y - content_offset(), -limit, limit);
+    }
+
+    QStyleOptionViewItem item_option() const
+    {
+        QStyleOptionViewItem option;
+        initViewItemOption(&option);
+        option.rect = QRect(0, 0, viewport()->width(), 0);
+
+        return option;
+    }
+
+    bool at_bottom() const
+    {
+        return verticalScrollBar()->value() >= verticalScrollBar()->maximum();
+    }
+
+    void rebuild()
+    {
+        const bool follow = at_bottom();
+        m_rows.clear();
+
+        if (model())
+        {
+            const QStyleOptionViewItem option = item_option();
+            const qint32 n_rows = model()->rowCount(rootIndex());
+
+            for (qint32 row = 0; row < n_rows; ++row)
+                m_rows.append(m_delegate->sizeHint(option, model()->index(row, 0, rootIndex())).height());
+        }
+
+        updateGeometries();
+        if (follow) verticalScrollBar()->setValue(verticalScrollBar()->maximum());
+        viewport()->update();
+    }
+
+    void schedule_measure()
+    {
+        if (m_measure_scheduled || m_measuring)
+            return;
+
+        m_measure_scheduled = true;
+        QMetaObject::invokeMethod(this, [this]() { m_measure_scheduled = false; measure_visible(); }, Qt::QueuedConnection);
+    }
+
+    // Replaces the estimates of the rows in the viewport with their exact heights. Fixing a
+    // height moves the rows after it, so this repeats until the visible range settles.
+    void measure_visible()
+    {
+        if (!model())
+            return;
+
+        const QStyleOptionViewItem option = item_option();
+        const bool follow = at_bottom();
+
+        m_measuring = true;
+
+        for (qint32 pass = 0; pass < 3; ++pass)
+        {
+            bool changed = false;
+            const qint64 offset = content_offset();
+
+            for (qint32 row = m_rows.row_at(offset); row < m_rows.size() && m_rows.offset(row) < offset + viewport()->height(); ++row)
+            {
+                const qint32 height = m_delegate->layoutSize(option, model()->index(row, 0, rootIndex())).height();
+
+                if (height != m_rows.height(row))
+                {
+                    m_rows.set(row, height);
+                    changed = true;
+                }
+            }
+
+            if (!changed)
+                break;
+
+            updateGeometries();
+            if (follow) verticalScrollBar()->setValue(verticalScrollBar()->maximum());
+            viewport()->update();
+        }
+
+        m_measuring = false;
+    }
+};
+
+#endif // QLLAMATRANSCRIPT_HPP
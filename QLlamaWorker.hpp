@@ -0,0 +1,2179 @@
+#ifndef QLLAMAWORKER_HPP
+#define QLLAMAWORKER_HPP
+
+#include "common/common.h"
+#include "common/ngram-cache.h"
+#include <llama.h>
+
+#include "QLlamaPromptCache.hpp"
+#include "QLlamaLogWriter.hpp"
+#include "QLlamaGrammarCache.hpp"
+#include "QLlamaDetokenizer.hpp"
+#include "QLlamaMetrics.hpp"
+#include "QLlamaSessionStore.hpp"
+#include "QLlamaPrefixTree.hpp"
+#include "QLlamaBatchController.hpp"
+
+#include <QObject>
+
+#include <QByteArray>
+#include <QList>
+#include <QHash>
+#include <QSet>
+#include <QString>
+#include <QDeadlineTimer>
+#include <QElapsedTimer>
+#include <QMetaObject>
+#include <QTimer>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// A single generation job handed to QLlamaWorker. The cancellation flag is shared with
+// the submitting thread so it can be raised without taking a lock.
+struct QLlamaRequest
+{
+    quint64 id                                      {0};
+    quint64 session                                 {0}; // 0 = no session, any free slot will do
+    QString prompt;
+    std::vector<llama_token> tokens;                     // used instead of prompt when not empty
+    qint32 n_keep                                   {-1}; // >= 0: keep this many session tokens and append tokens
+    bool resume_sampling                            {false}; // continue the session's sampler and grammar state
+    qint32 n_candidates                             {1};  // > 1: n-best, or beam search with beam
+    bool beam                                       {false};
+    qint32 n_predict                                {-1};
+    qint32 priority                                 {0};  // higher runs first and may preempt lower
+    QDeadlineTimer deadline                         {QDeadlineTimer::Forever};
+    llama_sampling_params sparams;
+    QLlamaGrammarCache::Grammar grammar;                 // takes the place of sparams.grammar
+    std::shared_ptr<std::atomic_bool> cancelled     {std::make_shared<std::atomic_bool>(false)};
+    QElapsedTimer t_queued;                              // started when the worker receives it
+};
+
+// One completion of an n-best or beam request. logprob is the sum of the log-probabilities
+// of its tokens: for n-best the raw model log-probabilities, before temperature, truncation,
+// penalties and grammar; for beam search those after penalties, logit bias and the grammar,
+// which is what the beams are ranked by.
+struct QLlamaCandidate
+{
+    QString text;
+    QList<llama_token> tokens;
+    double logprob                                  {0.0};
+};
+
+// Speculative decoding counters since the worker was created.
+struct QLlamaDraftStats
+{
+    quint64 n_drafted                               {0};
+    quint64 n_accepted                              {0};
+
+    double acceptance() const { return n_drafted ? double(n_accepted) / n_drafted : 0.0; }
+};
+
+// Owns a llama_context and runs the decode/sample loop on whatever thread it lives in.
+// The context is split into n_parallel slots, one llama_seq_id each. Every call to step()
+// assembles a single llama_batch from all active slots (one sampled token per generating
+// slot, prompt chunks for the rest), decodes it once and re-posts itself, so requests
+// submitted through the event loop are admitted while others are still generating.
+//
+// With a draft context, a slot that is generating on its own is decoded speculatively: the
+// draft model proposes up to n_draft tokens, the target verifies all of them in one batch
+// and the KV cells of rejected tokens are dropped again. Without one, lookup decoding can
+// draft for every generating slot from n-gram caches of the slot's own tokens, of earlier
+// generations (lookup_cache_dynamic) and of a corpus (lookup_cache_static).
+//
+// A slot that runs out of room keeps its first n_keep tokens and drops half of the rest,
+// moving the remaining KV cells back with llama_kv_cache_seq_add instead of evaluating them
+// again. With grp_attn_n > 1, self-extend compresses positions instead; the slot then holds
+// up to its share of n_ctx tokens at positions the model was trained on.
+//
+// Sessions can be forked. The fork gets its own slot whose sequence is filled with
+// llama_kv_cache_seq_cp, which adds the new seq_id to the cells of the shared prefix rather
+// than copying them; cells are written once per branch only after the branches diverge, and
+// a cell is freed once no sequence refers to it any more.
+//
+// Requests for several candidates run in as many slots at once. The first of them evaluates
+// the prompt, which is then copied into the others with llama_kv_cache_seq_cp, and every step
+// decodes one token per candidate in the shared batch. n-best samples every candidate with
+// its own sampling context; beam search keeps the n_candidates continuations with the highest
+// cumulative log-probability, moving sequences between slots as beams are pruned.
+//
+// Queued requests are admitted by priority. When every slot is busy, a request may preempt a
+// sequence of lower priority: its KV cells are serialized with llama_state_seq_get_data into
+// host memory, up to the swap space, and the slot is handed over. The preempted request
+// resumes with llama_state_seq_set_data once a slot is free and nothing of higher priority
+// is waiting, exactly where it stopped. Prompt chunks of higher priority also go into the
+// batch first, so a long background prompt does not hold up an interactive one.
+//
+// An idle session that loses its slot to another request keeps its cells in a
+// QLlamaSessionStore, in memory or on disk, and gets them back with its next
+// request instead of evaluating its history again.
+//
+// Cancellation and deadlines are also checked while a batch is being decoded, through the
+// context's abort callback. When a request in the batch is cancelled or runs out of time, the
+// decode stops within the ubatch being computed rather than after the whole batch, and the
+// other requests in it decode their part again with the next step. A stopped request
+// finishes with StopCancelled or StopDeadline and whatever it had generated so far. Only
+// backends that honour the abort callback (the CPU backend) stop mid-batch; on the others
+// the batch is still decoded to the end.
+class QLlamaWorker : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum StopReason
+    {
+        StopEog,
+        StopLength,
+        StopCancelled,
+        StopDeadline,
+        StopError
+    };
+    Q_ENUM(StopReason)
+
+    QLlamaWorker(llama_context *ctx, const gpt_params &params, llama_context *ctx_draft = nullptr, QObject *parent = nullptr)
+        : QObject(parent)
+        , m_ctx(ctx)
+        , m_ctx_draft(ctx_draft)
+        , m_model(llama_get_model(ctx))
+        , m_params(params)
+        , m_n_batch(std::max<qint32>(llama_n_batch(ctx), 1))
+        , m_batch(llama_batch_init(m_n_batch, 0, 1))
+        , m_batch_draft(llama_batch_init(m_ctx_draft ? std::max<qint32>(llama_n_batch(m_ctx_draft), 1) : 1, 0, 1))
+        , m_sessions(ctx)
+        , m_batch_controller(m_n_batch, llama_n_ubatch(ctx))
+    {
+        const qint32 n_slots = std::max<qint32>(llama_n_seq_max(ctx), 1);
+
+        m_n_ctx_slot = llama_n_ctx(ctx) / n_slots;
+        m_slots.resize(n_slots);
+
+        for (qint32 i = 0; i < n_slots; ++i)
+            m_slots[i].id = i;
+
+        if (m_params.grp_attn_n > 1 && m_params.grp_attn_w % m_params.grp_attn_n != 0)
+        {
+            LOG_TEE("%s: grp_attn_w must be a multiple of grp_attn_n, self-extend is disabled\n", __func__);
+            m_params.grp_attn_n = 1;
+        }
+
+        set_lookup_decoding(!params.lookup_cache_static.empty() || !params.lookup_cache_dynamic.empty());
+        load_lookup_caches();
+
+        m_metrics.set_batching(m_n_batch, llama_n_ubatch(ctx));
+        llama_set_abort_callback(ctx, abort_decode, this);
+    }
+
+    ~QLlamaWorker()
+    {
+        saveLookupCache();
+
+        for (QLlamaSlot &slot : m_slots)
+            if (slot.ctx_sampling) llama_sampling_free(slot.ctx_sampling);
+
+        for (QLlamaSwapped &swapped : m_swapped)
+            if (swapped.slot.ctx_sampling) llama_sampling_free(swapped.slot.ctx_sampling);
+
+        llama_batch_free(m_batch);
+        llama_batch_free(m_batch_draft);
+        if (m_ctx_draft) llama_free(m_ctx_draft);
+        if (m_ctx) llama_free(m_ctx);
+    }
+
+    // Safe to call from any thread.
+    QLlamaDraftStats draft_stats() const
+    {
+        QLlamaDraftStats stats;
+        stats.n_drafted = m_n_drafted.load(std::memory_order_relaxed);
+        stats.n_accepted = m_n_accepted.load(std::memory_order_relaxed);
+
+        return stats;
+    }
+
+    // Safe to call from any thread.
+    const QLlamaMetrics &metrics() const { return m_metrics; }
+
+    // Finished requests are logged through writer, which has to outlive the worker's thread.
+    // Set before the worker is moved to its thread.
+    void set_log_writer(QLlamaLogWriter *writer) { m_log_writer = writer; }
+
+    // Creates a context like the worker's, with another n_ubatch; without one, n_ubatch stays
+    // as it is. Called on the worker's thread. Set before the worker is moved to its thread.
+    using ContextFactory = std::function<llama_context *(qint32 n_ubatch)>;
+    void set_context_factory(ContextFactory factory) { m_context_factory = std::move(factory); }
+
+    // Safe to call from any thread. Without it, every batch is filled up to n_batch.
+    void set_adaptive_batch(bool adaptive_batch) { m_adaptive_batch.store(adaptive_batch, std::memory_order_relaxed); }
+
+    // Safe to call from any thread.
+    void set_lookup_decoding(bool lookup_decoding) { m_lookup.store(lookup_decoding, std::memory_order_relaxed); }
+
+    // Safe to call from any thread.
+    void set_n_flush_tokens(qint32 n_flush_tokens = 4) { m_n_flush_tokens.store(std::max(n_flush_tokens, 1), std::memory_order_relaxed); }
+
+    // Safe to call from any thread. Buffered tokens are emitted at least this often.
+    void set_flush_interval_ms(qint32 flush_interval_ms = 16) { m_flush_interval_ms.store(std::max(flush_interval_ms, 0), std::memory_order_relaxed); }
+
+    // Safe to call from any thread. Budgets for the cells of idle sessions that lost their slot.
+    void set_session_memory_mb(qint32 session_memory_mb = 1024) { m_sessions.set_memory_budget_mb(session_memory_mb); }
+    void set_session_disk_mb(qint32 session_disk_mb = 8192)     { m_sessions.set_disk_budget_mb(session_disk_mb); }
+
+    // Safe to call from any thread. Host memory for preempted sequences; 0 disables preemption.
+    void set_swap_space_mb(qint32 swap_space_mb = 2048) { m_swap_limit.store(qint64(std::max(swap_space_mb, 0)) << 20, std::memory_order_relaxed); }
+
+public slots:
+    void submit(const QLlamaRequest &request)
+    {
+        // Candidates need a slot each, and every one of them ends up with a different history.
+        if (request.n_candidates > (qint32) m_slots.size() || (request.n_candidates > 1 && request.session))
+        {
+            LOG_TEE("%s: cannot generate %d candidates with %zu slots\n", __func__, request.n_candidates, m_slots.size());
+            emit generationFinished(request.id, StopError, QString());
+            return;
+        }
+
+        m_queue.append(request);
+        m_queue.last().t_queued.start();
+
+        // Tokenize once on arrival rather than every time admission is attempted.
+        QLlamaRequest &queued = m_queue.last();
+        if (queued.tokens.empty() && queued.n_keep < 0 && !queued.prompt.isEmpty())
+            queued.tokens = ::llama_tokenize(m_ctx, queued.prompt.toStdString(), true, true);
+
+        // Sampling contexts are only ever started from compiled grammars.
+        if (!queued.grammar && !queued.sparams.grammar.empty())
+        {
+            queued.grammar = QLlamaGrammarCache::instance().grammar(queued.sparams.grammar);
+
+            if (!queued.grammar)
+            {
+                const QLlamaRequest rejected = m_queue.takeLast();
+                emit generationFinished(rejected.id, StopError, QString());
+                return;
+            }
+        }
+
+        schedule();
+    }
+
+    // Loads path_prompt_cache into an idle slot; requests sharing its prefix then skip that part of the prefill.
+    void restorePromptCache()
+    {
+        if (m_params.path_prompt_cache.empty())
+            return;
+
+        for (QLlamaSlot &slot : m_slots)
+        {
+            if (slot.active || slot.session)
+                continue;
+
+            if (QLlamaPromptCache::load(m_ctx, slot.id, m_params, slot.cache_tokens, m_n_ctx_slot))
+            {
+                slot.n_past = slot.cache_tokens.size();
+                slot.ga_i = 0;
+                m_prefixes.insert(slot.id, slot.cache_tokens);
+
+                LOG_TEE("%s: restored %zu tokens from %s\n", __func__, slot.cache_tokens.size(), m_params.path_prompt_cache.c_str());
+                emit promptCacheRestored(slot.cache_tokens.size());
+            }
+
+            return;
+        }
+    }
+
+    // Drops the KV cells of a session. Requests for the session that are still running finish
+    // normally and drop the cells then.
+    void releaseSession(quint64 session)
+    {
+        for (QLlamaSlot &slot : m_slots)
+        {
+            if (slot.session != session)
+                continue;
+
+            if (slot.active)
+                m_released.insert(session);
+            else
+                release(slot);
+        }
+
+        for (const QLlamaSwapped &swapped : m_swapped)
+            if (swapped.slot.session == session) m_released.insert(session);
+
+        m_sessions.remove(session);
+        m_session_tokens.remove(session);
+    }
+
+    // Starts session child with the first n_keep tokens of session parent, all of them if
+    // n_keep < 0. If the parent's tokens are cached, the shared prefix is copied into a free
+    // slot for the child, together with the sampler and grammar state when the whole history
+    // is forked; the child's next request then only decodes its new tokens.
+    void forkSession(quint64 parent, quint64 child, qint32 n_keep)
+    {
+        const std::vector<llama_token> history = m_session_tokens.value(parent);
+        const size_t n_tokens = n_keep < 0 ? history.size() : std::min<size_t>(n_keep, history.size());
+
+        std::vector<llama_token> &tokens = m_session_tokens[child];
+        tokens.assign(history.begin(), history.begin() + n_tokens);
+
+        QLlamaSlot *src = nullptr;
+        for (QLlamaSlot &slot : m_slots)
+            if (slot.session == parent) src = &slot;
+
+        if (!src || tokens.empty())
+            return;
+
+        const size_t n_copy = common_prefix(src->cache_tokens, tokens);
+
+        // Compressed positions cannot be cut in the middle.
+        if (n_copy == 0 || (src->ga_i > 0 && n_copy < src->cache_tokens.size()))
+            return;
+
+        QLlamaSlot *dst = fork_slot(src->id);
+
+        if (!dst)
+        {
+            LOG("%s: no free slot, session %llu starts without a cache\n", __func__, (unsigned long long) child);
+            return;
+        }
+
+        evict(*dst);
+
+        llama_kv_cache_seq_rm(m_ctx, dst->id, -1, -1);
+        llama_kv_cache_seq_cp(m_ctx, src->id, dst->id, 0, n_copy < src->cache_tokens.size() ? (llama_pos) n_copy : -1);
+
+        dst->cache_tokens.assign(tokens.begin(), tokens.begin() + n_copy);
+        dst->n_past = src->ga_i > 0 ? src->n_past : (qint32) n_copy;
+        dst->ga_i = src->ga_i;
+        dst->session = child;
+        dst->last_used = ++m_tick;
+
+        if (dst->ga_i == 0)
+            m_prefixes.insert(dst->id, dst->cache_tokens);
+
+        // The sampler has seen the parent's last generation; it only fits a branch that goes on from there.
+        if (!src->active && src->ctx_sampling && n_tokens == history.size())
+        {
+            if (dst->ctx_sampling) llama_sampling_free(dst->ctx_sampling);
+
+            dst->ctx_sampling = llama_sampling_init(src->ctx_sampling->params);
+            llama_sampling_cp(src->ctx_sampling, dst->ctx_sampling);
+        }
+    }
+
+    // Writes the n-grams of all finished generations to lookup_cache_dynamic.
+    void saveLookupCache()
+    {
+        if (!m_lookup_dirty || m_params.lookup_cache_dynamic.empty())
+            return;
+
+        std::string path = m_params.lookup_cache_dynamic;
+        llama_ngram_cache_save(m_nc_dynamic, path);
+        m_lookup_dirty = false;
+    }
+
+signals:
+    void tokensGenerated(quint64 id, const QList<llama_token> &tokens, const QString &text);
+    // The tokens [n_keep, n_keep + n_discard) of the request's sequence were dropped to make room.
+    void contextShifted(quint64 id, qint32 n_keep, qint32 n_discard);
+    void generationFinished(quint64 id, QLlamaWorker::StopReason reason, const QString &output);
+    // All candidates of an n-best or beam request, best first; generationFinished follows with the best one.
+    void candidatesReady(quint64 id, const QList<QLlamaCandidate> &candidates);
+    void promptCacheRestored(qint32 n_tokens);
+
+private:
+    struct QLlamaGroup;
+
+    struct QLlamaSlot
+    {
+        llama_seq_id id                             {0};
+        quint64 session                             {0};
+        quint64 last_used                           {0};
+
+        // Tokens currently held in the KV cache for this sequence, in position order.
+        std::vector<llama_token> cache_tokens;
+
+        // Position of the next token. Equal to cache_tokens.size() until self-extend compresses
+        // positions; from then on ga_i is where the next group starts.
+        qint32 n_past                               {0};
+        qint32 ga_i                                 {0};
+
+        QLlamaRequest request;
+        bool active                                 {false};
+
+        std::vector<llama_token> prompt;
+        std::vector<llama_token> generated;
+        std::vector<llama_token> draft;             // proposed continuation of last, verified with it
+
+        // Lookup decoding: prompt and generated tokens so far (append-only, no end-of-generation
+        // tokens), their n-grams and how many of them went into the dynamic cache.
+        std::vector<llama_token> lookup_tokens;
+        llama_ngram_cache nc_context;
+        size_t n_lookup_dynamic                     {0};
+        size_t n_reused                             {0};
+        size_t n_prompt_done                        {0};
+        qint32 n_decoded                            {0};
+        qint32 n_keep                               {0}; // tokens a context shift never drops
+        llama_token last                            {-1};
+
+        QElapsedTimer t_start;
+        qint64 t_prompt_us                          {0};
+        qint64 t_last_token_us                      {0};
+
+        // Contribution to the batch being decoded.
+        qint32 i_batch                              {-1};
+        qint32 n_batch                              {0};
+
+        llama_sampling_context *ctx_sampling        {nullptr};
+
+        // Set while the slot runs one candidate of a request; last is -1 while it does not decode.
+        QLlamaGroup *group                          {nullptr};
+
+        QLlamaDetokenizer detokenizer;
+        QElapsedTimer last_flush;
+        QList<llama_token> pending_tokens;
+        QString pending_text;
+        QString output;
+
+        bool prefilling() const { return n_prompt_done < prompt.size(); }
+    };
+
+    struct QLlamaBeam
+    {
+        std::vector<llama_token> tokens;            // without the end-of-generation token
+        double logprob                              {0.0};
+        bool done                                   {false};
+        StopReason reason                           {StopLength};
+    };
+
+    struct QLlamaGroup
+    {
+        QLlamaRequest request;
+        std::vector<QLlamaSlot *> members;          // members[0] evaluates the prompt
+        std::vector<QLlamaBeam> beams;              // beams[i] is held by members[i]
+        bool fanned_out                             {false};
+    };
+
+    // A preempted request: the state of its slot and the serialized KV cells of its sequence.
+    struct QLlamaSwapped
+    {
+        QLlamaSlot slot;
+        QByteArray state;
+    };
+
+    llama_context *m_ctx                            {nullptr};
+    llama_context *m_ctx_draft                      {nullptr};
+    const llama_model *m_model                      {nullptr};
+    gpt_params m_params;
+
+    qint32 m_n_batch                                {0};
+    qint32 m_n_ctx_slot                             {0};
+    llama_batch m_batch;
+    llama_batch m_batch_draft;
+
+    // Tokens in sequence 0 of the draft context, in position order.
+    std::vector<llama_token> m_draft_tokens;
+    std::atomic<quint64> m_n_drafted                {0};
+    std::atomic<quint64> m_n_accepted               {0};
+
+    QLlamaMetrics m_metrics;
+    QLlamaSessionStore m_sessions;
+    QLlamaPrefixTree m_prefixes;                    // prompts resident in the slots' sequences
+
+    // The requests in the batch being decoded, read by the abort callback on the compute threads.
+    struct QLlamaAbortWatch
+    {
+        std::shared_ptr<std::atomic_bool> cancelled;
+        QDeadlineTimer deadline;
+    };
+
+    std::vector<QLlamaAbortWatch> m_abort_watch;
+    std::atomic_bool m_decode_aborted               {false};
+
+    std::atomic_bool m_adaptive_batch               {true};
+    QLlamaBatchController m_batch_controller;
+    ContextFactory m_context_factory;
+    bool m_recreate_scheduled                       {false};
+
+    std::atomic_bool m_lookup                       {false};
+    llama_ngram_cache m_nc_dynamic;
+    llama_ngram_cache m_nc_static;
+    bool m_lookup_dirty                             {false};
+
+    std::vector<QLlamaSlot> m_slots;
+    std::vector<std::unique_ptr<QLlamaGroup>> m_groups;
+    QList<QLlamaRequest> m_queue;
+    std::vector<QLlamaSwapped> m_swapped;           // highest priority first, then in order of preemption
+    qint64 m_swap_bytes                             {0};
+    std::atomic<qint64> m_swap_limit                {qint64(2048) << 20};
+
+    // Full token history of every session: prompt and generated tokens, including the last
+    // sampled token, which has not been decoded yet.
+    QHash<quint64, std::vector<llama_token>> m_session_tokens;
+    QSet<quint64> m_released;                       // closed while a request was running
+    quint64 m_tick                                  {0};
+
+    QLlamaLogWriter *m_log_writer                   {nullptr};
+
+    bool m_prompt_cache_saved                       {false};
+    bool m_step_scheduled                           {false};
+    std::atomic_int m_n_flush_tokens                {4};
+    std::atomic_int m_flush_interval_ms             {16};
+
+    bool idle() const
+    {
+        for (const QLlamaSlot &slot : m_slots)
+            if (slot.active) return false;
+
+        return m_queue.isEmpty() && m_swapped.empty();
+    }
+
+    void schedule()
+    {
+        update_sequences();
+
+        if (m_step_scheduled)
+            return;
+
+        if (idle())
+        {
+            schedule_recreate();
+            return;
+        }
+
+        m_step_scheduled = true;
+        QMetaObject::invokeMethod(this, &QLlamaWorker::step, Qt::QueuedConnection);
+    }
+
+    void update_sequences()
+    {
+        const qint32 n_active = std::count_if(m_slots.begin(), m_slots.end(), [](const QLlamaSlot &slot) { return slot.active; });
+        m_metrics.set_sequences(n_active, m_queue.size() + m_swapped.size());
+    }
+
+    static size_t common_prefix(const std::vector<llama_token> &a, const std::vector<llama_token> &b)
+    {
+        size_t n = 0;
+        while (n < a.size() && n < b.size() && a[n] == b[n])
+            ++n;
+
+        return n;
+    }
+
+    // Resolves the full token sequence a request should end up with in its slot. A prompt
+    // that does not fit is cut down by n_discard tokens after the first n_keep when the
+    // request allows context shifting.
+    bool prompt_for(const QLlamaRequest &request, std::vector<llama_token> &prompt, qint32 &n_discard)
+    {
+        n_discard = 0;
+
+        // A resumed session keeps its whole history unless told otherwise.
+        if (request.session && (request.n_keep >= 0 || request.resume_sampling))
+        {
+            const std::vector<llama_token> &history = m_session_tokens[request.session];
+            const size_t n_keep = request.n_keep < 0 ? history.size() : request.n_keep;
+
+            if (n_keep > history.size())
+            {
+                LOG_TEE("%s: session %llu holds %zu tokens, cannot keep %d\n", __func__, (unsigned long long) request.session, history.size(), request.n_keep);
+                return false;
+            }
+
+            prompt.assign(history.begin(), history.begin() + n_keep);
+            prompt.insert(prompt.end(), request.tokens.begin(), request.tokens.end());
+        }
+        else
+        {
+            prompt = request.tokens;
+        }
+
+        if (prompt.empty())
+            prompt.push_back(llama_token_bos(m_model));
+
+        if ((qint32) prompt.size() >= m_n_ctx_slot)
+        {
+            if (!can_shift(request))
+            {
+                LOG_TEE("%s: prompt is too long (%zu tokens, slot holds %d)\n", __func__, prompt.size(), m_n_ctx_slot);
+                return false;
+            }
+
+            // Like a shift during generation, leave half of the space after n_keep filled.
+            const qint32 n_keep = n_keep_for(prompt);
+            n_discard = prompt.size() - n_keep - (m_n_ctx_slot - n_keep) / 2;
+        }
+
+        return true;
+    }
+
+    // Context shifting is the answer to a full slot unless self-extend manages positions, or
+    // the request asked to stop instead (n_predict == -2, as in the CLI).
+    bool can_shift(const QLlamaRequest &request) const
+    {
+        return m_params.grp_attn_n == 1 && request.n_predict != -2;
+    }
+
+    // n_keep as configured, -1 meaning the whole prompt; the BOS token is always kept and at
+    // least half of the slot is left to discard from.
+    qint32 n_keep_for(const std::vector<llama_token> &prompt) const
+    {
+        qint32 n_keep = m_params.n_keep < 0 ? (qint32) prompt.size() : m_params.n_keep;
+
+        if (!prompt.empty() && prompt.front() == llama_token_bos(m_model))
+            n_keep = std::max(n_keep, 1);
+
+        return std::min(n_keep, m_n_ctx_slot / 2);
+    }
+
+    // Drops the KV cells of [n_keep, n_keep + n_discard) and moves the ones behind them back.
+    void shift(QLlamaSlot &slot, qint32 n_keep, qint32 n_discard)
+    {
+        llama_kv_cache_seq_rm (m_ctx, slot.id, n_keep, n_keep + n_discard);
+        llama_kv_cache_seq_add(m_ctx, slot.id, n_keep + n_discard, slot.n_past, -n_discard);
+
+        slot.cache_tokens.erase(slot.cache_tokens.begin() + n_keep, slot.cache_tokens.begin() + n_keep + n_discard);
+        slot.n_past -= n_discard;
+        m_prefixes.revalidate(slot.id, slot.cache_tokens);
+
+        // The discarded range leaves a hole in the cache; it is compacted with the next decode.
+        llama_kv_cache_defrag(m_ctx);
+        m_metrics.defragmented();
+
+        emit contextShifted(slot.request.id, n_keep, n_discard);
+    }
+
+    // Makes room in a generating slot whose sequence is full, or stops it.
+    bool make_room(QLlamaSlot &slot)
+    {
+        if ((qint32) slot.cache_tokens.size() + 1 < m_n_ctx_slot)
+            return true;
+
+        if (!can_shift(slot.request))
+        {
+            finish(slot, StopLength);
+            return false;
+        }
+
+        const qint32 n_left = slot.n_past - slot.n_keep;
+        const qint32 n_discard = n_left / 2;
+
+        LOG("%s: slot %d: context full, keeping %d tokens and dropping %d\n", __func__, slot.id, slot.n_keep, n_discard);
+
+        shift(slot, slot.n_keep, n_discard);
+
+        // prompt + generated stay what the session history is made of, so fold the
+        // generated tokens into the (now shifted) prompt.
+        slot.prompt = slot.cache_tokens;
+        slot.n_prompt_done = slot.prompt.size();
+        slot.generated = { slot.last };
+
+        return true;
+    }
+
+    // Self-extend as in the CLI: every grp_attn_w positions the window is divided by
+    // grp_attn_n, so the positions the model sees grow grp_attn_n times slower.
+    void extend(QLlamaSlot &slot)
+    {
+        const qint32 ga_n = m_params.grp_attn_n;
+        const qint32 ga_w = m_params.grp_attn_w;
+
+        while (slot.n_past >= slot.ga_i + ga_w)
+        {
+            const qint32 ib = (ga_n * slot.ga_i) / ga_w;
+            const qint32 bd = (ga_w / ga_n) * (ga_n - 1);
+            const qint32 dd = (ga_w / ga_n) - ib * bd - ga_w;
+
+            llama_kv_cache_seq_add(m_ctx, slot.id, slot.ga_i, slot.n_past, ib * bd);
+            llama_kv_cache_seq_div(m_ctx, slot.id, slot.ga_i + ib * bd, slot.ga_i + ib * bd + ga_w, ga_n);
+            llama_kv_cache_seq_add(m_ctx, slot.id, slot.ga_i + ib * bd + ga_w, slot.n_past + ib * bd, dd);
+
+            slot.n_past -= bd;
+            slot.ga_i += ga_w / ga_n;
+
+            // Its positions no longer match the token indices, so nothing can be shared from it.
+            m_prefixes.remove(slot.id);
+        }
+    }
+
+    // Copies the cells of whatever more of slot's prompt another sequence holds, a shared
+    // system prompt for instance, behind the n_keep tokens slot already has, and returns how
+    // many it has now. The tree is only updated when prompts complete or cells are dropped, so
+    // each holder is checked against its cache first. Lending cells counts as a use of the
+    // lender: slots holding prefixes nobody asks for any more are the first to be recycled.
+    size_t share_prefix(QLlamaSlot &slot, size_t n_keep)
+    {
+        const size_t n_max = slot.prompt.size() - 1;
+        const QLlamaPrefixTree::Match match = m_prefixes.match(slot.prompt);
+
+        if (std::min(match.n_tokens, n_max) <= n_keep)
+            return n_keep;
+
+        QLlamaSlot *donor = nullptr;
+        size_t n_shared = n_keep;
+
+        for (const llama_seq_id id : match.holders)
+        {
+            QLlamaSlot &holder = m_slots[id];
+
+            if (holder.id == slot.id)
+                continue;
+
+            m_prefixes.revalidate(holder.id, holder.cache_tokens);
+
+            const size_t n = std::min(common_prefix(holder.cache_tokens, slot.prompt), n_max);
+
+            if (holder.ga_i == 0 && n > n_shared)
+            {
+                donor = &holder;
+                n_shared = n;
+            }
+        }
+
+        if (!donor)
+            return n_keep;
+
+        llama_kv_cache_seq_cp(m_ctx, donor->id, slot.id, n_keep, n_shared);
+
+        slot.cache_tokens.insert(slot.cache_tokens.end(), slot.prompt.begin() + n_keep, slot.prompt.begin() + n_shared);
+        slot.n_past = n_shared;
+        donor->last_used = ++m_tick;
+
+        m_metrics.shared(n_shared - n_keep);
+        LOG("%s: slot %d: %zu prompt tokens shared from slot %d\n", __func__, slot.id, n_shared - n_keep, donor->id);
+
+        return n_shared;
+    }
+
+    // Picks the slot a request should run in, or nullptr if it has to wait. A session keeps
+    // its slot between requests. Otherwise free slots are preferred, the one whose cache
+    // shares the longest prefix with the prompt first; only then is the least recently used
+    // slot of another idle session recycled.
+    QLlamaSlot *slot_for(const QLlamaRequest &request, const std::vector<llama_token> &prompt)
+    {
+        QLlamaSlot *best = nullptr;
+        size_t best_prefix = 0;
+
+        for (QLlamaSlot &slot : m_slots)
+        {
+            if (request.session && slot.session == request.session)
+                return slot.active ? nullptr : &slot;
+
+            if (slot.active)
+                continue;
+
+            const size_t prefix = slot.session ? 0 : common_prefix(slot.cache_tokens, prompt);
+
+            if (!best ||
+                (best->session && !slot.session) ||
+                (!best->session && !slot.session && prefix > best_prefix) ||
+                (!best->session == !slot.session && prefix == best_prefix && slot.last_used < best->last_used))
+            {
+                best = &slot;
+                best_prefix = prefix;
+            }
+        }
+
+        return best;
+    }
+
+    void begin(QLlamaSlot &slot, const QLlamaRequest &request, std::vector<llama_token> &&prompt, qint32 n_discard)
+    {
+        const bool resume = request.resume_sampling && slot.ctx_sampling && request.session && slot.session == request.session;
+
+        // The slot's idle session goes to the session store; the request's comes back from it.
+        if (slot.session != request.session)
+        {
+            evict(slot);
+
+            if (request.session && m_sessions.contains(request.session))
+                restore(slot, request.session);
+        }
+
+        slot.request = request;
+        slot.active = true;
+        slot.session = request.session;
+        slot.last_used = ++m_tick;
+        slot.prompt = std::move(prompt);
+        slot.generated.clear();
+        slot.draft.clear();
+        slot.n_decoded = 0;
+        slot.last = -1;
+        slot.i_batch = -1;
+        slot.n_batch = 0;
+        slot.detokenizer.clear();
+        slot.pending_tokens.clear();
+        slot.pending_text.clear();
+        slot.output.clear();
+        slot.t_start.start();
+        slot.t_prompt_us = 0;
+
+        if (!resume)
+        {
+            if (slot.ctx_sampling) llama_sampling_free(slot.ctx_sampling);
+
+            // Without a grammar string llama_sampling_init cannot fail; the grammar state is
+            // copied from the compiled one instead of being parsed again.
+            llama_sampling_params sparams = request.sparams;
+            sparams.grammar.clear();
+            slot.ctx_sampling = llama_sampling_init(sparams);
+
+            if (request.grammar)
+                slot.ctx_sampling->grammar = llama_grammar_copy(request.grammar->initial);
+        }
+
+        slot.n_keep = n_keep_for(slot.prompt);
+
+        // An overlong prompt loses a range after n_keep. When that range is already in the
+        // cache, shift the cells behind it back rather than evaluating them again.
+        if (n_discard > 0)
+        {
+            const size_t n_end = slot.n_keep + n_discard;
+
+            if (slot.ga_i == 0 && common_prefix(slot.cache_tokens, slot.prompt) >= n_end)
+                shift(slot, slot.n_keep, n_discard);
+            else
+                emit contextShifted(request.id, slot.n_keep, n_discard);
+
+            slot.prompt.erase(slot.prompt.begin() + slot.n_keep, slot.prompt.begin() + n_end);
+        }
+
+        // Keep whatever prefix of the prompt is already in this sequence's cache and drop the
+        // rest; for a chat session this is where a diverging turn is rolled back. At least one
+        // token has to be decoded to get logits for sampling.
+        size_t n_keep = std::min(common_prefix(slot.cache_tokens, slot.prompt), slot.prompt.size() - 1);
+
+        if (n_keep < slot.cache_tokens.size())
+        {
+            // Compressed positions cannot be cut in the middle.
+            if (slot.ga_i > 0)
+            {
+                n_keep = 0;
+                slot.ga_i = 0;
+            }
+
+            llama_kv_cache_seq_rm(m_ctx, slot.id, n_keep, -1);
+            slot.cache_tokens.resize(n_keep);
+            slot.n_past = n_keep;
+        }
+
+        m_prefixes.revalidate(slot.id, slot.cache_tokens);
+
+        if (slot.ga_i == 0)
+            n_keep = share_prefix(slot, n_keep);
+
+        slot.n_reused = n_keep;
+        slot.n_prompt_done = n_keep;
+
+        if (m_lookup.load(std::memory_order_relaxed))
+            lookup_prompt(slot);
+    }
+
+    void admit()
+    {
+        // Higher priorities first; requests of equal priority keep their order of arrival.
+        std::stable_sort(m_queue.begin(), m_queue.end(), [](const QLlamaRequest &a, const QLlamaRequest &b) { return a.priority > b.priority; });
+
+        for (qsizetype i = 0;;)
+        {
+            const bool has_free = std::any_of(m_slots.begin(), m_slots.end(), [](const QLlamaSlot &slot) { return !slot.active; });
+
+            // A preempted sequence resumes before queued requests of the same or a lower priority.
+            if (!m_swapped.empty() && (i == m_queue.size() || m_swapped.front().slot.request.priority >= m_queue.at(i).priority))
+            {
+                if (!has_free || !swap_in())
+                    return;
+
+                continue;
+            }
+
+            if (i == m_queue.size())
+                return;
+
+            const QLlamaRequest &request = m_queue.at(i);
+
+            // A session's next request waits until its preempted one is back, and a request whose
+            // session is running waits anyway. Candidates never preempt.
+            if (is_swapped(request.session) ||
+                (!has_free && (request.n_candidates > 1 || is_running(request.session) || !preempt(request.priority))))
+            {
+                ++i;
+                continue;
+            }
+            std::vector<llama_token> prompt;
+            qint32 n_discard = 0;
+
+            if (!prompt_for(request, prompt, n_discard))
+            {
+                const QLlamaRequest rejected = m_queue.takeAt(i);
+                emit generationFinished(rejected.id, StopError, QString());
+                continue;
+            }
+
+            QLlamaSlot *slot = slot_for(request, prompt);
+
+            if (!slot || (request.n_candidates > 1 && !begin_group(*slot, request, std::move(prompt), n_discard)))
+            {
+                ++i;
+                continue;
+            }
+
+            if (request.n_candidates > 1)
+                m_queue.removeAt(i);
+            else
+                begin(*slot, m_queue.takeAt(i), std::move(prompt), n_discard);
+        }
+    }
+
+    bool is_running(quint64 session) const
+    {
+        return session && std::any_of(m_slots.begin(), m_slots.end(), [session](const QLlamaSlot &slot) { return slot.active && slot.session == session; });
+    }
+
+    bool is_swapped(quint64 session) const
+    {
+        return session && std::any_of(m_swapped.begin(), m_swapped.end(), [session](const QLlamaSwapped &swapped) { return swapped.slot.session == session; });
+    }
+
+    // Frees a slot for a request of the given priority by swapping out a sequence of lower
+    // priority: the lowest, and of those the one with the fewest cells, which is the cheapest
+    // to serialize. Candidates are never preempted.
+    bool preempt(qint32 priority)
+    {
+        QLlamaSlot *victim = nullptr;
+
+        for (QLlamaSlot &slot : m_slots)
+        {
+            if (!slot.active || slot.group || slot.request.priority >= priority)
+                continue;
+
+            if (!victim || slot.request.priority < victim->request.priority ||
+                (slot.request.priority == victim->request.priority && slot.cache_tokens.size() < victim->cache_tokens.size()))
+            {
+                victim = &slot;
+            }
+        }
+
+        return victim && swap_out(*victim);
+    }
+
+    bool swap_out(QLlamaSlot &slot)
+    {
+        const size_t size = llama_state_seq_get_size(m_ctx, slot.id);
+
+        if (m_swap_bytes + (qint64) size > m_swap_limit.load(std::memory_order_relaxed))
+        {
+            LOG("%s: no swap space left for %zu bytes, request %llu keeps its slot\n", __func__, size, (unsigned long long) slot.request.id);
+            return false;
+        }
+
+        QLlamaSwapped swapped;
+        swapped.state.resize(size);
+
+        if (llama_state_seq_get_data(m_ctx, reinterpret_cast<uint8_t *>(swapped.state.data()), size, slot.id) != size)
+        {
+            LOG_TEE("%s: cannot serialize sequence %d\n", __func__, slot.id);
+            return false;
+        }
+
+        // What was generated so far reaches the client before the pause.
+        flush(slot);
+
+        llama_kv_cache_seq_rm(m_ctx, slot.id, -1, -1);
+        m_prefixes.remove(slot.id);
+        m_swap_bytes += size;
+
+        LOG("%s: request %llu (priority %d) swapped out, %zu cells in %zu bytes\n", __func__,
+            (unsigned long long) slot.request.id, slot.request.priority, slot.cache_tokens.size(), size);
+
+        const llama_seq_id id = slot.id;
+        swapped.slot = std::move(slot);
+        slot = QLlamaSlot();
+        slot.id = id;
+
+        const qint32 priority = swapped.slot.request.priority;
+        const auto pos = std::find_if(m_swapped.begin(), m_swapped.end(), [priority](const QLlamaSwapped &s) { return s.slot.request.priority < priority; });
+        m_swapped.insert(pos, std::move(swapped));
+
+        return true;
+    }
+
+    // Resumes the first preempted request in a free slot; false if there is none. An idle
+    // session in that slot loses its cells, its token history rebuilds them when needed.
+    bool swap_in()
+    {
+        QLlamaSlot *target = nullptr;
+
+        for (QLlamaSlot &slot : m_slots)
+        {
+            if (slot.active)
+                continue;
+
+            if (!target || (target->session && !slot.session) || (!target->session == !slot.session && slot.last_used < target->last_used))
+                target = &slot;
+        }
+
+        if (!target)
+            return false;
+
+        QLlamaSwapped swapped = std::move(m_swapped.front());
+        m_swapped.erase(m_swapped.begin());
+        m_swap_bytes -= swapped.state.size();
+
+        evict(*target);
+        if (target->ctx_sampling) llama_sampling_free(target->ctx_sampling);
+
+        const llama_seq_id id = target->id;
+        *target = std::move(swapped.slot);
+        target->id = id;
+        target->last_used = ++m_tick;
+
+        if (llama_state_seq_set_data(m_ctx, reinterpret_cast<const uint8_t *>(swapped.state.constData()), swapped.state.size(), id) == 0)
+        {
+            LOG_TEE("%s: cannot restore the cells of request %llu\n", __func__, (unsigned long long) target->request.id);
+            finish(*target, StopError);
+            return true;
+        }
+
+        if (target->ga_i == 0)
+            m_prefixes.insert(id, target->cache_tokens);
+
+        LOG("%s: request %llu resumed in slot %d\n", __func__, (unsigned long long) target->request.id, id);
+
+        return true;
+    }
+
+    // Ends a preempted request that was cancelled or ran out of time without restoring it.
+    // Its cells are gone; a session rebuilds them from its history with the next request.
+    void drop_swapped(size_t i, StopReason reason)
+    {
+        QLlamaSwapped swapped = std::move(m_swapped[i]);
+        m_swapped.erase(m_swapped.begin() + i);
+        m_swap_bytes -= swapped.state.size();
+
+        QLlamaSlot &slot = swapped.slot;
+
+        const QString tail = slot.detokenizer.flush();
+        slot.pending_text += tail;
+        slot.output += tail;
+        flush(slot);
+
+        if (slot.session && !m_released.remove(slot.session))
+        {
+            std::vector<llama_token> &history = m_session_tokens[slot.session];
+            history = std::move(slot.prompt);
+            history.insert(history.end(), slot.generated.begin(), slot.generated.end());
+        }
+
+        if (slot.ctx_sampling) llama_sampling_free(slot.ctx_sampling);
+
+        m_metrics.finished();
+        emit generationFinished(slot.request.id, reason, slot.output);
+    }
+
+    void flush(QLlamaSlot &slot)
+    {
+        if (slot.pending_tokens.isEmpty() && slot.pending_text.isEmpty())
+            return;
+
+        emit tokensGenerated(slot.request.id, slot.pending_tokens, slot.pending_text);
+        slot.pending_tokens.clear();
+        slot.pending_text.clear();
+        slot.last_flush.start();
+    }
+
+    void finish(QLlamaSlot &slot, StopReason reason)
+    {
+        // verify() may finish a slot while cells of draft tokens it has not accepted are still in
+        // the sequence; they go before anything saves or hands on the sequence's state.
+        llama_kv_cache_seq_rm(m_ctx, slot.id, slot.n_past, -1);
+
+        // Bytes of a character the generation never completed.
+        const QString tail = slot.detokenizer.flush();
+        slot.pending_text += tail;
+        slot.output += tail;
+
+        flush(slot);
+
+        if (m_log_writer && reason != StopError)
+            log_run(slot, reason);
+
+        if (slot.session && !m_released.contains(slot.session))
+        {
+            std::vector<llama_token> &history = m_session_tokens[slot.session];
+            history = std::move(slot.prompt);
+            history.insert(history.end(), slot.generated.begin(), slot.generated.end());
+        }
+
+        if (reason != StopError && m_params.prompt_cache_all)
+            save_prompt_cache(slot);
+
+        if (reason != StopError && slot.n_lookup_dynamic < slot.lookup_tokens.size())
+        {
+            llama_ngram_cache_update(m_nc_dynamic, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.lookup_tokens, slot.lookup_tokens.size() - slot.n_lookup_dynamic, false);
+            slot.n_lookup_dynamic = slot.lookup_tokens.size();
+            m_lookup_dirty = true;
+        }
+
+        m_metrics.finished();
+        emit generationFinished(slot.request.id, reason, slot.output);
+
+        slot.active = false;
+        slot.i_batch = -1;
+        slot.n_batch = 0;
+        slot.prompt.clear();
+        slot.draft.clear();
+        slot.output.clear();
+
+        // A failed decode leaves the sequence in an unknown state.
+        if (reason == StopError)
+        {
+            llama_kv_cache_seq_rm(m_ctx, slot.id, -1, -1);
+            m_prefixes.remove(slot.id);
+            slot.cache_tokens.clear();
+            slot.n_past = 0;
+            slot.ga_i = 0;
+        }
+
+        if (m_released.remove(slot.session))
+            release(slot);
+    }
+
+    // Drops a slot's sequence. Cells the sequence shares with forks of it stay with them.
+    void release(QLlamaSlot &slot)
+    {
+        llama_kv_cache_seq_rm(m_ctx, slot.id, -1, -1);
+        m_prefixes.remove(slot.id);
+        slot.cache_tokens.clear();
+        slot.n_past = 0;
+        slot.ga_i = 0;
+        slot.session = 0;
+    }
+
+    // Hands the cells of an idle session to the session store and frees its sequence.
+    void evict(QLlamaSlot &slot)
+    {
+        if (!slot.session)
+            return;
+
+        m_sessions.spill(slot.session, slot.id, slot.cache_tokens, slot.n_past, slot.ga_i);
+        release(slot);
+    }
+
+    void restore(QLlamaSlot &slot, quint64 session)
+    {
+        if (!m_sessions.restore(session, slot.id, slot.cache_tokens, slot.n_past, slot.ga_i))
+        {
+            slot.cache_tokens.clear();
+            slot.n_past = 0;
+            slot.ga_i = 0;
+            return;
+        }
+
+        slot.session = session;
+
+        if (slot.ga_i == 0)
+            m_prefixes.insert(slot.id, slot.cache_tokens);
+
+        LOG("%s: session %llu restored with %zu tokens\n", __func__, (unsigned long long) session, slot.cache_tokens.size());
+    }
+
+    // Recreating the context takes a while; it waits until the worker has been idle for a moment
+    // rather than holding up a request that arrives right after another one finished.
+    void schedule_recreate()
+    {
+        if (m_recreate_scheduled || !m_context_factory || !m_adaptive_batch.load(std::memory_order_relaxed))
+            return;
+
+        if (m_batch_controller.recommended_n_ubatch() == 0)
+            return;
+
+        m_recreate_scheduled = true;
+
+        QTimer::singleShot(1000, this, [this]() {
+            m_recreate_scheduled = false;
+
+            const qint32 n_ubatch = m_batch_controller.recommended_n_ubatch();
+
+            if (idle() && n_ubatch > 0)
+                recreate_context(n_ubatch);
+        });
+    }
+
+    // Moves every resident sequence into a new context with n_ubatch. The new context is
+    // created while the old one still exists, so a failure leaves everything as it was.
+    void recreate_context(qint32 n_ubatch)
+    {
+        const qint32 n_ubatch_old = llama_n_ubatch(m_ctx);
+        llama_context *ctx = m_context_factory(n_ubatch);
+
+        if (!ctx)
+        {
+            LOG_TEE("%s: failed to create a context with n_ubatch = %d, keeping %d\n", __func__, n_ubatch, n_ubatch_old);
+            m_batch_controller.rebase(n_ubatch_old);
+            return;
+        }
+
+        QByteArray state;
+
+        for (QLlamaSlot &slot : m_slots)
+        {
+            if (slot.cache_tokens.empty())
+                continue;
+
+            state.resize(llama_state_seq_get_size(m_ctx, slot.id));
+
+            if (llama_state_seq_get_data(m_ctx, reinterpret_cast<uint8_t *>(state.data()), state.size(), slot.id) != (size_t) state.size() ||
+                llama_state_seq_set_data(ctx, reinterpret_cast<const uint8_t *>(state.constData()), state.size(), slot.id) == 0)
+            {
+                LOG_TEE("%s: cannot move sequence %d, its cells are dropped\n", __func__, slot.id);
+                llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+                release(slot);
+            }
+        }
+
+        llama_free(m_ctx);
+        m_ctx = ctx;
+        m_sessions.set_context(ctx);
+        llama_set_abort_callback(ctx, abort_decode, this);
+        m_batch_controller.rebase(llama_n_ubatch(ctx));
+
+        m_metrics.context_recreated();
+        m_metrics.set_batching(m_batch_controller.chunk(), llama_n_ubatch(ctx));
+        m_metrics.set_kv_cells(llama_get_kv_cache_used_cells(ctx), llama_n_ctx(ctx));
+
+        LOG_TEE("%s: n_ubatch %d -> %d\n", __func__, n_ubatch_old, llama_n_ubatch(ctx));
+    }
+
+    // A slot for a fork of the sequence in slot src: a free slot if there is one, otherwise
+    // the least recently used idle session gives up its cells.
+    QLlamaSlot *fork_slot(llama_seq_id src)
+    {
+        QLlamaSlot *best = nullptr;
+
+        for (QLlamaSlot &slot : m_slots)
+        {
+            if (slot.active || slot.id == src)
+                continue;
+
+            if (!best || (best->session && !slot.session) || (!best->session == !slot.session && slot.last_used < best->last_used))
+                best = &slot;
+        }
+
+        return best;
+    }
+
+    // Fills m_batch: one token for every generating slot first, then prompt chunks from
+    // prefilling slots until the batch is full. Without cont_batching, prompts are only
+    // processed while nothing is generating.
+    void build_batch()
+    {
+        llama_batch_clear(m_batch);
+
+        bool generating = false;
+
+        for (QLlamaSlot &slot : m_slots)
+        {
+            slot.i_batch = -1;
+            slot.n_batch = 0;
+
+            if (!slot.active || slot.prefilling() || (slot.group && slot.last < 0))
+                continue;
+
+            slot.i_batch = m_batch.n_tokens;
+            slot.n_batch = 1 + slot.draft.size();
+            llama_batch_add(m_batch, slot.last, slot.n_past, { slot.id }, true);
+
+            for (size_t i = 0; i < slot.draft.size(); ++i)
+                llama_batch_add(m_batch, slot.draft[i], slot.n_past + 1 + i, { slot.id }, true);
+
+            generating = true;
+        }
+
+        if (generating && !m_params.cont_batching)
+            return;
+
+        // Prompts of higher priority get the room in the batch first.
+        std::vector<QLlamaSlot *> prefilling;
+        for (QLlamaSlot &slot : m_slots)
+            if (slot.active && slot.prefilling()) prefilling.push_back(&slot);
+
+        if (prefilling.empty())
+            return;
+
+        std::stable_sort(prefilling.begin(), prefilling.end(), [](const QLlamaSlot *a, const QLlamaSlot *b) { return a->request.priority > b->request.priority; });
+
+        qint32 n_limit = m_n_batch;
+        if (m_adaptive_batch.load(std::memory_order_relaxed))
+            n_limit = std::min(m_n_batch, m_batch.n_tokens + m_batch_controller.next_chunk(generating));
+
+        for (QLlamaSlot *slot : prefilling)
+        {
+            if (m_batch.n_tokens >= n_limit)
+                break;
+
+            const size_t n_chunk = std::min(slot->prompt.size() - slot->n_prompt_done, (size_t) (n_limit - m_batch.n_tokens));
+            const bool last_chunk = slot->n_prompt_done + n_chunk == slot->prompt.size();
+
+            for (size_t i = 0; i < n_chunk; ++i)
+                llama_batch_add(m_batch, slot->prompt[slot->n_prompt_done + i], slot->n_past + i, { slot->id }, last_chunk && i == n_chunk - 1);
+
+            slot->n_batch = n_chunk;
+            slot->i_batch = last_chunk ? m_batch.n_tokens - 1 : -1;
+        }
+    }
+
+    void step()
+    {
+        m_step_scheduled = false;
+
+        for (QLlamaSlot &slot : m_slots)
+        {
+            if (!slot.active)
+                continue;
+
+            if (slot.request.cancelled->load(std::memory_order_relaxed))
+                slot.group ? finish_group(*slot.group, StopCancelled) : finish(slot, StopCancelled);
+            else if (slot.request.deadline.hasExpired())
+                slot.group ? finish_group(*slot.group, StopDeadline) : finish(slot, StopDeadline);
+        }
+
+        for (size_t i = 0; i < m_swapped.size();)
+        {
+            const QLlamaRequest &request = m_swapped[i].slot.request;
+
+            if (request.cancelled->load(std::memory_order_relaxed))
+                drop_swapped(i, StopCancelled);
+            else if (request.deadline.hasExpired())
+                drop_swapped(i, StopDeadline);
+            else
+                ++i;
+        }
+
+        admit();
+
+        for (QLlamaSlot &slot : m_slots)
+        {
+            // Candidates stop when their slot is full rather than shifting.
+            if (!slot.active || slot.group)
+                continue;
+
+            if (!slot.prefilling() && !make_room(slot))
+                continue;
+
+            if (m_params.grp_attn_n > 1)
+                extend(slot);
+        }
+
+        speculate();
+        build_batch();
+
+        if (m_batch.n_tokens == 0)
+        {
+            schedule();
+            return;
+        }
+
+        qint32 n_prompt = 0;
+        for (const QLlamaSlot &slot : m_slots)
+            if (slot.active && slot.prefilling()) n_prompt += slot.n_batch;
+
+        m_abort_watch.clear();
+        for (const QLlamaSlot &slot : m_slots)
+            if (slot.active && slot.n_batch > 0) m_abort_watch.push_back({slot.request.cancelled, slot.request.deadline});
+
+        m_decode_aborted.store(false, std::memory_order_relaxed);
+
+        QElapsedTimer t_decode;
+        t_decode.start();
+
+        const int32_t ret = llama_decode(m_ctx, m_batch);
+
+        // Whatever llama_decode returns, logits of an aborted graph are not to be sampled from.
+        if (m_decode_aborted.load(std::memory_order_relaxed))
+        {
+            abandon_batch();
+            schedule();
+            return;
+        }
+
+        if (ret != 0)
+        {
+            LOG_TEE("%s: llama_decode failed for a batch of %d tokens\n", __func__, m_batch.n_tokens);
+
+            for (QLlamaSlot &slot : m_slots)
+            {
+                if (!slot.active || slot.n_batch == 0)
+                    continue;
+
+                slot.group ? finish_group(*slot.group, StopError) : finish(slot, StopError);
+            }
+
+            schedule();
+            return;
+        }
+
+        const qint64 t_decode_us = t_decode.nsecsElapsed() / 1000;
+
+        m_metrics.decoded(n_prompt, m_batch.n_tokens - n_prompt, t_decode_us);
+
+        if (n_prompt > 0 && m_batch_controller.observe(n_prompt, m_batch.n_tokens, t_decode_us))
+        {
+            m_metrics.batch_adjusted();
+            m_metrics.set_batching(m_batch_controller.chunk(), llama_n_ubatch(m_ctx));
+            LOG("%s: %d prompt tokens per decode\n", __func__, m_batch_controller.chunk());
+        }
+
+        m_metrics.set_kv_cells(llama_get_kv_cache_used_cells(m_ctx), llama_n_ctx(m_ctx));
+
+        for (QLlamaSlot &slot : m_slots)
+        {
+            if (!slot.active || slot.n_batch == 0)
+                continue;
+
+            if (slot.prefilling())
+            {
+                slot.cache_tokens.insert(slot.cache_tokens.end(), slot.prompt.begin() + slot.n_prompt_done, slot.prompt.begin() + slot.n_prompt_done + slot.n_batch);
+                slot.n_prompt_done += slot.n_batch;
+                slot.n_past += slot.n_batch;
+
+                // A whole prompt is what later prompts are likely to start with.
+                if (!slot.prefilling() && slot.ga_i == 0)
+                    m_prefixes.insert(slot.id, slot.cache_tokens);
+            }
+            else if (!slot.draft.empty())
+            {
+                verify(slot);
+                continue;
+            }
+            else
+            {
+                slot.cache_tokens.push_back(slot.last);
+                ++slot.n_past;
+            }
+
+            // Still prefilling: nothing to sample yet. Candidates are picked per group below.
+            if (slot.i_batch < 0 || slot.group)
+                continue;
+
+            // Like the CLI, the first prompt that was not fully served from the cache is saved.
+            if (slot.n_decoded == 0 && !m_prompt_cache_saved && slot.n_reused < slot.prompt.size() - 1)
+                save_prompt_cache(slot);
+
+            sample(slot);
+        }
+
+        // finish_group() removes the group from m_groups.
+        for (size_t i = 0; i < m_groups.size();)
+        {
+            QLlamaGroup &group = *m_groups[i];
+
+            if (group.members[0]->prefilling() || group_step(group))
+                ++i;
+        }
+
+        schedule();
+    }
+
+    // Called by ggml between graph nodes of every ubatch, on one of the compute threads. The
+    // batch is given up as soon as any request in it is cancelled or runs past its deadline;
+    // the others decode their part again with the next step.
+    static bool abort_decode(void *data)
+    {
+        QLlamaWorker *worker = static_cast<QLlamaWorker *>(data);
+
+        if (worker->m_decode_aborted.load(std::memory_order_relaxed))
+            return true;
+
+        for (const QLlamaAbortWatch &watch : worker->m_abort_watch)
+        {
+            if (watch.cancelled->load(std::memory_order_relaxed) || watch.deadline.hasExpired())
+            {
+                worker->m_decode_aborted.store(true, std::memory_order_relaxed);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // After an aborted decode: drops the cells the batch may have filled, stops the requests that
+    // caused it with what they have produced so far, and leaves the others to go again.
+    void abandon_batch()
+    {
+        m_metrics.aborted();
+        LOG("%s: decode of %d tokens aborted\n", __func__, m_batch.n_tokens);
+
+        for (QLlamaSlot &slot : m_slots)
+            if (slot.active && slot.n_batch > 0) llama_kv_cache_seq_rm(m_ctx, slot.id, slot.n_past, -1);
+
+        for (QLlamaSlot &slot : m_slots)
+        {
+            if (!slot.active || slot.n_batch == 0)
+                continue;
+
+            StopReason reason;
+
+            if (slot.request.cancelled->load(std::memory_order_relaxed))
+                reason = StopCancelled;
+            else if (slot.request.deadline.hasExpired())
+                reason = StopDeadline;
+            else
+                continue;
+
+            slot.group ? finish_group(*slot.group, reason) : finish(slot, reason);
+        }
+
+        m_metrics.set_kv_cells(llama_get_kv_cache_used_cells(m_ctx), llama_n_ctx(m_ctx));
+    }
+
+    // Copies what the log needs; formatting and I/O happen on the writer's thread.
+    void log_run(const QLlamaSlot &slot, StopReason reason)
+    {
+        static const char *const reasons[] = {"eog", "length", "cancelled", "deadline", "error"};
+
+        QLlamaRunRecord record;
+        record.timestamp = string_get_sortable_timestamp();
+        record.stop_reason = reasons[reason];
+        record.sparams = slot.request.sparams;
+        record.input_tokens = slot.prompt;
+        record.output_tokens = slot.generated;
+        record.output = slot.output;
+        record.n_reused = slot.n_reused;
+        record.t_prompt_us = slot.t_prompt_us;
+        record.t_eval_us = slot.t_start.nsecsElapsed() / 1000 - slot.t_prompt_us;
+
+        m_log_writer->enqueue(std::move(record));
+    }
+
+    void save_prompt_cache(QLlamaSlot &slot)
+    {
+        // The file stores tokens, not positions; a self-extended sequence cannot be restored from it.
+        if (m_params.path_prompt_cache.empty() || m_params.prompt_cache_ro || slot.ga_i > 0)
+            return;
+
+        if (QLlamaPromptCache::save(m_ctx, slot.id, m_params, slot.cache_tokens))
+            m_prompt_cache_saved = true;
+    }
+
+    // Samples from the logits at i_batch and records the token; false once the slot has finished.
+    bool sample(QLlamaSlot &slot, qint32 i_batch = -1)
+    {
+        const llama_token id = llama_sampling_sample(slot.ctx_sampling, m_ctx, nullptr, i_batch < 0 ? slot.i_batch : i_batch);
+        llama_sampling_accept(slot.ctx_sampling, m_ctx, id, true);
+
+        const qint64 t_us = slot.t_start.nsecsElapsed() / 1000;
+
+        if (++slot.n_decoded == 1)
+        {
+            slot.t_prompt_us = t_us;
+            m_metrics.first_token(slot.request.t_queued.nsecsElapsed() / 1e6);
+        }
+        else
+        {
+            m_metrics.next_token((t_us - slot.t_last_token_us) / 1000.0);
+        }
+
+        slot.t_last_token_us = t_us;
+        m_metrics.generated();
+
+        slot.last = id;
+        slot.generated.push_back(id);
+        slot.last_used = ++m_tick;
+
+        if (llama_token_is_eog(m_model, id))
+        {
+            finish(slot, StopEog);
+            return false;
+        }
+
+        if (!slot.lookup_tokens.empty())
+        {
+            slot.lookup_tokens.push_back(id);
+            llama_ngram_cache_update(slot.nc_context, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.lookup_tokens, 1, false);
+        }
+
+        const QString text = slot.detokenizer.push(::llama_token_to_piece(m_ctx, id, m_params.special));
+        slot.pending_tokens.append(id);
+        slot.pending_text += text;
+        slot.output += text;
+
+        // The first token goes out on its own so time-to-first-token is not hidden by batching;
+        // after that, tokens are batched up to n_flush_tokens or the flush interval.
+        if (slot.n_decoded == 1 ||
+            slot.pending_tokens.size() >= m_n_flush_tokens.load(std::memory_order_relaxed) ||
+            slot.last_flush.hasExpired(m_flush_interval_ms.load(std::memory_order_relaxed)))
+        {
+            flush(slot);
+        }
+
+        // A full context is dealt with by make_room() before the next decode.
+        if (slot.request.n_predict >= 0 && slot.n_decoded >= slot.request.n_predict)
+        {
+            finish(slot, StopLength);
+            return false;
+        }
+
+        return true;
+    }
+
+    void speculate()
+    {
+        if (m_params.n_draft <= 0)
+            return;
+
+        if (m_ctx_draft)
+            draft_with_model();
+        else if (m_lookup.load(std::memory_order_relaxed))
+            draft_with_lookup();
+    }
+
+    // How many tokens may be drafted for a generating slot: last and every draft token take a
+    // cell and may all be emitted.
+    qint32 max_draft(const QLlamaSlot &slot) const
+    {
+        qint32 n_draft = std::min({m_params.n_draft, m_n_batch - 1, m_n_ctx_slot - (qint32) slot.cache_tokens.size() - 2});
+        if (slot.request.n_predict >= 0)
+            n_draft = std::min(n_draft, slot.request.n_predict - slot.n_decoded - 1);
+
+        return n_draft;
+    }
+
+    // Drafts a continuation for a slot that is generating alone. With other slots in the
+    // batch the target already runs at a useful batch size and a draft model only adds work.
+    void draft_with_model()
+    {
+        QLlamaSlot *single = nullptr;
+
+        for (QLlamaSlot &slot : m_slots)
+        {
+            if (!slot.active)
+                continue;
+
+            if (single || slot.prefilling() || slot.group)
+                return;
+
+            single = &slot;
+        }
+
+        if (!single)
+            return;
+
+        QLlamaSlot &slot = *single;
+        const qint32 n_draft = max_draft(slot);
+
+        if (n_draft <= 0 || !sync_draft(slot.cache_tokens))
+            return;
+
+        const qint32 n_vocab = llama_n_vocab(llama_get_model(m_ctx_draft));
+        llama_token id = slot.last;
+
+        for (qint32 i = 0; i < n_draft; ++i)
+        {
+            llama_batch_clear(m_batch_draft);
+            llama_batch_add(m_batch_draft, id, m_draft_tokens.size(), { 0 }, true);
+
+            if (llama_decode(m_ctx_draft, m_batch_draft) != 0)
+                break;
+
+            m_draft_tokens.push_back(id);
+
+            // Greedy draft; stop as soon as the draft model is unsure of its own guess.
+            const float *logits = llama_get_logits_ith(m_ctx_draft, 0);
+            const llama_token best = std::max_element(logits, logits + n_vocab) - logits;
+
+            float sum = 0.0f;
+            for (qint32 t = 0; t < n_vocab; ++t)
+                sum += expf(logits[t] - logits[best]);
+
+            if (1.0f / sum < m_params.p_split)
+                break;
+
+            id = best;
+            slot.draft.push_back(id);
+
+            if (llama_token_is_eog(m_model, id))
+                break;
+        }
+
+        m_n_drafted.fetch_add(slot.draft.size(), std::memory_order_relaxed);
+    }
+
+    // Drafts for every generating slot from the n-gram caches; drafts cost no decode of their
+    // own, only room in the batch, which is shared out in slot order.
+    void draft_with_lookup()
+    {
+        qint32 n_budget = m_n_batch;
+
+        for (const QLlamaSlot &slot : m_slots)
+            if (slot.active && !slot.prefilling()) --n_budget;
+
+        for (QLlamaSlot &slot : m_slots)
+        {
+            if (!slot.active || slot.prefilling() || slot.group || slot.lookup_tokens.empty())
+                continue;
+
+            const qint32 n_draft = std::min(max_draft(slot), n_budget);
+
+            if (n_draft <= 0)
+                continue;
+
+            // The draft starts with the last sampled token, which lookup_tokens ends with.
+            std::vector<llama_token> draft = { slot.last };
+            llama_ngram_cache_draft(slot.lookup_tokens, draft, n_draft, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.nc_context, m_nc_dynamic, m_nc_static);
+
+            slot.draft.assign(draft.begin() + 1, draft.end());
+            n_budget -= slot.draft.size();
+
+            m_n_drafted.fetch_add(slot.draft.size(), std::memory_order_relaxed);
+        }
+    }
+
+    // Brings the slot's n-gram cache up to its new prompt. A prompt that extends the tokens
+    // seen so far, like the next turn of a chat, only adds the n-grams of the new tokens.
+    void lookup_prompt(QLlamaSlot &slot)
+    {
+        if (slot.lookup_tokens.empty() || common_prefix(slot.lookup_tokens, slot.prompt) < slot.lookup_tokens.size())
+        {
+            slot.lookup_tokens.clear();
+            slot.nc_context.clear();
+            slot.n_lookup_dynamic = 0;
+        }
+
+        const size_t n_new = slot.prompt.size() - slot.lookup_tokens.size();
+
+        slot.lookup_tokens.insert(slot.lookup_tokens.end(), slot.prompt.end() - n_new, slot.prompt.end());
+        llama_ngram_cache_update(slot.nc_context, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.lookup_tokens, n_new, false);
+    }
+
+    void load_lookup_caches()
+    {
+        try
+        {
+            if (!m_params.lookup_cache_static.empty())
+            {
+                std::string path = m_params.lookup_cache_static;
+                m_nc_static = llama_ngram_cache_load(path);
+            }
+        }
+        catch (const std::exception &)
+        {
+            LOG_TEE("%s: failed to open static lookup cache %s\n", __func__, m_params.lookup_cache_static.c_str());
+        }
+
+        try
+        {
+            // Missing on first use; it is written when the worker goes away.
+            if (!m_params.lookup_cache_dynamic.empty())
+            {
+                std::string path = m_params.lookup_cache_dynamic;
+                m_nc_dynamic = llama_ngram_cache_load(path);
+            }
+        }
+        catch (const std::exception &) {}
+    }
+
+    // Makes sequence 0 of the draft context hold tokens, reusing their common prefix.
+    bool sync_draft(const std::vector<llama_token> &tokens)
+    {
+        const size_t n_keep = common_prefix(m_draft_tokens, tokens);
+
+        llama_kv_cache_seq_rm(m_ctx_draft, 0, n_keep, -1);
+        m_draft_tokens.resize(n_keep);
+
+        const size_t n_batch = llama_n_batch(m_ctx_draft);
+
+        while (m_draft_tokens.size() < tokens.size())
+        {
+            const size_t n_chunk = std::min(tokens.size() - m_draft_tokens.size(), n_batch);
+
+            llama_batch_clear(m_batch_draft);
+            for (size_t i = 0; i < n_chunk; ++i)
+            {
+                const size_t pos = m_draft_tokens.size() + i;
+                llama_batch_add(m_batch_draft, tokens[pos], pos, { 0 }, false);
+            }
+
+            if (llama_decode(m_ctx_draft, m_batch_draft) != 0)
+            {
+                LOG_TEE("%s: llama_decode failed on the draft context\n", __func__);
+                llama_kv_cache_seq_rm(m_ctx_draft, 0, -1, -1);
+                m_draft_tokens.clear();
+                return false;
+            }
+
+            m_draft_tokens.insert(m_draft_tokens.end(), tokens.begin() + m_draft_tokens.size(), tokens.begin() + m_draft_tokens.size() + n_chunk);
+        }
+
+        return true;
+    }
+
+    // Starts an n-best or beam request in leader and enough other idle slots, or returns false
+    // if there are not enough of them. Idle slots without a session are taken first; then the
+    // least recently used sessions give up theirs.
+    bool begin_group(QLlamaSlot &leader, const QLlamaRequest &request, std::vector<llama_token> &&prompt, qint32 n_discard)
+    {
+        std::vector<QLlamaSlot *> followers;
+
+        for (QLlamaSlot &slot : m_slots)
+            if (!slot.active && &slot != &leader) followers.push_back(&slot);
+
+        if ((qint32) followers.size() < request.n_candidates - 1)
+            return false;
+
+        std::sort(followers.begin(), followers.end(), [](const QLlamaSlot *a, const QLlamaSlot *b) {
+            return !a->session != !b->session ? !a->session : a->last_used < b->last_used;
+        });
+        followers.resize(request.n_candidates - 1);
+
+        begin(leader, request, std::move(prompt), n_discard);
+
+        auto group = std::make_unique<QLlamaGroup>();
+        group->request = request;
+        group->members.push_back(&leader);
+        group->members.insert(group->members.end(), followers.begin(), followers.end());
+        group->beams.resize(group->members.size());
+
+        for (QLlamaSlot *slot : group->members)
+        {
+            if (slot != &leader)
+                evict(*slot);
+
+            slot->request = request;
+            slot->active = true;
+            slot->group = group.get();
+            slot->last = -1;
+            slot->last_used = ++m_tick;
+        }
+
+        m_groups.push_back(std::move(group));
+
+        return true;
+    }
+
+    // Picks the next token of every candidate from the batch just decoded. Returns false once
+    // the group has finished.
+    bool group_step(QLlamaGroup &group)
+    {
+        const bool first = !group.fanned_out;
+
+        if (first)
+            fan_out(group);
+
+        if (group.request.beam)
+            beam_step(group, first);
+        else
+            nbest_step(group, first);
+
+        const bool done = std::all_of(group.beams.begin(), group.beams.end(), [](const QLlamaBeam &beam) { return beam.done; });
+
+        if (done)
+            finish_group(group, StopEog);
+
+        return !done;
+    }
+
+    // The prompt is in the leader's sequence; every other member gets its cells with
+    // llama_kv_cache_seq_cp and a sampler of its own, and samples from the leader's logits.
+    void fan_out(QLlamaGroup &group)
+    {
+        QLlamaSlot &leader = *group.members[0];
+        leader.t_prompt_us = leader.t_start.nsecsElapsed() / 1000;
+        m_metrics.first_token(group.request.t_queued.nsecsElapsed() / 1e6);
+
+        for (size_t i = 1; i < group.members.size(); ++i)
+        {
+            QLlamaSlot &member = *group.members[i];
+
+            copy_sequence(leader, member);
+            member.i_batch = leader.i_batch;
+        }
+
+        group.fanned_out = true;
+    }
+
+    // Makes dst a copy of src: the same KV cells, tokens and sampler state.
+    void copy_sequence(const QLlamaSlot &src, QLlamaSlot &dst)
+    {
+        llama_kv_cache_seq_rm(m_ctx, dst.id, -1, -1);
+        llama_kv_cache_seq_cp(m_ctx, src.id, dst.id, -1, -1);
+
+        dst.cache_tokens = src.cache_tokens;
+        dst.n_past = src.n_past;
+        dst.ga_i = src.ga_i;
+
+        if (dst.ga_i == 0)
+            m_prefixes.insert(dst.id, dst.cache_tokens);
+        else
+            m_prefixes.remove(dst.id);
+
+        if (!dst.ctx_sampling)
+            dst.ctx_sampling = llama_sampling_init(src.ctx_sampling->params);
+
+        llama_sampling_cp(src.ctx_sampling, dst.ctx_sampling);
+    }
+
+    // Samples every live candidate from its row of logits. llama_sampling_sample adds the
+    // logit bias to the row in place, so the row is kept as decoded: right after the fan-out
+    // all members sample from the leader's row, and each of them starts from the original.
+    void nbest_step(QLlamaGroup &group, bool first)
+    {
+        const qint32 n_vocab = llama_n_vocab(m_model);
+        std::vector<float> raw;
+
+        for (size_t i = 0; i < group.members.size(); ++i)
+        {
+            QLlamaSlot &member = *group.members[i];
+
+            if (group.beams[i].done)
+                continue;
+
+            float *logits = llama_get_logits_ith(m_ctx, member.i_batch);
+
+            if (first && !raw.empty())
+                std::copy(raw.begin(), raw.end(), logits);
+            else
+                raw.assign(logits, logits + n_vocab);
+
+            const llama_token id = llama_sampling_sample(member.ctx_sampling, m_ctx, nullptr, member.i_batch);
+            llama_sampling_accept(member.ctx_sampling, m_ctx, id, true);
+
+            group.beams[i].logprob += token_logprob(raw.data(), n_vocab, id);
+            advance(group, i, id);
+        }
+    }
+
+    // Expands every live beam by its n_candidates most likely tokens, after penalties and the
+    // grammar, and keeps the n_candidates best of those and of the finished beams. A member
+    // keeps its sequence for the first survivor that extends it; further survivors of the
+    // same beam are copied into members whose beam was dropped. Copies only ever come from
+    // members that keep their beam, so they are made before any token is accepted.
+    void beam_step(QLlamaGroup &group, bool first)
+    {
+        struct QLlamaExpansion
+        {
+            size_t parent                           {0};
+            llama_token id                          {-1}; // -1: the finished beam itself
+            double logprob                          {0.0};
+        };
+
+        const size_t n_beams = group.members.size();
+        std::vector<QLlamaExpansion> expansions;
+
+        for (size_t i = 0; i < n_beams; ++i)
+        {
+            const QLlamaBeam &beam = group.beams[i];
+
+            if (beam.done)
+            {
+                if (std::isfinite(beam.logprob))
+                    expansions.push_back({i, -1, beam.logprob});
+
+                continue;
+            }
+
+            // Right after the fan-out all beams are the same.
+            if (first && i > 0)
+                continue;
+
+            QLlamaSlot &member = *group.members[i];
+            llama_token_data_array cur_p = llama_sampling_prepare(member.ctx_sampling, m_ctx, nullptr, member.i_batch);
+            llama_sample_softmax(m_ctx, &cur_p);
+
+            for (size_t k = 0; k < std::min(cur_p.size, n_beams) && cur_p.data[k].p > 0.0f; ++k)
+                expansions.push_back({i, cur_p.data[k].id, beam.logprob + std::log(cur_p.data[k].p)});
+        }
+
+        const size_t n_kept = std::min(expansions.size(), n_beams);
+        std::partial_sort(expansions.begin(), expansions.begin() + n_kept, expansions.end(),
+                          [](const QLlamaExpansion &a, const QLlamaExpansion &b) { return a.logprob > b.logprob; });
+        expansions.resize(n_kept);
+
+        std::vector<qint32> target(n_kept, -1);
+        std::vector<bool> taken(n_beams, false);
+
+        for (size_t j = 0; j < n_kept; ++j)
+        {
+            if (!taken[expansions[j].parent])
+            {
+                taken[expansions[j].parent] = true;
+                target[j] = expansions[j].parent;
+            }
+        }
+
+        size_t free = 0;
+        for (size_t j = 0; j < n_kept; ++j)
+        {
+            if (target[j] >= 0)
+                continue;
+
+            while (taken[free]) ++free;
+            taken[free] = true;
+            target[j] = free;
+
+            copy_sequence(*group.members[expansions[j].parent], *group.members[free]);
+        }
+
+        // Members left over (a grammar that allows fewer tokens than beams) hold no beam.
+        std::vector<QLlamaBeam> beams(n_beams, QLlamaBeam{{}, -INFINITY, true, StopEog});
+
+        for (size_t j = 0; j < n_kept; ++j)
+            beams[target[j]] = group.beams[expansions[j].parent];
+
+        group.beams = std::move(beams);
+
+        for (size_t i = 0; i < n_beams; ++i)
+            if (group.beams[i].done) group.members[i]->last = -1;
+
+        for (size_t j = 0; j < n_kept; ++j)
+        {
+            const QLlamaExpansion &expansion = expansions[j];
+
+            if (expansion.id < 0)
+                continue;
+
+            llama_sampling_accept(group.members[target[j]]->ctx_sampling, m_ctx, expansion.id, true);
+
+            group.beams[target[j]].logprob = expansion.logprob;
+            advance(group, target[j], expansion.id);
+        }
+    }
+
+    // Appends id to candidate i, or ends it.
+    void advance(QLlamaGroup &group, size_t i, llama_token id)
+    {
+        QLlamaSlot &member = *group.members[i];
+        QLlamaBeam &beam = group.beams[i];
+
+        member.last = id;
+        member.last_used = ++m_tick;
+        m_metrics.generated();
+
+        if (llama_token_is_eog(m_model, id))
+        {
+            beam.done = true;
+            beam.reason = StopEog;
+        }
+        else
+        {
+            beam.tokens.push_back(id);
+
+            if ((group.request.n_predict >= 0 && (qint32) beam.tokens.size() >= group.request.n_predict) ||
+                (qint32) member.cache_tokens.size() + 1 >= m_n_ctx_slot)
+            {
+                beam.done = true;
+                beam.reason = StopLength;
+            }
+        }
+
+        if (beam.done)
+            member.last = -1;
+    }
+
+    // Log-probability of id under the model's own distribution, before any sampling parameter.
+    static double token_logprob(const float *logits, qint32 n_vocab, llama_token id)
+    {
+        const float max = *std::max_element(logits, logits + n_vocab);
+
+        double sum = 0.0;
+        for (qint32 t = 0; t < n_vocab; ++t)
+            sum += std::exp(logits[t] - max);
+
+        return logits[id] - max - std::log(sum);
+    }
+
+    void finish_group(QLlamaGroup &group, StopReason reason)
+    {
+        QList<QLlamaCandidate> candidates;
+        StopReason best_reason = reason;
+        double best = -INFINITY;
+
+        for (const QLlamaBeam &beam : group.beams)
+        {
+            // Nothing was generated before the fan-out; after it, members may hold no beam.
+            if (!group.fanned_out || !std::isfinite(beam.logprob))
+                continue;
+
+            QLlamaCandidate candidate;
+            candidate.text = QString::fromStdString(::llama_detokenize(m_ctx, beam.tokens, m_params.special));
+            candidate.tokens = QList<llama_token>(beam.tokens.begin(), beam.tokens.end());
+            candidate.logprob = beam.logprob;
+            candidates.append(candidate);
+
+            if (beam.logprob > best)
+            {
+                best = beam.logprob;
+                best_reason = beam.reason;
+            }
+        }
+
+        std::sort(candidates.begin(), candidates.end(), [](const QLlamaCandidate &a, const QLlamaCandidate &b) { return a.logprob > b.logprob; });
+
+        // Only a group that ran to its end reports the reason of its best candidate.
+        if (reason == StopEog)
+            reason = best_reason;
+
+        m_metrics.finished();
+
+        if (reason != StopError)
+            emit candidatesReady(group.request.id, candidates);
+
+        emit generationFinished(group.request.id, reason, reason == StopError || candidates.isEmpty() ? QString() : candidates.first().text);
+
+        for (QLlamaSlot *member : group.members)
+        {
+            member->active = false;
+            member->group = nullptr;
+            member->last = -1;
+            member->i_batch = -1;
+            member->n_batch = 0;
+            member->prompt.clear();
+            member->n_prompt_done = 0;
+
+            // A failed decode leaves the sequence in an unknown state.
+            if (reason == StopError)
+                release(*member);
+        }
+
+        m_groups.erase(std::find_if(m_groups.begin(), m_groups.end(), [&group](const std::unique_ptr<QLlamaGroup> &g) { return g.get() == &group; }));
+    }
+
+    // Samples the target after last and after every draft token in turn; a draft token is
+    // accepted while it matches what the target sampled before it. Every emitted token is a
+    // target sample, so the output is distributed as without speculation.
+    void verify(QLlamaSlot &slot)
+    {
+        const std::vector<llama_token> draft = std::move(slot.draft);
+        slot.draft.clear();
+
+        slot.cache_tokens.push_back(slot.last);
+        ++slot.n_past;
+
+        size_t n_accepted = 0;
+
+        // cache_tokens and n_past only ever cover accepted tokens, so a sample() that finishes
+        // the slot drops the cells of the rest of the draft along with the sampled token.
+        for (size_t i = 0; i <= draft.size(); ++i)
+        {
+            if (!sample(slot, slot.i_batch + i))
+                break;
+
+            if (i == draft.size() || slot.last != draft[i])
+                break;
+
+            slot.cache_tokens.push_back(draft[i]);
+            ++slot.n_past;
+            ++n_accepted;
+        }
+
+        m_n_accepted.fetch_add(n_accepted, std::memory_order_relaxed);
+
+        // Drop the cells of the rejected draft tokens.
+        llama_kv_cache_seq_rm(m_ctx, slot.id, slot.n_past, -1);
+    }
+};
+
+#endif // QLLAMAWORKER_HPP
@@ -0,0 +1,17 @@
+# Headless batch inference: no widgets, no display needed.
+QT       = core
+
+CONFIG += console
+CONFIG -= app_bundle
+
+TARGET = QLlamaBatch
+
+include(../QLlamaCommon.pri)
+
+SOURCES += \
+    main.cpp
+
+# Default rules for deployment.
+qnx: target.path = /tmp/$${TARGET}/bin
+else: unix:!android: target.path = /opt/$${TARGET}/bin
+!isEmpty(target.path): INSTALLS += target
@@ -0,0 +1,50 @@
+#include "QLlamaBatch.hpp"
+#include "QLlamaInference.hpp"
+
+#include <QCoreApplication>
+
+#include <algorithm>
+#include <cstdio>
+
+int main(int argc, char *argv[])
+{
+    const bool autotune_threads = QLlamaThreadTuner::take_flag(argc, argv);
+
+    QCoreApplication a(argc, argv);
+
+    gpt_params params;
+
+    if (!gpt_params_parse(argc, argv, params) || params.prompt_file.empty())
+    {
+        fprintf(stderr, "usage: %s -m model.gguf -f prompts.jsonl [-o results.jsonl] [-np n_parallel] [--autotune-threads] [other llama.cpp options]\n", argv[0]);
+        return 1;
+    }
+
+    // -f read the whole file into prompt; the runner streams it instead.
+    params.prompt.clear();
+
+    const QString input = QString::fromStdString(params.prompt_file);
+    const QString output = params.out_file == gpt_params().out_file ? input + ".out.jsonl" : QString::fromStdString(params.out_file);
+
+    QLlamaInference inference(&params);
+    inference.set_autotune_threads(autotune_threads);
+
+    try
+    {
+        inference.load();
+    }
+    catch (const QLlamaExceptions::QModelLoadError &e)
+    {
+        fprintf(stderr, "%s", e.what());
+        return 1;
+    }
+
+    // Twice the slots, so a slot that finishes finds the next prompt already tokenized.
+    QLlamaBatchRunner runner(&inference, input, output, 2 * std::max(params.n_parallel, 1));
+    QObject::connect(&runner, &QLlamaBatchRunner::finished, &a, &QCoreApplication::exit, Qt::QueuedConnection);
+
+    if (!runner.start())
+        return 1;
+
+    return a.exec();
+}
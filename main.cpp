@@ -1,9 +1,66 @@
 #include "mainwindow.h"
 
+#include "QLlamaInference.hpp"
+#include "QLlamaServer.hpp"
+
 #include <QApplication>
+#include <QCoreApplication>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// Serves the model over HTTP without a window; the remaining arguments are llama.cpp options.
+static int serve(int argc, char *argv[])
+{
+    const bool autotune_threads = QLlamaThreadTuner::take_flag(argc, argv);
+
+    QCoreApplication a(argc, argv);
+
+    gpt_params params;
+
+    if (!gpt_params_parse(argc, argv, params))
+    {
+        fprintf(stderr, "usage: %s --server -m model.gguf [--host 127.0.0.1] [--port 8080] [-np n_parallel] [--api-key key] [--autotune-threads] [other llama.cpp options]\n", argv[0]);
+        return 1;
+    }
+
+    QLlamaInference inference(&params);
+    inference.set_autotune_threads(autotune_threads);
+    QLlamaServer server(&inference);
+
+    // Listen right away, so clients can poll /health while the weights load.
+    if (!server.listen())
+        return 1;
+
+    QObject::connect(&inference, &QLlamaInference::loadFinished, &a, [](bool success) {
+        if (!success)
+        {
+            fprintf(stderr, "failed to load the model\n");
+            QCoreApplication::exit(1);
+        }
+    });
+
+    inference.loadAsync();
+
+    return a.exec();
+}
 
 int main(int argc, char *argv[])
 {
+    std::vector<char *> args(argv, argv + argc);
+    const auto server = std::find_if(args.begin(), args.end(), [](const char *arg) { return strcmp(arg, "--server") == 0; });
+
+    if (server != args.end())
+    {
+        args.erase(server);
+        int n_args = args.size();
+        args.push_back(nullptr);
+
+        return serve(n_args, args.data());
+    }
+
     QApplication a(argc, argv);
     MainWindow w;
     w.show();
@@ -1,14 +1,40 @@
 #include "mainwindow.h"
 #include "ui_mainwindow.h"
 
+#include "QLlamaDetokenizer.hpp"
+#include "QLlamaInference.hpp"
+#include "QLlamaTranscript.hpp"
+
+#include <QVBoxLayout>
+
 MainWindow::MainWindow(QWidget *parent)
     : QMainWindow(parent)
     , ui(new Ui::MainWindow)
+    , m_transcript(new QLlamaTranscriptModel(this))
+    , m_stream_buffer(new QLlamaStreamBuffer(this))
 {
     ui->setupUi(this);
+
+    m_transcript_view = new QLlamaTranscriptView(ui->centralwidget);
+    m_transcript_view->setModel(m_transcript);
+
+    QVBoxLayout *layout = new QVBoxLayout(ui->centralwidget);
+    layout->setContentsMargins(0, 0, 0, 0);
+    layout->addWidget(m_transcript_view);
+
+    connect(m_stream_buffer, &QLlamaStreamBuffer::textReady, m_transcript, &QLlamaTranscriptModel::appendText);
 }
 
 MainWindow::~MainWindow()
 {
     delete ui;
 }
+
+void MainWindow::attach(QLlamaInference *inference)
+{
+    connect(inference, &QLlamaInference::tokensGenerated, m_stream_buffer, &QLlamaStreamBuffer::append);
+    connect(inference, &QLlamaInference::generationFinished, this, [this](quint64 id) {
+        m_stream_buffer->flush(id);
+        m_transcript->finishMessage(id);
+    });
+}
@@ -3,6 +3,11 @@
 
 #include <QMainWindow>
 
+class QLlamaInference;
+class QLlamaStreamBuffer;
+class QLlamaTranscriptModel;
+class QLlamaTranscriptView;
+
 QT_BEGIN_NAMESPACE
 namespace Ui {
 class MainWindow;
@@ -17,7 +22,17 @@ public:
     MainWindow(QWidget *parent = nullptr);
     ~MainWindow();
 
+    QLlamaTranscriptModel *transcript() const { return m_transcript; }
+
+    // Streams the text generated by inference into the transcript. Requests show up once a
+    // message was added for them with QLlamaTranscriptModel::appendMessage(role, text, id).
+    void attach(QLlamaInference *inference);
+
 private:
     Ui::MainWindow *ui;
+
+    QLlamaTranscriptModel *m_transcript;
+    QLlamaTranscriptView *m_transcript_view;
+    QLlamaStreamBuffer *m_stream_buffer;
 };
 #endif // MAINWINDOW_H
@@ -0,0 +1,12 @@
+# Engine tests. They need a GGUF model: set QLLAMA_TEST_MODEL to its path, or they are skipped.
+QT       = core testlib
+
+CONFIG += console testcase
+CONFIG -= app_bundle
+
+TARGET = QLlamaTests
+
+include(../QLlamaCommon.pri)
+
+SOURCES += \
+    tst_qllamaworker.cpp
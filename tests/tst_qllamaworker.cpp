@@ -0,0 +1,193 @@
+#include "QLlamaInference.hpp"
+#include "QLlamaPromptCache.hpp"
+
+#include <QSignalSpy>
+#include <QTemporaryDir>
+#include <QTest>
+
+#include <chrono>
+#include <cmath>
+#include <thread>
+
+// Runs against the model in QLLAMA_TEST_MODEL; any small GGUF model will do.
+class TestQLlamaWorker : public QObject
+{
+    Q_OBJECT
+
+private:
+    QTemporaryDir m_dir;
+
+    static QString model_path() { return qEnvironmentVariable("QLLAMA_TEST_MODEL"); }
+
+    gpt_params base_params() const
+    {
+        gpt_params params;
+        params.model = model_path().toStdString();
+        params.n_ctx = 4096;
+        params.n_batch = 2048;
+        params.n_parallel = 1;
+        params.seed = 1;
+        params.warmup = false;
+
+        return params;
+    }
+
+    // Waits for request id to finish and returns its stop reason.
+    static QLlamaWorker::StopReason wait_finished(QSignalSpy &spy, quint64 id)
+    {
+        for (;;)
+        {
+            for (const QList<QVariant> &args : std::as_const(spy))
+                if (args.at(0).toULongLong() == id) return args.at(1).value<QLlamaWorker::StopReason>();
+
+            if (!spy.wait(60000))
+                return QLlamaWorker::StopError;
+        }
+    }
+
+private slots:
+    void initTestCase()
+    {
+        if (model_path().isEmpty())
+            QSKIP("QLLAMA_TEST_MODEL is not set");
+
+        QVERIFY(m_dir.isValid());
+    }
+
+    // A request that stops in the middle of a draft must not save the cells of the draft
+    // tokens it rejected: the prompt cache has to hold exactly as many cells as tokens.
+    void promptCacheAfterRejectedDraft()
+    {
+        gpt_params params = base_params();
+        params.model_draft = params.model;
+        params.n_draft = 8;
+        params.p_split = 0.0f;
+        params.path_prompt_cache = m_dir.filePath("rejected.bin").toStdString();
+        params.prompt_cache_all = true;
+
+        // A hot sampler rejects the greedy draft often.
+        params.sparams.temp = 1.5f;
+        params.sparams.top_k = 0;
+        params.sparams.top_p = 1.0f;
+        params.sparams.min_p = 0.0f;
+
+        QLlamaInference inference(&params);
+        inference.set_adaptive_batch(false);
+        inference.load();
+
+        QSignalSpy finished(&inference, &QLlamaInference::generationFinished);
+
+        std::shared_ptr<llama_model> model = QLlamaModelPool::instance().acquire(params);
+        QVERIFY(model);
+
+        for (qint32 n_predict = 2; n_predict <= 8; ++n_predict)
+        {
+            const quint64 id = inference.generate("Once upon a time, in a land far away,", params.sparams, n_predict);
+            QVERIFY(id);
+            QCOMPARE(wait_finished(finished, id), QLlamaWorker::StopLength);
+
+            llama_context *ctx = llama_new_context_with_model(model.get(), llama_context_params_from_gpt_params(params));
+            QVERIFY(ctx);
+
+            std::vector<llama_token> tokens;
+            const bool loaded = QLlamaPromptCache::load(ctx, 0, params, tokens);
+            const qint32 n_cells = llama_get_kv_cache_used_cells(ctx);
+            llama_free(ctx);
+
+            QVERIFY(loaded);
+            QCOMPARE(n_cells, (qint32) tokens.size());
+        }
+
+        const QLlamaDraftStats stats = inference.draftStats();
+        QVERIFY2(stats.n_accepted < stats.n_drafted, "no draft token was rejected, the test proves nothing");
+    }
+
+    // A request cancelled while it shares a batch with a much larger live prompt stops that
+    // decode instead of waiting for the prompt chunk, and the live request still completes.
+    // Needs a model that takes well over 20 ms to decode 2048 tokens.
+    void cancelNextToLargePrompt()
+    {
+        gpt_params params = base_params();
+        params.n_ctx = 8192;
+        params.n_parallel = 2;
+
+        QLlamaInference inference(&params);
+        inference.set_adaptive_batch(false);
+        inference.load();
+
+        QSignalSpy finished(&inference, &QLlamaInference::generationFinished);
+
+        QString prompt;
+        while (prompt.size() < 6000)
+            prompt += "The quick brown fox jumps over the lazy dog. ";
+
+        const quint64 cancelled = inference.generate("Say hello.", params.sparams, 64);
+        const quint64 live = inference.generate(prompt, params.sparams, 4);
+        QVERIFY(cancelled && live);
+
+        std::thread canceller([token = inference.cancelToken(cancelled)]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            token->store(true, std::memory_order_relaxed);
+        });
+
+        const QLlamaWorker::StopReason cancelled_reason = wait_finished(finished, cancelled);
+        const QLlamaWorker::StopReason live_reason = wait_finished(finished, live);
+        canceller.join();
+
+        QCOMPARE(cancelled_reason, QLlamaWorker::StopCancelled);
+        QCOMPARE(live_reason, QLlamaWorker::StopLength);
+        QVERIFY(inference.metrics().n_aborted >= 1);
+    }
+
+    // n-best and beam requests run until every candidate has n_predict tokens; the end of
+    // generation is banned so none of them stops early.
+    void candidatesRunToLength_data()
+    {
+        QTest::addColumn<bool>("beam");
+
+        QTest::newRow("n-best") << false;
+        QTest::newRow("beam") << true;
+    }
+
+    void candidatesRunToLength()
+    {
+        QFETCH(bool, beam);
+
+        constexpr qint32 n_candidates = 3;
+
+        gpt_params params = base_params();
+        params.n_parallel = n_candidates;
+        params.n_predict = 12;
+
+        std::shared_ptr<llama_model> model = QLlamaModelPool::instance().acquire(params);
+        QVERIFY(model);
+
+        for (const llama_token eog : {llama_token_eos(model.get()), llama_token_eot(model.get())})
+            if (eog >= 0) params.sparams.logit_bias[eog] = -INFINITY;
+
+        QLlamaInference inference(&params);
+        inference.set_adaptive_batch(false);
+        inference.load();
+
+        QSignalSpy finished(&inference, &QLlamaInference::generationFinished);
+        QSignalSpy ready(&inference, &QLlamaInference::candidatesReady);
+
+        const quint64 id = inference.generateCandidates("Once upon a time, in a land far away,", n_candidates, beam);
+        QVERIFY(id);
+        QCOMPARE(wait_finished(finished, id), QLlamaWorker::StopLength);
+
+        QCOMPARE(ready.size(), 1);
+        const QList<QLlamaCandidate> candidates = ready.at(0).at(1).value<QList<QLlamaCandidate>>();
+        QCOMPARE(candidates.size(), n_candidates);
+
+        for (const QLlamaCandidate &candidate : candidates)
+        {
+            QCOMPARE((qint32) candidate.tokens.size(), params.n_predict);
+            QVERIFY(std::isfinite(candidate.logprob));
+        }
+    }
+};
+
+QTEST_GUILESS_MAIN(TestQLlamaWorker)
+
+#include "tst_qllamaworker.moc"